@@ -16,6 +16,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,11 +46,25 @@ struct backed_block {
 		} fill;
 	};
 	struct backed_block *next;
+	/* Ordered index, a treap keyed by block */
+	struct backed_block *left;
+	struct backed_block *right;
+	uint32_t priority;
+	bool indexed;
 };
 
 struct backed_block_list {
 	struct backed_block *data_blocks;
-	struct backed_block *last_used;
+	struct backed_block *last;
+	struct backed_block *index;
+	unsigned int index_count;
+	/* Blocks appended after the last one skip the index.  They form a run at
+	 * the end of the list, starting at unindexed, that is added to the index
+	 * the next time it is searched. */
+	struct backed_block *unindexed;
+	unsigned int unindexed_count;
+	pthread_mutex_t index_lock;
+	uint32_t seed;
 	unsigned int block_size;
 };
 
@@ -123,10 +139,205 @@ void backed_block_destroy(struct backed_block *bb)
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
 	struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
+	if (!b) {
+		return NULL;
+	}
 	b->block_size = block_size;
+	b->seed = 0x9e3779b9;
+	pthread_mutex_init(&b->index_lock, NULL);
 	return b;
 }
 
+/* xorshift32, only used to balance the index */
+static uint32_t index_priority(struct backed_block_list *bbl)
+{
+	uint32_t x = bbl->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	bbl->seed = x;
+
+	return x;
+}
+
+static struct backed_block *index_rotate_right(struct backed_block *t)
+{
+	struct backed_block *l = t->left;
+
+	t->left = l->right;
+	l->right = t;
+	return l;
+}
+
+static struct backed_block *index_rotate_left(struct backed_block *t)
+{
+	struct backed_block *r = t->right;
+
+	t->right = r->left;
+	r->left = t;
+	return r;
+}
+
+/* Inserts bb into the subtree t, before any entry with the same block */
+static struct backed_block *index_insert(struct backed_block *t, struct backed_block *bb)
+{
+	if (!t) {
+		bb->left = bb->right = NULL;
+		return bb;
+	}
+
+	if (bb->block <= t->block) {
+		t->left = index_insert(t->left, bb);
+		if (t->left->priority > t->priority) {
+			t = index_rotate_right(t);
+		}
+	} else {
+		t->right = index_insert(t->right, bb);
+		if (t->right->priority > t->priority) {
+			t = index_rotate_left(t);
+		}
+	}
+
+	return t;
+}
+
+/* Joins two subtrees where every entry of a comes before every entry of b */
+static struct backed_block *index_join(struct backed_block *a, struct backed_block *b)
+{
+	if (!a) {
+		return b;
+	}
+	if (!b) {
+		return a;
+	}
+
+	if (a->priority > b->priority) {
+		a->right = index_join(a->right, b);
+		return a;
+	}
+
+	b->left = index_join(a, b->left);
+	return b;
+}
+
+static struct backed_block *index_remove(struct backed_block *t, struct backed_block *bb)
+{
+	if (!t) {
+		return NULL;
+	}
+
+	if (t == bb) {
+		return index_join(t->left, t->right);
+	}
+
+	if (bb->block < t->block) {
+		t->left = index_remove(t->left, bb);
+	} else if (bb->block > t->block) {
+		t->right = index_remove(t->right, bb);
+	} else {
+		/* Entries with equal blocks may be on either side */
+		t->left = index_remove(t->left, bb);
+		t->right = index_remove(t->right, bb);
+	}
+
+	return t;
+}
+
+/*
+ * Builds a balanced index of the next count blocks of the list from *cur, in
+ * O(count).  Priorities fall with depth, so later inserts keep it a treap.
+ */
+static struct backed_block *index_build(struct backed_block **cur,
+		unsigned int count, unsigned int depth)
+{
+	struct backed_block *t;
+	struct backed_block *left;
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	left = index_build(cur, count / 2, depth + 1);
+	t = *cur;
+	*cur = t->next;
+	t->left = left;
+	t->priority = depth < 32 ? UINT32_MAX >> depth : 0;
+	t->indexed = true;
+	t->right = index_build(cur, count - count / 2 - 1, depth + 1);
+
+	return t;
+}
+
+/*
+ * Adds the blocks appended since the index was last used to it.  A long run
+ * rebuilds the whole index in O(n), a short one is inserted block by block.
+ * Lookups may race with each other, so this is done under the list's lock.
+ */
+static void index_sync(struct backed_block_list *bbl)
+{
+	struct backed_block *bb;
+
+	if (!__atomic_load_n(&bbl->unindexed, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&bbl->index_lock);
+	if (bbl->unindexed) {
+		if (bbl->unindexed_count >= bbl->index_count) {
+			bb = bbl->data_blocks;
+			bbl->index = index_build(&bb, bbl->index_count + bbl->unindexed_count, 0);
+		} else {
+			for (bb = bbl->unindexed; bb; bb = bb->next) {
+				bb->priority = index_priority(bbl);
+				bb->indexed = true;
+				bbl->index = index_insert(bbl->index, bb);
+			}
+		}
+		bbl->index_count += bbl->unindexed_count;
+		bbl->unindexed_count = 0;
+		__atomic_store_n(&bbl->unindexed, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&bbl->index_lock);
+}
+
+/* Returns the last backed block that starts before block, or NULL */
+static struct backed_block *index_find_prev(struct backed_block_list *bbl, unsigned int block)
+{
+	struct backed_block *t = bbl->index;
+	struct backed_block *prev = NULL;
+
+	while (t) {
+		if (t->block < block) {
+			prev = t;
+			t = t->right;
+		} else {
+			t = t->left;
+		}
+	}
+
+	return prev;
+}
+
+/* Returns the backed block containing block, or else the first one after it */
+struct backed_block *backed_block_lookup(struct backed_block_list *bbl, unsigned int block)
+{
+	struct backed_block *bb;
+
+	index_sync(bbl);
+	bb = index_find_prev(bbl, block + 1);
+
+	if (!bb) {
+		return bbl->data_blocks;
+	}
+
+	if (block < bb->block + DIV_ROUND_UP(bb->len, bbl->block_size)) {
+		return bb;
+	}
+
+	return bb->next;
+}
+
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
 	if (bbl->data_blocks) {
@@ -138,6 +349,7 @@ void backed_block_list_destroy(struct backed_block_list *bbl)
 		}
 	}
 
+	pthread_mutex_destroy(&bbl->index_lock);
 	free(bbl);
 }
 
@@ -146,6 +358,12 @@ void backed_block_list_move(struct backed_block_list *from,
 		struct backed_block *end)
 {
 	struct backed_block *bb;
+	struct backed_block *next;
+	struct backed_block *stop;
+	unsigned int count = 0;
+
+	index_sync(from);
+	index_sync(to);
 
 	if (start == NULL) {
 		start = from->data_blocks;
@@ -160,30 +378,39 @@ void backed_block_list_move(struct backed_block_list *from,
 		return;
 	}
 
-	from->last_used = NULL;
-	to->last_used = NULL;
-	if (from->data_blocks == start) {
-		from->data_blocks = end->next;
+	stop = end->next;
+	bb = index_find_prev(from, start->block);
+	if (bb) {
+		bb->next = stop;
 	} else {
-		for (bb = from->data_blocks; bb; bb = bb->next) {
-			if (bb->next == start) {
-				bb->next = end->next;
-				break;
-			}
-		}
+		from->data_blocks = stop;
+	}
+	if (!stop) {
+		from->last = bb;
 	}
 
-	if (!to->data_blocks) {
-		to->data_blocks = start;
-		end->next = NULL;
+	for (bb = start; bb != stop; bb = bb->next) {
+		from->index = index_remove(from->index, bb);
+		count++;
+	}
+	from->index_count -= count;
+	to->index_count += count;
+
+	bb = index_find_prev(to, start->block);
+	if (bb) {
+		end->next = bb->next;
+		bb->next = start;
 	} else {
-		for (bb = to->data_blocks; bb; bb = bb->next) {
-			if (!bb->next || bb->next->block > start->block) {
-				end->next = bb->next;
-				bb->next = start;
-				break;
-			}
-		}
+		end->next = to->data_blocks;
+		to->data_blocks = start;
+	}
+	if (!end->next) {
+		to->last = end;
+	}
+
+	for (bb = start; bb != end->next; bb = next) {
+		next = bb->next;
+		to->index = index_insert(to->index, bb);
 	}
 }
 
@@ -239,7 +466,20 @@ static int merge_bb(struct backed_block_list *bbl,
 	 * and free b */
 	a->len += b->len;
 	a->next = b->next;
+	if (bbl->last == b) {
+		bbl->last = a;
+	}
 
+	if (b->indexed) {
+		bbl->index = index_remove(bbl->index, b);
+		bbl->index_count--;
+	} else {
+		/* Only ever the newest of the unindexed blocks */
+		if (bbl->unindexed == b) {
+			bbl->unindexed = NULL;
+		}
+		bbl->unindexed_count--;
+	}
 	backed_block_destroy(b);
 
 	return 0;
@@ -247,43 +487,46 @@ static int merge_bb(struct backed_block_list *bbl,
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-	struct backed_block *bb;
+	struct backed_block *bb = bbl->last;
+
+	/* Blocks are mostly queued in order.  One past the last block is
+	 * appended in O(1) and only indexed when the index is next needed. */
+	if (!bb || new_bb->block > bb->block) {
+		if (bb) {
+			bb->next = new_bb;
+		} else {
+			bbl->data_blocks = new_bb;
+		}
+		bbl->last = new_bb;
+		if (!bbl->unindexed) {
+			bbl->unindexed = new_bb;
+		}
+		bbl->unindexed_count++;
 
-	if (bbl->data_blocks == NULL) {
-		bbl->data_blocks = new_bb;
+		merge_bb(bbl, bb, new_bb);
 		return 0;
 	}
 
-	if (bbl->data_blocks->block > new_bb->block) {
+	index_sync(bbl);
+	new_bb->priority = index_priority(bbl);
+	new_bb->indexed = true;
+	bbl->index_count++;
+
+	bb = index_find_prev(bbl, new_bb->block);
+	if (bb == NULL) {
+		/* New first block, never merged */
 		new_bb->next = bbl->data_blocks;
 		bbl->data_blocks = new_bb;
+		bbl->index = index_insert(bbl->index, new_bb);
 		return 0;
 	}
 
-	/* Optimization: blocks are mostly queued in sequence, so save the
-	   pointer to the last bb that was added, and start searching from
-	   there if the next block number is higher */
-	if (bbl->last_used && new_bb->block > bbl->last_used->block)
-		bb = bbl->last_used;
-	else
-		bb = bbl->data_blocks;
-	bbl->last_used = new_bb;
-
-	for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-		;
-
-	if (bb->next == NULL) {
-		bb->next = new_bb;
-	} else {
-		new_bb->next = bb->next;
-		bb->next = new_bb;
-	}
+	new_bb->next = bb->next;
+	bb->next = new_bb;
+	bbl->index = index_insert(bbl->index, new_bb);
 
 	merge_bb(bbl, new_bb, new_bb->next);
-	if (!merge_bb(bbl, bb, new_bb)) {
-		/* new_bb destroyed, point to retained as last_used */
-		bbl->last_used = bb;
-	}
+	merge_bb(bbl, bb, new_bb);
 
 	return 0;
 }
@@ -378,13 +621,20 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		return -ENOMEM;
 	}
 
+	index_sync(bbl);
 	*new_bb = *bb;
 
 	new_bb->len = bb->len - max_len;
 	new_bb->block = bb->block + max_len / bbl->block_size;
 	new_bb->next = bb->next;
+	new_bb->priority = index_priority(bbl);
 	bb->next = new_bb;
 	bb->len = max_len;
+	bbl->index = index_insert(bbl->index, new_bb);
+	bbl->index_count++;
+	if (bbl->last == bb) {
+		bbl->last = new_bb;
+	}
 
 	switch (bb->type) {
 	case BACKED_BLOCK_DATA:
@@ -50,6 +50,7 @@ uint32_t backed_block_fill_val(struct backed_block *bb);
 enum backed_block_type backed_block_type(struct backed_block *bb);
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		unsigned int max_len);
+struct backed_block *backed_block_lookup(struct backed_block_list *bbl, unsigned int block);
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
@@ -294,6 +294,19 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_set_threads - deflate gzipped output on several threads
+ *
+ * @s - sparse file cookie
+ * @threads - number of threads, at most 256, or 0 or 1 to deflate serially
+ *
+ * When sparse_file_write writes a gzipped file, split the output into 512KB
+ * blocks and deflate them on this many threads.  The result is one gzip
+ * member that any gunzip reads; it is not byte identical to the serial
+ * output but decompresses to the same data.
+ */
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
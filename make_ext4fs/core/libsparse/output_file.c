@@ -33,6 +33,7 @@
 #include "output_file.h"
 #include "sparse_crc32.h"
 #include "sparse_format.h"
+#include "sparse_parallel.h"
 
 #ifndef USE_MINGW
 #include <sys/mman.h>
@@ -272,6 +273,283 @@ static struct output_file_ops gz_file_ops = {
 	.close = gz_file_close,
 };
 
+/* Size of the blocks the parallel gzip output deflates independently */
+#define PGZ_BLOCK_SIZE (512U * 1024U)
+
+/* Deflate history carried into each block from the data before it */
+#define PGZ_DICT_SIZE (32U * 1024U)
+
+/* Blocks gathered per worker before a batch is deflated */
+#define PGZ_BLOCKS_PER_THREAD 2
+
+struct pgz_block {
+	unsigned char *out;
+	size_t out_size;
+	size_t out_len;
+	unsigned int len;
+	uint32_t crc;
+};
+
+/*
+ * Writes a single gzip member like the gz backend, but deflates
+ * PGZ_BLOCK_SIZE blocks of input on several threads.  Each block is primed
+ * with the last PGZ_DICT_SIZE bytes before it and ends in a sync flush, so
+ * the raw deflate streams can simply be concatenated, and their crcs are
+ * combined for the trailer.
+ */
+struct output_file_pgz {
+	struct output_file out;
+	int fd;
+	unsigned int threads;
+	unsigned int nblocks;
+	/* PGZ_DICT_SIZE bytes of history, then nblocks blocks of input */
+	unsigned char *in;
+	size_t in_len;
+	struct pgz_block *blocks;
+	z_stream *strms;
+	bool *strm_init;
+	uint32_t crc;
+	uint64_t total;
+};
+
+#define to_output_file_pgz(_o) \
+	container_of((_o), struct output_file_pgz, out)
+
+static int pgz_deflate_block(void *priv, unsigned int worker, unsigned int idx)
+{
+	struct output_file_pgz *outpgz = priv;
+	struct pgz_block *b = &outpgz->blocks[idx];
+	z_stream *strm = &outpgz->strms[worker];
+	unsigned char *start = outpgz->in + PGZ_DICT_SIZE + (size_t)idx * PGZ_BLOCK_SIZE;
+	uint64_t history = outpgz->total + (uint64_t)idx * PGZ_BLOCK_SIZE;
+	unsigned int dict_len = min(history, (uint64_t)PGZ_DICT_SIZE);
+	size_t bound;
+	int ret;
+
+	b->len = min(outpgz->in_len - (size_t)idx * PGZ_BLOCK_SIZE, (size_t)PGZ_BLOCK_SIZE);
+	b->crc = crc32(0, start, b->len);
+
+	if (!outpgz->strm_init[worker]) {
+		ret = deflateInit2(strm, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+		if (ret != Z_OK) {
+			return -ENOMEM;
+		}
+		outpgz->strm_init[worker] = true;
+	} else {
+		deflateReset(strm);
+	}
+
+	if (dict_len) {
+		deflateSetDictionary(strm, start - dict_len, dict_len);
+	}
+
+	/* Room for the worst case plus the empty stored block of the flush */
+	bound = deflateBound(strm, b->len) + 16;
+	if (b->out_size < bound) {
+		free(b->out);
+		b->out = malloc(bound);
+		if (!b->out) {
+			b->out_size = 0;
+			return -ENOMEM;
+		}
+		b->out_size = bound;
+	}
+
+	strm->next_in = start;
+	strm->avail_in = b->len;
+	strm->next_out = b->out;
+	strm->avail_out = b->out_size;
+	ret = deflate(strm, Z_SYNC_FLUSH);
+	if (ret != Z_OK || strm->avail_in != 0 || strm->avail_out == 0) {
+		return -EIO;
+	}
+	b->out_len = b->out_size - strm->avail_out;
+
+	return 0;
+}
+
+static int pgz_write(struct output_file_pgz *outpgz, const void *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(outpgz->fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error_errno("write");
+			return -1;
+		}
+
+		data = (const char *)data + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Deflates the buffered input and writes it out in order */
+static int pgz_flush(struct output_file_pgz *outpgz)
+{
+	unsigned int count = DIV_ROUND_UP(outpgz->in_len, PGZ_BLOCK_SIZE);
+	unsigned int i;
+	int ret;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	ret = sparse_parallel_for(outpgz->threads, count, pgz_deflate_block, outpgz);
+	if (ret < 0) {
+		error("deflate failed: %s", strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = pgz_write(outpgz, outpgz->blocks[i].out, outpgz->blocks[i].out_len);
+		if (ret < 0) {
+			return ret;
+		}
+		outpgz->crc = crc32_combine(outpgz->crc, outpgz->blocks[i].crc,
+				outpgz->blocks[i].len);
+	}
+
+	/* The end of this batch is the history of the next one */
+	memmove(outpgz->in, outpgz->in + outpgz->in_len, PGZ_DICT_SIZE);
+	outpgz->total += outpgz->in_len;
+	outpgz->in_len = 0;
+
+	return 0;
+}
+
+/* Adds len bytes of data, or of zeros if data is NULL, to the input */
+static int pgz_add(struct output_file_pgz *outpgz, const void *data, uint64_t len)
+{
+	size_t cap = (size_t)outpgz->nblocks * PGZ_BLOCK_SIZE;
+	unsigned char *dst;
+	size_t n;
+	int ret;
+
+	while (len > 0) {
+		n = min((uint64_t)(cap - outpgz->in_len), len);
+		dst = outpgz->in + PGZ_DICT_SIZE + outpgz->in_len;
+		if (data) {
+			memcpy(dst, data, n);
+			data = (const char *)data + n;
+		} else {
+			memset(dst, 0, n);
+		}
+		outpgz->in_len += n;
+		len -= n;
+
+		if (outpgz->in_len == cap) {
+			ret = pgz_flush(outpgz);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Frees the buffers and the output itself, leaving fd open */
+static void pgz_release(struct output_file_pgz *outpgz)
+{
+	unsigned int i;
+
+	for (i = 0; outpgz->strm_init && i < outpgz->threads; i++) {
+		if (outpgz->strm_init[i]) {
+			deflateEnd(&outpgz->strms[i]);
+		}
+	}
+	for (i = 0; outpgz->blocks && i < outpgz->nblocks; i++) {
+		free(outpgz->blocks[i].out);
+	}
+	free(outpgz->strm_init);
+	free(outpgz->strms);
+	free(outpgz->blocks);
+	free(outpgz->in);
+	free(outpgz);
+}
+
+static int pgz_file_open(struct output_file *out, int fd)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+	/* gzip header: deflate, no name or mtime, maximum compression, Unix */
+	static const unsigned char header[10] = {
+		0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3
+	};
+
+	outpgz->fd = fd;
+	outpgz->nblocks = outpgz->threads * PGZ_BLOCKS_PER_THREAD;
+	outpgz->in = malloc(PGZ_DICT_SIZE + (size_t)outpgz->nblocks * PGZ_BLOCK_SIZE);
+	outpgz->blocks = calloc(outpgz->nblocks, sizeof(*outpgz->blocks));
+	outpgz->strms = calloc(outpgz->threads, sizeof(*outpgz->strms));
+	outpgz->strm_init = calloc(outpgz->threads, sizeof(*outpgz->strm_init));
+	if (!outpgz->in || !outpgz->blocks || !outpgz->strms || !outpgz->strm_init) {
+		error_errno("malloc pgz buffers");
+		return -ENOMEM;
+	}
+
+	return pgz_write(outpgz, header, sizeof(header));
+}
+
+static int pgz_file_skip(struct output_file *out, int64_t cnt)
+{
+	return pgz_add(to_output_file_pgz(out), NULL, cnt);
+}
+
+static int pgz_file_pad(struct output_file *out, int64_t len)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+	int64_t cur = outpgz->total + outpgz->in_len;
+
+	if (cur >= len) {
+		return 0;
+	}
+
+	return pgz_add(outpgz, NULL, len - cur);
+}
+
+static int pgz_file_write(struct output_file *out, void *data, size_t len)
+{
+	return pgz_add(to_output_file_pgz(out), data, len);
+}
+
+static void pgz_file_close(struct output_file *out)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+	unsigned char trailer[10];
+	unsigned int i;
+
+	if (outpgz->in && pgz_flush(outpgz) == 0) {
+		/* An empty final fixed block ends the deflate stream, followed by
+		 * the crc and the length mod 2^32, both little endian */
+		trailer[0] = 3;
+		trailer[1] = 0;
+		for (i = 0; i < 4; i++) {
+			trailer[2 + i] = outpgz->crc >> (8 * i);
+			trailer[6 + i] = outpgz->total >> (8 * i);
+		}
+		pgz_write(outpgz, trailer, sizeof(trailer));
+	}
+
+	/* Like gzclose, this closes the fd the output was opened on */
+	close(outpgz->fd);
+
+	pgz_release(outpgz);
+}
+
+static struct output_file_ops pgz_file_ops = {
+	.open = pgz_file_open,
+	.skip = pgz_file_skip,
+	.pad = pgz_file_pad,
+	.write = pgz_file_write,
+	.close = pgz_file_close,
+};
+
 static int callback_file_open(struct output_file *out __unused, int fd __unused)
 {
 	return 0;
@@ -621,6 +899,20 @@ static struct output_file *output_file_new_gz(void)
 	return &outgz->out;
 }
 
+static struct output_file *output_file_new_pgz(unsigned int threads)
+{
+	struct output_file_pgz *outpgz = calloc(1, sizeof(struct output_file_pgz));
+	if (!outpgz) {
+		error_errno("malloc struct outpgz");
+		return NULL;
+	}
+
+	outpgz->out.ops = &pgz_file_ops;
+	outpgz->threads = min(threads, SPARSE_PARALLEL_MAX_THREADS);
+
+	return &outpgz->out;
+}
+
 static struct output_file *output_file_new_normal(void)
 {
 	struct output_file_normal *outn = calloc(1, sizeof(struct output_file_normal));
@@ -661,12 +953,14 @@ struct output_file *output_file_open_callback(int (*write)(void *, const void *,
 }
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-		int gz, int sparse, int chunks, int crc)
+		int gz, int sparse, int chunks, int crc, unsigned int threads)
 {
 	int ret;
 	struct output_file *out;
 
-	if (gz) {
+	if (gz && threads > 1) {
+		out = output_file_new_pgz(threads);
+	} else if (gz) {
 		out = output_file_new_gz();
 	} else {
 		out = output_file_new_normal();
@@ -675,11 +969,16 @@ struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t
 		return NULL;
 	}
 
-	out->ops->open(out, fd);
-
-	ret = output_file_init(out, block_size, len, sparse, chunks, crc);
+	ret = out->ops->open(out, fd);
+	if (ret == 0) {
+		ret = output_file_init(out, block_size, len, sparse, chunks, crc);
+	}
 	if (ret < 0) {
-		free(out);
+		if (out->ops == &pgz_file_ops) {
+			pgz_release(to_output_file_pgz(out));
+		} else {
+			free(out);
+		}
 		return NULL;
 	}
 
@@ -166,7 +166,8 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 	struct output_file *out;
 
 	chunks = sparse_count_chunks(s);
-	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc);
+	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc,
+			s->threads);
 
 	if (!out)
 		return -ENOMEM;
@@ -393,3 +394,8 @@ void sparse_file_verbose(struct sparse_file *s)
 {
 	s->verbose = true;
 }
+
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads)
+{
+	s->threads = threads;
+}
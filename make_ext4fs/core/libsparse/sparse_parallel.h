@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_PARALLEL_H_
+#define _LIBSPARSE_SPARSE_PARALLEL_H_
+
+/* Most threads a sparse file is compressed on */
+#define SPARSE_PARALLEL_MAX_THREADS 256U
+
+/*
+ * Calls fn(priv, worker, idx) for every idx in [0, count) using up to
+ * threads workers, one of which is the calling thread.  Indexes are handed
+ * out in increasing order; worker is in [0, threads) and can be used to pick
+ * per-thread scratch state.  Stops handing out work after the first negative
+ * return and returns that value, 0 on success.
+ */
+int sparse_parallel_for(unsigned int threads, unsigned int count,
+		int (*fn)(void *priv, unsigned int worker, unsigned int idx),
+		void *priv);
+
+#endif
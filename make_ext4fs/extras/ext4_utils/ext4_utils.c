@@ -43,6 +43,7 @@
 #endif
 
 int force = 0;
+unsigned int gz_threads = 1;
 struct fs_info info;
 struct fs_aux_info aux_info;
 struct sparse_file *ext4_sparse_file;
@@ -130,6 +131,7 @@ void write_sb(int fd, unsigned long long offset, struct ext4_super_block *sb)
 /* Write the filesystem image to a file */
 void write_ext4_image(int fd, int gz, int sparse, int crc)
 {
+	sparse_file_set_threads(ext4_sparse_file, gz_threads);
 	sparse_file_write(ext4_sparse_file, fd, gz, sparse, crc);
 }
 
@@ -48,6 +48,8 @@ extern "C" {
 #include "ext4_sb.h"
 
 extern int force;
+/* Threads a gzipped image is deflated on */
+extern unsigned int gz_threads;
 
 #define warn(fmt, args...) do { fprintf(stderr, "warning: %s: " fmt "\n", __func__, ## args); } while (0)
 #define error(fmt, args...) do { fprintf(stderr, "error: %s: " fmt "\n", __func__, ## args); if (!force) longjmp(setjmp_env, EXIT_FAILURE); } while (0)
@@ -54,7 +54,8 @@ static void usage(char *path)
 	fprintf(stderr, "    [ -g <blocks per group> ] [ -i <inodes> ] [ -I <inode size> ]\n");
 	fprintf(stderr, "    [ -L <label> ] [ -f ] [ -a <android mountpoint> ]\n");
 	fprintf(stderr, "    [ -S file_contexts ] [ -C fs_config ] [ -T timestamp ]\n");
-	fprintf(stderr, "    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -v ] [ -B <block_list_file> ]\n");
+	fprintf(stderr, "    [ -z | -s ] [ -Z <gzip threads> ] [ -w ] [ -c ] [ -J ] [ -v ]\n");
+	fprintf(stderr, "    [ -B <block_list_file> ]\n");
 	fprintf(stderr, "    [ -X fs_config  (Xtra fs_config will be used in addition to the default android fs props)   ]\n");
 	fprintf(stderr, "    [    Note: all 'capabilities' will be removed from all other files not explicitly specified ]\n");
 	fprintf(stderr, "    <filename> [<directory>]\n");
@@ -70,6 +71,8 @@ int main(int argc, char **argv)
 	const char *fs_config_file = NULL;
 	const char *xtra_fs_config_file = NULL;
 	int gzip = 0;
+	long threads;
+	char *end;
 	int sparse = 0;
 	int crc = 0;
 	int wipe = 0;
@@ -85,7 +88,7 @@ int main(int argc, char **argv)
 
 	//current                        "l:j:b:g:i:I:    L:a:S:T:C:B:    fwzJsctv "
 	//upstream                       "l:j:b:g:i:I:e:o:L:a:S:T:C:B:d:D:fwzJsctvu"
-	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:T:C:X:B:fwzJsctv")) != -1) {
+	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:T:C:X:B:Z:fwzJsctv")) != -1) {
 		switch (opt) {
 		case 'l':
 			info.len = parse_num(optarg);
@@ -126,6 +129,17 @@ int main(int argc, char **argv)
 		case 'z':
 			gzip = 1;
 			break;
+		case 'Z':
+			threads = strtol(optarg, &end, 10);
+			if (end == optarg || *end || threads < 1) {
+				fprintf(stderr, "Invalid gzip thread count %s\n", optarg);
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			/* sparse_file_set_threads takes at most 256 */
+			gz_threads = threads < 256 ? threads : 256;
+			gzip = 1;
+			break;
 		case 'J':
 			info.no_journal = 1;
 			break;
@@ -20,14 +20,19 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sparse/sparse.h>
+#include "simg_opt.h"
 #include "sparse_file.h"
 #include "backed_block.h"
+#include "output_file.h"
+#include "sparse_format.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -43,11 +48,58 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: append2simg <output> <input>\n");
+    fprintf(stderr, "Usage: append2simg [-i] [--stats] [--index] <output> <input>\n");
+    fprintf(stderr, "  -i    append the new chunks to the output file in place\n");
+    fprintf(stderr, "  --stats  print chunk, i/o and time statistics to stderr\n");
+    fprintf(stderr, "  --index  read the chunks of a sparse output from <output>.idx, writing\n"
+            "           it if missing or out of date\n");
+}
+
+/*
+ * Appends the input to the end of the sparse image in output without
+ * rewriting it.  Fill blocks in the input become fill chunks.  Returns
+ * -EINVAL if output is not a sparse image and -ERANGE if the input is not a
+ * whole number of its blocks.
+ */
+static int append_in_place(int output, int input, off_t input_len)
+{
+    sparse_header_t sparse_header;
+    struct sparse_file *s;
+    int ret;
+
+    ret = pread_all(output, &sparse_header, sizeof(sparse_header), 0);
+    if (ret < 0) {
+        return ret;
+    }
+    if (sparse_header.magic != SPARSE_HEADER_MAGIC || sparse_header.blk_sz == 0) {
+        return -EINVAL;
+    }
+    if (input_len % sparse_header.blk_sz) {
+        return -ERANGE;
+    }
+
+    s = sparse_file_new(sparse_header.blk_sz, input_len);
+    if (!s) {
+        return -ENOMEM;
+    }
+
+    ret = sparse_file_read(s, input, SPARSE_READ_MODE_NORMAL, false);
+    if (ret == 0) {
+        ret = sparse_file_append(s, output);
+    }
+
+    sparse_file_destroy(s);
+
+    return ret;
 }
 
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 'S'},
+        {"index", no_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0},
+    };
     int output;
     int output_block;
     char *output_path;
@@ -60,8 +112,33 @@ int main(int argc, char *argv[])
     int tmp_fd;
     char *tmp_path;
 
+    bool in_place = false;
+    bool print_stats = false;
+    bool use_index = false;
+    struct sparse_stats stats;
+    int opt;
     int ret;
 
+    while ((opt = getopt_long(argc, argv, "i", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            in_place = true;
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        case 'I':
+            use_index = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc == 3) {
         output_path = argv[1];
         input_path = argv[2];
@@ -70,6 +147,53 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (print_stats) {
+        memset(&stats, 0, sizeof(stats));
+        sparse_set_stats(&stats);
+    }
+
+    if (in_place) {
+        output = open(output_path, O_RDWR | O_BINARY);
+        if (output < 0) {
+            fprintf(stderr, "Couldn't open output file (%s)\n", strerror(errno));
+            exit(-1);
+        }
+
+        input = open(input_path, O_RDONLY | O_BINARY);
+        if (input < 0) {
+            fprintf(stderr, "Couldn't open input file (%s)\n", strerror(errno));
+            exit(-1);
+        }
+
+        input_len = lseek(input, 0, SEEK_END);
+        if (input_len < 0) {
+            fprintf(stderr, "Couldn't get input file length (%s)\n", strerror(errno));
+            exit(-1);
+        }
+        lseek(input, 0, SEEK_SET);
+
+        ret = append_in_place(output, input, input_len);
+        if (ret == -EINVAL) {
+            fprintf(stderr, "Output file can't be appended to in place\n");
+            exit(-1);
+        } else if (ret == -ERANGE) {
+            fprintf(stderr, "Input file is not a multiple of the output file's block size\n");
+            exit(-1);
+        } else if (ret < 0) {
+            fprintf(stderr, "Failed to append to sparse file (%s)\n", strerror(-ret));
+            exit(-1);
+        }
+
+        if (print_stats) {
+            sparse_stats_print(&stats);
+        }
+
+        close(output);
+        close(input);
+
+        exit(0);
+    }
+
     ret = asprintf(&tmp_path, "%s.append2simg", output_path);
     if (ret < 0) {
         fprintf(stderr, "Couldn't allocate filename\n");
@@ -82,7 +206,11 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    sparse_output = sparse_file_import_auto(output, false, true);
+    /* A raw output has no index and is imported as usual */
+    sparse_output = use_index ? import_indexed(output, output_path, false) : NULL;
+    if (!sparse_output) {
+        sparse_output = sparse_file_import_auto(output, false, true);
+    }
     if (!sparse_output) {
         fprintf(stderr, "Couldn't import output file\n");
         exit(-1);
@@ -123,6 +251,10 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (print_stats) {
+        sparse_stats_print(&stats);
+    }
+
     sparse_file_destroy(sparse_output);
     close(tmp_fd);
     close(output);
@@ -16,12 +16,17 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "backed_block.h"
 #include "sparse_defs.h"
+#include "sparse_file.h"
+#include "sparse_parallel.h"
 
 struct backed_block {
     unsigned int block;
@@ -42,13 +47,31 @@ struct backed_block {
         struct {
             uint32_t val;
         } fill;
+        struct {
+            struct sparse_gz *gz;
+            int64_t offset;
+        } gz;
     };
     struct backed_block *next;
+    /* Ordered index, a treap keyed by block */
+    struct backed_block *left;
+    struct backed_block *right;
+    uint32_t priority;
+    bool indexed;
 };
 
 struct backed_block_list {
     struct backed_block *data_blocks;
-    struct backed_block *last_used;
+    struct backed_block *last;
+    struct backed_block *index;
+    unsigned int index_count;
+    /* Blocks appended after the last one skip the index.  They form a run at
+     * the end of the list, starting at unindexed, that is added to the index
+     * the next time it is searched. */
+    struct backed_block *unindexed;
+    unsigned int unindexed_count;
+    pthread_mutex_t index_lock;
+    uint32_t seed;
     unsigned int block_size;
 };
 
@@ -90,11 +113,20 @@ int backed_block_fd(struct backed_block *bb)
     return bb->fd.fd;
 }
 
+struct sparse_gz *backed_block_gz(struct backed_block *bb)
+{
+    assert(bb->type == BACKED_BLOCK_GZ);
+    return bb->gz.gz;
+}
+
 int64_t backed_block_file_offset(struct backed_block * bb)
 {
-    assert(bb->type == BACKED_BLOCK_FILE || bb->type == BACKED_BLOCK_FD);
+    assert(bb->type == BACKED_BLOCK_FILE || bb->type == BACKED_BLOCK_FD ||
+           bb->type == BACKED_BLOCK_GZ);
     if (bb->type == BACKED_BLOCK_FILE) {
         return bb->file.offset;
+    } else if (bb->type == BACKED_BLOCK_GZ) {
+        return bb->gz.offset;
     } else {                    /* bb->type == BACKED_BLOCK_FD */
         return bb->fd.offset;
     }
@@ -123,10 +155,204 @@ void backed_block_destroy(struct backed_block *bb)
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
     struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
+    if (!b) {
+        return NULL;
+    }
     b->block_size = block_size;
+    b->seed = 0x9e3779b9;
+    pthread_mutex_init(&b->index_lock, NULL);
     return b;
 }
 
+/* xorshift32, only used to balance the index */
+static uint32_t index_priority(struct backed_block_list *bbl)
+{
+    uint32_t x = bbl->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bbl->seed = x;
+
+    return x;
+}
+
+static struct backed_block *index_rotate_right(struct backed_block *t)
+{
+    struct backed_block *l = t->left;
+
+    t->left = l->right;
+    l->right = t;
+    return l;
+}
+
+static struct backed_block *index_rotate_left(struct backed_block *t)
+{
+    struct backed_block *r = t->right;
+
+    t->right = r->left;
+    r->left = t;
+    return r;
+}
+
+/* Inserts bb into the subtree t, before any entry with the same block */
+static struct backed_block *index_insert(struct backed_block *t, struct backed_block *bb)
+{
+    if (!t) {
+        bb->left = bb->right = NULL;
+        return bb;
+    }
+
+    if (bb->block <= t->block) {
+        t->left = index_insert(t->left, bb);
+        if (t->left->priority > t->priority) {
+            t = index_rotate_right(t);
+        }
+    } else {
+        t->right = index_insert(t->right, bb);
+        if (t->right->priority > t->priority) {
+            t = index_rotate_left(t);
+        }
+    }
+
+    return t;
+}
+
+/* Joins two subtrees where every entry of a comes before every entry of b */
+static struct backed_block *index_join(struct backed_block *a, struct backed_block *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    if (a->priority > b->priority) {
+        a->right = index_join(a->right, b);
+        return a;
+    }
+
+    b->left = index_join(a, b->left);
+    return b;
+}
+
+static struct backed_block *index_remove(struct backed_block *t, struct backed_block *bb)
+{
+    if (!t) {
+        return NULL;
+    }
+
+    if (t == bb) {
+        return index_join(t->left, t->right);
+    }
+
+    if (bb->block < t->block) {
+        t->left = index_remove(t->left, bb);
+    } else if (bb->block > t->block) {
+        t->right = index_remove(t->right, bb);
+    } else {
+        /* Entries with equal blocks may be on either side */
+        t->left = index_remove(t->left, bb);
+        t->right = index_remove(t->right, bb);
+    }
+
+    return t;
+}
+
+/*
+ * Builds a balanced index of the next count blocks of the list from *cur, in
+ * O(count).  Priorities fall with depth, so later inserts keep it a treap.
+ */
+static struct backed_block *index_build(struct backed_block **cur, unsigned int count,
+                                        unsigned int depth)
+{
+    struct backed_block *t;
+    struct backed_block *left;
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    left = index_build(cur, count / 2, depth + 1);
+    t = *cur;
+    *cur = t->next;
+    t->left = left;
+    t->priority = depth < 32 ? UINT32_MAX >> depth : 0;
+    t->indexed = true;
+    t->right = index_build(cur, count - count / 2 - 1, depth + 1);
+
+    return t;
+}
+
+/*
+ * Adds the blocks appended since the index was last used to it.  A long run
+ * rebuilds the whole index in O(n), a short one is inserted block by block.
+ * Lookups may race with each other, so this is done under the list's lock.
+ */
+static void index_sync(struct backed_block_list *bbl)
+{
+    struct backed_block *bb;
+
+    if (!__atomic_load_n(&bbl->unindexed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&bbl->index_lock);
+    if (bbl->unindexed) {
+        if (bbl->unindexed_count >= bbl->index_count) {
+            bb = bbl->data_blocks;
+            bbl->index = index_build(&bb, bbl->index_count + bbl->unindexed_count, 0);
+        } else {
+            for (bb = bbl->unindexed; bb; bb = bb->next) {
+                bb->priority = index_priority(bbl);
+                bb->indexed = true;
+                bbl->index = index_insert(bbl->index, bb);
+            }
+        }
+        bbl->index_count += bbl->unindexed_count;
+        bbl->unindexed_count = 0;
+        __atomic_store_n(&bbl->unindexed, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&bbl->index_lock);
+}
+
+/* Returns the last backed block that starts before block, or NULL */
+static struct backed_block *index_find_prev(struct backed_block_list *bbl, unsigned int block)
+{
+    struct backed_block *t = bbl->index;
+    struct backed_block *prev = NULL;
+
+    while (t) {
+        if (t->block < block) {
+            prev = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+
+    return prev;
+}
+
+/* Returns the backed block containing block, or else the first one after it */
+struct backed_block *backed_block_lookup(struct backed_block_list *bbl, unsigned int block)
+{
+    struct backed_block *bb;
+
+    index_sync(bbl);
+    bb = index_find_prev(bbl, block + 1);
+    if (!bb) {
+        return bbl->data_blocks;
+    }
+
+    if (block < bb->block + DIV_ROUND_UP(bb->len, bbl->block_size)) {
+        return bb;
+    }
+
+    return bb->next;
+}
+
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
     if (bbl->data_blocks) {
@@ -138,6 +364,7 @@ void backed_block_list_destroy(struct backed_block_list *bbl)
         }
     }
 
+    pthread_mutex_destroy(&bbl->index_lock);
     free(bbl);
 }
 
@@ -146,6 +373,12 @@ void backed_block_list_move(struct backed_block_list *from,
                             struct backed_block *end)
 {
     struct backed_block *bb;
+    struct backed_block *next;
+    struct backed_block *stop;
+    unsigned int count = 0;
+
+    index_sync(from);
+    index_sync(to);
 
     if (start == NULL) {
         start = from->data_blocks;
@@ -159,30 +392,39 @@ void backed_block_list_move(struct backed_block_list *from,
         return;
     }
 
-    from->last_used = NULL;
-    to->last_used = NULL;
-    if (from->data_blocks == start) {
-        from->data_blocks = end->next;
+    stop = end->next;
+    bb = index_find_prev(from, start->block);
+    if (bb) {
+        bb->next = stop;
     } else {
-        for (bb = from->data_blocks; bb; bb = bb->next) {
-            if (bb->next == start) {
-                bb->next = end->next;
-                break;
-            }
-        }
+        from->data_blocks = stop;
+    }
+    if (!stop) {
+        from->last = bb;
     }
 
-    if (!to->data_blocks) {
-        to->data_blocks = start;
-        end->next = NULL;
+    for (bb = start; bb != stop; bb = bb->next) {
+        from->index = index_remove(from->index, bb);
+        count++;
+    }
+    from->index_count -= count;
+    to->index_count += count;
+
+    bb = index_find_prev(to, start->block);
+    if (bb) {
+        end->next = bb->next;
+        bb->next = start;
     } else {
-        for (bb = to->data_blocks; bb; bb = bb->next) {
-            if (!bb->next || bb->next->block > start->block) {
-                end->next = bb->next;
-                bb->next = start;
-                break;
-            }
-        }
+        end->next = to->data_blocks;
+        to->data_blocks = start;
+    }
+    if (!end->next) {
+        to->last = end;
+    }
+
+    for (bb = start; bb != end->next; bb = next) {
+        next = bb->next;
+        to->index = index_insert(to->index, bb);
     }
 }
 
@@ -209,6 +451,11 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
         return -EINVAL;
     }
 
+    /* Merged length would not fit */
+    if (a->len > UINT_MAX - b->len) {
+        return -EINVAL;
+    }
+
     switch (a->type) {
     case BACKED_BLOCK_DATA:
         /* Don't support merging data for now */
@@ -229,13 +476,30 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
             return -EINVAL;
         }
         break;
+    case BACKED_BLOCK_GZ:
+        /* Keep each block within one restart segment, so expanding it never
+         * inflates more than one segment */
+        return -EINVAL;
     }
 
     /* Blocks are compatible and adjacent, with a before b.  Merge b into a,
      * and free b */
     a->len += b->len;
     a->next = b->next;
+    if (bbl->last == b) {
+        bbl->last = a;
+    }
 
+    if (b->indexed) {
+        bbl->index = index_remove(bbl->index, b);
+        bbl->index_count--;
+    } else {
+        /* Only ever the newest of the unindexed blocks */
+        if (bbl->unindexed == b) {
+            bbl->unindexed = NULL;
+        }
+        bbl->unindexed_count--;
+    }
     backed_block_destroy(b);
 
     return 0;
@@ -243,42 +507,46 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-    struct backed_block *bb;
+    struct backed_block *bb = bbl->last;
+
+    /* Blocks are mostly queued in order.  One past the last block is
+     * appended in O(1) and only indexed when the index is next needed. */
+    if (!bb || new_bb->block > bb->block) {
+        if (bb) {
+            bb->next = new_bb;
+        } else {
+            bbl->data_blocks = new_bb;
+        }
+        bbl->last = new_bb;
+        if (!bbl->unindexed) {
+            bbl->unindexed = new_bb;
+        }
+        bbl->unindexed_count++;
 
-    if (bbl->data_blocks == NULL) {
-        bbl->data_blocks = new_bb;
+        merge_bb(bbl, bb, new_bb);
         return 0;
     }
 
-    if (bbl->data_blocks->block > new_bb->block) {
+    index_sync(bbl);
+    new_bb->priority = index_priority(bbl);
+    new_bb->indexed = true;
+    bbl->index_count++;
+
+    bb = index_find_prev(bbl, new_bb->block);
+    if (bb == NULL) {
+        /* New first block, never merged */
         new_bb->next = bbl->data_blocks;
         bbl->data_blocks = new_bb;
+        bbl->index = index_insert(bbl->index, new_bb);
         return 0;
     }
 
-    /* Optimization: blocks are mostly queued in sequence, so save the
-       pointer to the last bb that was added, and start searching from
-       there if the next block number is higher */
-    if (bbl->last_used && new_bb->block > bbl->last_used->block)
-        bb = bbl->last_used;
-    else
-        bb = bbl->data_blocks;
-    bbl->last_used = new_bb;
-
-    for (; bb->next && bb->next->block < new_bb->block; bb = bb->next) ;
-
-    if (bb->next == NULL) {
-        bb->next = new_bb;
-    } else {
-        new_bb->next = bb->next;
-        bb->next = new_bb;
-    }
+    new_bb->next = bb->next;
+    bb->next = new_bb;
+    bbl->index = index_insert(bbl->index, new_bb);
 
     merge_bb(bbl, new_bb, new_bb->next);
-    if (!merge_bb(bbl, bb, new_bb)) {
-        /* new_bb destroyed, point to retained as last_used */
-        bbl->last_used = bb;
-    }
+    merge_bb(bbl, bb, new_bb);
 
     return 0;
 }
@@ -357,6 +625,254 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
     return queue_bb(bbl, bb);
 }
 
+/* Queues a range of the uncompressed data of a gz file with restart points to
+ * be written to the specified data blocks */
+int backed_block_add_gz(struct backed_block_list *bbl, struct sparse_gz *gz, int64_t offset,
+                        unsigned int len, unsigned int block)
+{
+    struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+    if (bb == NULL) {
+        return -ENOMEM;
+    }
+
+    bb->block = block;
+    bb->len = len;
+    bb->type = BACKED_BLOCK_GZ;
+    bb->gz.gz = gz;
+    bb->gz.offset = offset;
+    bb->next = NULL;
+
+    return queue_bb(bbl, bb);
+}
+
+/* Queues blocks [block, block + count) of bb, which is in another list, to be
+ * written to the same data blocks.  The new block shares the data, file, fd or
+ * gz file bb is backed by, so bb's list must outlive bbl. */
+int backed_block_add_blocks(struct backed_block_list *bbl, struct backed_block *bb,
+                            unsigned int block, unsigned int count)
+{
+    int64_t offset = (int64_t) (block - bb->block) * bbl->block_size;
+    int64_t end = offset + (int64_t) count * bbl->block_size;
+    unsigned int len;
+
+    if (end > bb->len) {
+        end = bb->len;
+    }
+    len = end - offset;
+
+    switch (bb->type) {
+    case BACKED_BLOCK_DATA:
+        return backed_block_add_data(bbl, (char *)bb->data.data + offset, len, block);
+    case BACKED_BLOCK_FILE:
+        return backed_block_add_file(bbl, bb->file.filename, bb->file.offset + offset, len,
+                                     block);
+    case BACKED_BLOCK_FD:
+        return backed_block_add_fd(bbl, bb->fd.fd, bb->fd.offset + offset, len, block);
+    case BACKED_BLOCK_FILL:
+        return backed_block_add_fill(bbl, bb->fill.val, len, block);
+    case BACKED_BLOCK_GZ:
+        return backed_block_add_gz(bbl, bb->gz.gz, bb->gz.offset + offset, len, block);
+    default:
+        return -EINVAL;
+    }
+}
+
+unsigned int backed_block_end(struct backed_block *bb, unsigned int block_size)
+{
+    return bb->block + DIV_ROUND_UP(bb->len, block_size);
+}
+
+/* Moves *bb past the blocks that end at or before pos and returns it if it
+ * covers pos.  *next is lowered to the block where that answer changes. */
+static struct backed_block *pair_at(struct backed_block **bb, unsigned int pos,
+                                    unsigned int block_size, unsigned int *next)
+{
+    while (*bb && backed_block_end(*bb, block_size) <= pos) {
+        *bb = (*bb)->next;
+    }
+    if (!*bb) {
+        return NULL;
+    }
+    if ((*bb)->block > pos) {
+        if ((*bb)->block < *next) {
+            *next = (*bb)->block;
+        }
+        return NULL;
+    }
+    if (backed_block_end(*bb, block_size) < *next) {
+        *next = backed_block_end(*bb, block_size);
+    }
+    return *bb;
+}
+
+int backed_block_walk_pair(struct backed_block_list *a, struct backed_block_list *b,
+                           unsigned int blocks, backed_block_pair_fn fn, void *priv)
+{
+    unsigned int block_size = a->block_size;
+    struct backed_block *a_iter = a->data_blocks;
+    struct backed_block *b_iter = b->data_blocks;
+    struct backed_block *a_bb;
+    struct backed_block *b_bb;
+    unsigned int pos = 0;
+    unsigned int end;
+    int ret;
+
+    while (pos < blocks) {
+        end = blocks;
+        a_bb = pair_at(&a_iter, pos, block_size, &end);
+        b_bb = pair_at(&b_iter, pos, block_size, &end);
+        ret = fn(priv, a_bb, b_bb, pos, end - pos);
+        if (ret < 0) {
+            return ret;
+        }
+        pos = end;
+    }
+
+    return 0;
+}
+
+/* A run of blocks to read and compare, NULL where a list is don't care */
+struct backed_block_compare_task {
+    struct backed_block *a_bb;
+    struct backed_block *b_bb;
+    unsigned int block;
+    unsigned int count;
+};
+
+int backed_block_compare_init(struct backed_block_compare *c, unsigned int block_size,
+                              unsigned int blocks, unsigned int threads)
+{
+    memset(c, 0, sizeof(*c));
+    c->block_size = block_size;
+    c->threads = threads ? threads : 1;
+    c->task_blocks = BACKED_BLOCK_COMPARE_SIZE / block_size;
+    if (c->task_blocks == 0) {
+        c->task_blocks = 1;
+    }
+    c->changed = calloc(blocks ? blocks : 1, 1);
+    c->bufs = calloc(2 * c->threads, sizeof(char *));
+    if (!c->changed || !c->bufs) {
+        backed_block_compare_free(c);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void backed_block_compare_free(struct backed_block_compare *c)
+{
+    unsigned int i;
+
+    for (i = 0; c->bufs && i < 2 * c->threads; i++) {
+        free(c->bufs[i]);
+    }
+    free(c->bufs);
+    free(c->tasks);
+    free(c->changed);
+    memset(c, 0, sizeof(*c));
+}
+
+int backed_block_compare_add(struct backed_block_compare *c, struct backed_block *a_bb,
+                             struct backed_block *b_bb, unsigned int block, unsigned int count)
+{
+    struct backed_block_compare_task *tasks;
+    unsigned int n;
+
+    while (count > 0) {
+        if (c->count == c->alloc) {
+            c->alloc = c->alloc ? c->alloc * 2 : 64;
+            tasks = realloc(c->tasks, c->alloc * sizeof(*tasks));
+            if (!tasks) {
+                return -ENOMEM;
+            }
+            c->tasks = tasks;
+        }
+
+        n = count < c->task_blocks ? count : c->task_blocks;
+        c->tasks[c->count].a_bb = a_bb;
+        c->tasks[c->count].b_bb = b_bb;
+        c->tasks[c->count].block = block;
+        c->tasks[c->count].count = n;
+        c->count++;
+        block += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/* Reads blocks [block, block + count) of bb into buf, padding the last block
+ * of bb and the whole run if bb is NULL with zeros. */
+static int compare_read(struct backed_block *bb, char *buf, unsigned int block,
+                        unsigned int count, unsigned int block_size)
+{
+    size_t size = (size_t) count * block_size;
+    uint64_t start;
+    unsigned int len = 0;
+    int ret;
+
+    if (bb) {
+        start = (uint64_t) (block - bb->block) * block_size;
+        len = (start + size < bb->len ? start + size : bb->len) - start;
+        ret = backed_block_read(bb, buf, start, len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    memset(buf + len, 0, size - len);
+
+    return 0;
+}
+
+static int compare_task(void *priv, unsigned int worker, unsigned int idx)
+{
+    struct backed_block_compare *c = priv;
+    struct backed_block_compare_task *task = &c->tasks[idx];
+    unsigned int block_size = c->block_size;
+    size_t off;
+    unsigned int i;
+    char *a_buf;
+    char *b_buf;
+    int ret;
+
+    for (i = 2 * worker; i < 2 * worker + 2; i++) {
+        if (!c->bufs[i]) {
+            c->bufs[i] = malloc((size_t) c->task_blocks * block_size);
+            if (!c->bufs[i]) {
+                return -ENOMEM;
+            }
+        }
+    }
+    a_buf = c->bufs[2 * worker];
+    b_buf = c->bufs[2 * worker + 1];
+
+    ret = compare_read(task->a_bb, a_buf, task->block, task->count, block_size);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = compare_read(task->b_bb, b_buf, task->block, task->count, block_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (memcmp(a_buf, b_buf, (size_t) task->count * block_size) == 0) {
+        return 0;
+    }
+    for (i = 0; i < task->count; i++) {
+        off = (size_t) i * block_size;
+        if (memcmp(a_buf + off, b_buf + off, block_size) != 0) {
+            c->changed[task->block + i] = 1;
+        }
+    }
+
+    return 0;
+}
+
+int backed_block_compare_run(struct backed_block_compare *c)
+{
+    return sparse_parallel_for(c->threads, c->count, compare_task, c);
+}
+
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, unsigned int max_len)
 {
     struct backed_block *new_bb;
@@ -372,13 +888,20 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, u
         return -ENOMEM;
     }
 
+    index_sync(bbl);
     *new_bb = *bb;
 
     new_bb->len = bb->len - max_len;
     new_bb->block = bb->block + max_len / bbl->block_size;
     new_bb->next = bb->next;
+    new_bb->priority = index_priority(bbl);
     bb->next = new_bb;
     bb->len = max_len;
+    bbl->index = index_insert(bbl->index, new_bb);
+    bbl->index_count++;
+    if (bbl->last == bb) {
+        bbl->last = new_bb;
+    }
 
     switch (bb->type) {
     case BACKED_BLOCK_DATA:
@@ -390,6 +913,9 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, u
     case BACKED_BLOCK_FD:
         new_bb->fd.offset += max_len;
         break;
+    case BACKED_BLOCK_GZ:
+        new_bb->gz.offset += max_len;
+        break;
     case BACKED_BLOCK_FILL:
         break;
     }
@@ -21,12 +21,14 @@
 
 struct backed_block_list;
 struct backed_block;
+struct sparse_gz;
 
 enum backed_block_type {
     BACKED_BLOCK_DATA,
     BACKED_BLOCK_FILE,
     BACKED_BLOCK_FD,
     BACKED_BLOCK_FILL,
+    BACKED_BLOCK_GZ,
 };
 
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
@@ -37,6 +39,10 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
                           int64_t offset, unsigned int len, unsigned int block);
 int backed_block_add_fd(struct backed_block_list *bbl, int fd,
                         int64_t offset, unsigned int len, unsigned int block);
+int backed_block_add_gz(struct backed_block_list *bbl, struct sparse_gz *gz,
+                        int64_t offset, unsigned int len, unsigned int block);
+int backed_block_add_blocks(struct backed_block_list *bbl, struct backed_block *bb,
+                            unsigned int block, unsigned int count);
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
@@ -45,11 +51,59 @@ unsigned int backed_block_block(struct backed_block *bb);
 void *backed_block_data(struct backed_block *bb);
 const char *backed_block_filename(struct backed_block *bb);
 int backed_block_fd(struct backed_block *bb);
+struct sparse_gz *backed_block_gz(struct backed_block *bb);
 int64_t backed_block_file_offset(struct backed_block *bb);
 uint32_t backed_block_fill_val(struct backed_block *bb);
 enum backed_block_type backed_block_type(struct backed_block *bb);
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
                        unsigned int max_len);
+struct backed_block *backed_block_lookup(struct backed_block_list *bbl, unsigned int block);
+
+/* First block after bb */
+unsigned int backed_block_end(struct backed_block *bb, unsigned int block_size);
+
+typedef int (*backed_block_pair_fn) (void *priv, struct backed_block *a, struct backed_block *b,
+                                     unsigned int block, unsigned int count);
+
+/*
+ * Walks two lists with the same block size side by side over blocks
+ * [0, blocks), calling fn for each run of blocks over which neither list
+ * moves to another backed block.  a or b is NULL where that list is don't
+ * care.  Each backed block of both lists is visited once.
+ */
+int backed_block_walk_pair(struct backed_block_list *a, struct backed_block_list *b,
+                           unsigned int blocks, backed_block_pair_fn fn, void *priv);
+
+/* Largest run of blocks read from each list and compared by one worker */
+#define BACKED_BLOCK_COMPARE_SIZE (4U * 1024U * 1024U)
+
+struct backed_block_compare_task;
+
+/*
+ * Runs of blocks of two lists queued to be read back and compared on
+ * threads workers.  Don't care blocks and the short end of a backed block
+ * read as zeros, the way they are written out when an image is expanded.
+ */
+struct backed_block_compare {
+    unsigned int block_size;
+    unsigned int threads;
+    /* One byte per block, set if the block differs */
+    uint8_t *changed;
+    struct backed_block_compare_task *tasks;
+    unsigned int count;
+    unsigned int alloc;
+    unsigned int task_blocks;
+    /* Two task sized buffers per worker, one for each list */
+    char **bufs;
+};
+
+int backed_block_compare_init(struct backed_block_compare *c, unsigned int block_size,
+                              unsigned int blocks, unsigned int threads);
+void backed_block_compare_free(struct backed_block_compare *c);
+int backed_block_compare_add(struct backed_block_compare *c, struct backed_block *a_bb,
+                             struct backed_block *b_bb, unsigned int block, unsigned int count);
+/* Compares every queued run, setting changed for each block that differs */
+int backed_block_compare_run(struct backed_block_compare *c);
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
@@ -18,6 +18,7 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,9 @@
 
 #include <sparse/sparse.h>
 
+#include "simg_opt.h"
+#include "sparse_uring.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -40,17 +44,59 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [-s] [-z] [-q <depth>] [--stats] <raw_image_file> "
+            "<sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "  -s    only read allocated data, write holes as don't care chunks\n");
+    fprintf(stderr, "  -z    write all-zero blocks as don't care chunks\n");
+    fprintf(stderr, "  -q    keep up to depth writes in flight with io_uring when available\n");
+    fprintf(stderr, "  --stats  print chunk, i/o and time statistics to stderr\n");
 }
 
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
     int in;
     int out;
     int ret;
     struct sparse_file *s;
     unsigned int block_size = 4096;
+    enum sparse_read_mode mode = SPARSE_READ_MODE_NORMAL;
+    bool skip_zero = false;
+    unsigned int queue_depth = 0;
+    int opt;
     off_t len;
+    bool print_stats = false;
+    struct sparse_stats stats;
+
+    while ((opt = getopt_long(argc, argv, "szq:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            mode = SPARSE_READ_MODE_HOLE;
+            break;
+        case 'z':
+            skip_zero = true;
+            break;
+        case 'q':
+            queue_depth = parse_count(optarg, SPARSE_URING_MAX_DEPTH);
+            if (queue_depth < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc < 3 || argc > 4) {
         usage();
@@ -86,6 +132,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (print_stats) {
+        memset(&stats, 0, sizeof(stats));
+        sparse_set_stats(&stats);
+    }
+
     len = lseek(in, 0, SEEK_END);
     lseek(in, 0, SEEK_SET);
 
@@ -96,7 +147,9 @@ int main(int argc, char *argv[])
     }
 
     sparse_file_verbose(s);
-    ret = sparse_file_read(s, in, false, false);
+    sparse_file_set_skip_zero(s, skip_zero);
+    sparse_file_set_queue_depth(s, queue_depth);
+    ret = sparse_file_read(s, in, mode, false);
     if (ret) {
         fprintf(stderr, "Failed to read file\n");
         exit(-1);
@@ -108,6 +161,10 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (print_stats) {
+        sparse_stats_print(&stats);
+    }
+
     close(in);
     close(out);
 
@@ -18,6 +18,7 @@
 #define _LIBSPARSE_SPARSE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef	__cplusplus
@@ -203,6 +204,70 @@ unsigned int sparse_file_block_size(struct sparse_file *s);
 int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
 		int (*write)(void *priv, const void *data, int len), void *priv);
 
+/**
+ * sparse_file_pread - read part of a sparse file without expanding it
+ *
+ * @s - sparse file cookie
+ * @buf - buffer to read into
+ * @len - number of bytes to read
+ * @offset - byte offset in the expanded file to read from
+ *
+ * Reads the bytes a normal, non-sparse write of the file would have at offset,
+ * without writing anything out.  The block covering offset is found through
+ * the sorted block index, fill and don't care regions are answered from
+ * memory, and only data backed by a file or fd is read, with pread, so the
+ * position of the fd the file was imported from is not disturbed.  Reads do
+ * not have to be block aligned.
+ *
+ * Returns the number of bytes read, which is less than len only when the read
+ * reaches the end of the file, or negative errno on error.
+ */
+int64_t sparse_file_pread(struct sparse_file *s, void *buf, size_t len, int64_t offset);
+
+/* Size of the sha256 digests produced by the hash functions */
+#define SPARSE_SHA256_DIGEST_SIZE 32
+
+/**
+ * sparse_file_block_hashes - hash every block of a sparse file
+ *
+ * @s - sparse file cookie
+ * @salt - bytes hashed before each block, may be NULL if salt_len is 0
+ * @salt_len - length of salt
+ * @hashes - buffer for one SPARSE_SHA256_DIGEST_SIZE digest per block
+ *
+ * Stores the sha256 of salt followed by each block of the expanded file in
+ * hashes, in block order, without expanding the file.  Every fill and don't
+ * care block with the same value has the same hash, so it is only computed
+ * once per value.  Blocks with data are read and hashed on the number of
+ * threads set with sparse_file_set_threads.  A short last block is hashed as
+ * if padded with zeros.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_block_hashes(struct sparse_file *s, const void *salt, size_t salt_len,
+		uint8_t *hashes);
+
+/**
+ * sparse_file_hash_tree - build a dm-verity hash tree of a sparse file
+ *
+ * @s - sparse file cookie
+ * @salt - salt for every hash, may be NULL if salt_len is 0
+ * @salt_len - length of salt
+ * @fd - file descriptor to write the hash tree to, or -1
+ * @root_digest - buffer for the SPARSE_SHA256_DIGEST_SIZE root digest
+ *
+ * Builds the sha256 Merkle tree dm-verity uses, with hash blocks the size of
+ * the data blocks, from sparse_file_block_hashes.  Each level holds the
+ * hashes of the blocks of the level below, zero padded to a whole block, up
+ * to a level of a single block, whose hash is the root digest.  The tree is
+ * written to fd top level first, the layout veritysetup expects on a hash
+ * device.  The block size must be a power of two.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_hash_tree(struct sparse_file *s, const void *salt, size_t salt_len, int fd,
+		uint8_t *root_digest);
+
 /**
  * sparse_file_foreach_chunk - call a callback for data blocks in sparse file
  *
@@ -221,23 +286,42 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
 	int (*write)(void *priv, const void *data, int len, unsigned int block,
 		     unsigned int nr_blocks),
 	void *priv);
+/**
+ * enum sparse_read_mode - the method to use when reading in files
+ * @SPARSE_READ_MODE_NORMAL: The input is a regular file.  Constant chunks of
+ *                           data (including holes) will be converted to fill
+ *                           chunks.
+ * @SPARSE_READ_MODE_SPARSE: The input is an Android sparse file.
+ * @SPARSE_READ_MODE_HOLE: The input is a regular file.  Holes will be converted
+ *                         to "don't care" chunks without being read.  Other
+ *                         constant chunks will be converted to fill chunks.
+ */
+enum sparse_read_mode {
+    SPARSE_READ_MODE_NORMAL = false,
+    SPARSE_READ_MODE_SPARSE = true,
+    SPARSE_READ_MODE_HOLE,
+};
+
 /**
  * sparse_file_read - read a file into a sparse file cookie
  *
  * @s - sparse file cookie
  * @fd - file descriptor to read from
- * @sparse - read a file in the Android sparse file format
+ * @mode - mode to use when reading the input file
  * @crc - verify the crc of a file in the Android sparse file format
  *
- * Reads a file into a sparse file cookie.  If sparse is true, the file is
- * assumed to be in the Android sparse file format.  If sparse is false, the
- * file will be sparsed by looking for block aligned chunks of all zeros or
- * another 32 bit value.  If crc is true, the crc of the sparse file will be
- * verified.
+ * Reads a file into a sparse file cookie.  If @mode is
+ * SPARSE_READ_MODE_SPARSE, the file is assumed to be in the Android sparse
+ * file format.  Otherwise the file will be sparsed by looking for block
+ * aligned chunks of all zeros or another 32 bit value.  In
+ * SPARSE_READ_MODE_HOLE, the filesystem is asked for the data and hole
+ * extents of the file (SEEK_DATA/SEEK_HOLE, or FIEMAP where that is not
+ * available) and only the data is read.  If crc is true, the crc of the
+ * sparse file will be verified.
  *
  * Returns 0 on success, negative errno on error.
  */
-int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc);
+int sparse_file_read(struct sparse_file *s, int fd, enum sparse_read_mode mode, bool crc);
 
 /**
  * sparse_file_import - import an existing sparse file
@@ -271,6 +355,79 @@ struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc);
  */
 struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 
+/**
+ * sparse_file_stream - expand a sparse file as it is read
+ *
+ * @fd - file descriptor to read from
+ * @verbose - print verbose errors while reading the sparse file
+ * @crc - verify the crc of the sparse file
+ * @write - function to call for each block of expanded data
+ * @priv - value that will be passed as the first argument to write
+ *
+ * Reads a file in the Android sparse file format strictly sequentially and
+ * calls 'write' for the expanded data of each chunk as it arrives, so fd may
+ * be a pipe or socket.  Memory use is bounded by a single 1MB buffer no matter
+ * how large the chunks are.  As with sparse_file_callback, 'write' is called
+ * with data==NULL to skip over a region, and should return negative on error,
+ * 0 on success.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_stream(int fd, bool verbose, bool crc,
+		int (*write)(void *priv, const void *data, int len), void *priv);
+
+/**
+ * sparse_file_write_index - write a chunk index for an imported sparse file
+ *
+ * @s - sparse file cookie returned by sparse_file_import on fd
+ * @fd - file descriptor of the sparse image s was imported from
+ * @path - name of the index file to write, conventionally image.simg.idx
+ *
+ * Writes a compact index of the chunks of the sparse image in fd, with their
+ * block ranges, offsets in the image and fill values, so later imports can
+ * skip reading the chunk headers.  The index records the size, inode, mtime
+ * and ctime, to the nanosecond, and header crc of the image and is only used
+ * while they all still match.  The file is replaced atomically.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_write_index(struct sparse_file *s, int fd, const char *path);
+
+/**
+ * sparse_file_import_indexed - import a sparse file using its chunk index
+ *
+ * @fd - file descriptor of the sparse image to read from
+ * @path - name of the index file written by sparse_file_write_index
+ * @verbose - print verbose errors while reading the sparse file
+ *
+ * Recreates the same sparse file cookie as sparse_file_import, but from the
+ * index at path, which is mapped rather than read, so opening the image only
+ * costs the header read, the mapping and one O(1) append per entry.  If the
+ * index is missing, invalid, out of block order or was written for a
+ * different version of the image, the image is imported normally and a fresh
+ * index is written for next time, if path is writable.
+ *
+ * Returns a new sparse file cookie on success, NULL on error.
+ */
+struct sparse_file *sparse_file_import_indexed(int fd, const char *path, bool verbose);
+
+/**
+ * sparse_file_import_gz - import a gzipped raw image with restart points
+ *
+ * @fd - file descriptor to read from
+ * @verbose - print verbose errors while reading the file
+ *
+ * Reads the restart point index of a gzipped raw (non-sparse) image written
+ * by sparse_file_write after sparse_file_set_gz_restart, and returns a
+ * sparse file cookie whose blocks are backed by the compressed file.  Reading
+ * or writing a block only inflates the data between the restart point before
+ * it and the block.  The fd must remain open until the sparse file is
+ * destroyed, and any sparse files resparsed from it must be destroyed first.
+ *
+ * Returns a new sparse file cookie on success, NULL on error.
+ */
+struct sparse_file *sparse_file_import_gz(int fd, bool verbose);
+
 /** sparse_file_resparse - rechunk an existing sparse file into smaller files
  *
  * @in_s - sparse file cookie of the existing sparse file
@@ -285,6 +442,132 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/**
+ * sparse_file_resparse_alloc - rechunk a sparse file into an allocated array
+ *
+ * @in_s - sparse file cookie of the existing sparse file
+ * @max_len - maximum file size
+ * @out_s - set to a newly allocated array of sparse file cookies
+ *
+ * Like sparse_file_resparse, but splits in_s in a single pass and returns the
+ * resulting sparse files in an array allocated with malloc, instead of
+ * needing a first call to find out how many there will be.  The caller
+ * destroys each sparse file and frees the array.
+ *
+ * Returns the number of sparse files in out_s, or negative errno on error.
+ */
+int sparse_file_resparse_alloc(struct sparse_file *in_s, unsigned int max_len,
+		struct sparse_file ***out_s);
+
+/**
+ * sparse_file_delta - find the blocks that changed between two images
+ *
+ * @old_s - sparse file cookie of the image already on the device
+ * @new_s - sparse file cookie of the image to update it to
+ * @delta_s - set to a new sparse file cookie holding the changed blocks
+ *
+ * Compares the blocks of new_s with the same blocks of old_s and returns a
+ * sparse file the size of new_s holding only the blocks that differ, with
+ * don't care everywhere else, so that writing it over old_s gives new_s.
+ * Fills over fills are compared by value without reading anything, blocks
+ * over a don't care block of old_s are always included, and don't care
+ * blocks of new_s never are.  The rest of the blocks are read from both
+ * files and compared on the number of threads set on new_s with
+ * sparse_file_set_threads.  The block sizes must match.
+ *
+ * The delta shares the data of new_s, which must not be destroyed before it.
+ *
+ * Returns the number of blocks in the delta, or negative errno on error.
+ */
+int64_t sparse_file_delta(struct sparse_file *old_s, struct sparse_file *new_s,
+		struct sparse_file **delta_s);
+
+/**
+ * sparse_file_overlay - lay one sparse file over another
+ *
+ * @base - sparse file cookie of the bottom image
+ * @top - sparse file cookie of the image laid over it
+ * @out_s - set to a new sparse file cookie holding the combined image
+ *
+ * Returns a sparse file as long as the longer of base and top, in which every
+ * block defined in top comes from top and every other block comes from base.
+ * The chunks of both files are merged in one linear pass without reading any
+ * data, and the result refers to the same memory, files and fds as its inputs, so
+ * neither base nor top may be destroyed before it.  The block sizes must
+ * match.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_overlay(struct sparse_file *base, struct sparse_file *top,
+		struct sparse_file **out_s);
+
+/**
+ * sparse_file_diff - find the blocks that differ between two images
+ *
+ * @a - sparse file cookie of the first image
+ * @b - sparse file cookie of the second image
+ * @range - function to call for each run of differing blocks, or NULL
+ * @priv - value that will be passed as the first argument to range
+ *
+ * Compares the expanded contents of a and b, in which don't care blocks read
+ * as zeros, and calls range with the first block and block count of each
+ * maximal run of blocks that differ, in increasing order.  Runs that are fill
+ * or don't care in both files are compared by value without reading
+ * anything, and only blocks with data in either file are read and compared,
+ * on the number of threads set on a with sparse_file_set_threads.  Blocks
+ * past the end of the shorter file always differ.  The block sizes must
+ * match.  range should return negative on error, which stops the diff.
+ *
+ * Returns the number of blocks that differ, or negative errno on error.
+ */
+int64_t sparse_file_diff(struct sparse_file *a, struct sparse_file *b,
+		int (*range)(void *priv, unsigned int block, unsigned int count),
+		void *priv);
+
+/**
+ * sparse_file_append - append a sparse file to a sparse image in place
+ *
+ * @s - sparse file cookie of the data to append
+ * @fd - file descriptor of a sparse image, open for reading and writing
+ *
+ * Writes the chunks of s at the end of the existing sparse image in fd,
+ * after its last chunk, so that block 0 of s follows the last block of the
+ * image.  Only the new chunks and the sparse header are written, so the cost
+ * depends on the size of s rather than the size of the image.  If the image
+ * ends with a crc chunk, a new crc chunk covering the whole image is written
+ * after the new chunks and the old one is left in place.
+ *
+ * The new chunks are synced before the header is rewritten to include them,
+ * so if the append is interrupted the image reads as it did before.  The
+ * length of s must be a multiple of the block size, and the image must use
+ * the same block size and standard chunk header size.
+ *
+ * Returns 0 on success, -EINVAL if fd can't be appended to in place, or
+ * another negative errno on error.
+ */
+int sparse_file_append(struct sparse_file *s, int fd);
+
+/**
+ * sparse_file_write_split - write several sparse files at once
+ *
+ * @files - array of sparse file cookies, usually from sparse_file_resparse
+ * @fds - file descriptor to write each sparse file to
+ * @count - number of entries in files and fds
+ * @gz - write gzipped files
+ * @sparse - write in the Android sparse file format
+ * @crc - append a crc chunk
+ * @threads - number of files to write at the same time
+ *
+ * Writes files[i] to fds[i] with sparse_file_write for every i, spreading the
+ * files over up to threads threads.  The files may share backing files and
+ * fds, such as the image they were resparsed from, since data is read at
+ * explicit offsets.  Each fd must be different.
+ *
+ * Returns 0 on success, or the first negative errno returned by a write.
+ */
+int sparse_file_write_split(struct sparse_file **files, const int *fds, int count,
+		bool gz, bool sparse, bool crc, unsigned int threads);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
@@ -294,6 +577,65 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_set_threads - set the number of threads used to write a file
+ *
+ * @s - sparse file cookie
+ * @threads - number of worker threads, 0 or 1 to write serially, at most 256
+ *
+ * When sparse_file_write is asked for a plain, non-gzipped file without a crc,
+ * chunks are expanded by this many threads, each writing its chunks directly
+ * at their final offsets in the output.  The result is identical to a serial
+ * write.  Output that can't be written at an offset, such as a pipe, is still
+ * written serially.  Gzipped output is deflated in independent 512KB blocks
+ * by this many threads and joined into a single gzip member, which is not
+ * byte identical to the serial output but decompresses to the same data.
+ */
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads);
+
+/**
+ * sparse_file_set_queue_depth - keep several writes in flight on an io_uring
+ *
+ * @s - sparse file cookie
+ * @depth - writes in flight at once, at most 256, or 0 to write synchronously
+ *
+ * When sparse_file_write writes a non-gzipped file, data and fill chunks are
+ * gathered into depth 256KB buffers registered with the kernel and submitted
+ * through io_uring without waiting for earlier writes to finish.  If io_uring
+ * is not available, or the output can't be written at an offset, the file is
+ * written synchronously as usual.  A parallel expansion requested with
+ * sparse_file_set_threads takes precedence.
+ */
+void sparse_file_set_queue_depth(struct sparse_file *s, unsigned int depth);
+
+/**
+ * sparse_file_set_gz_restart - add restart points to gzipped output
+ *
+ * @s - sparse file cookie
+ * @interval - bytes of uncompressed data between restart points, 0 for none
+ *
+ * When sparse_file_write writes a gzipped raw file, start a fresh deflate
+ * stream with no history every interval bytes (rounded up to a multiple of
+ * 512KB, at most 1GB) and append an index of these restart points after the
+ * data, in the extra field of empty gzip members.  The file still
+ * decompresses with any gunzip, and sparse_file_import_gz can read any block
+ * of it by inflating only the segment that covers it.  Gzipped sparse format
+ * output gets no restart points, since they would not map onto blocks.
+ */
+void sparse_file_set_gz_restart(struct sparse_file *s, unsigned int interval);
+
+/**
+ * sparse_file_set_skip_zero - read all-zero blocks as don't care
+ *
+ * @s - sparse file cookie
+ * @skip - true to leave all-zero blocks out of the sparse file
+ *
+ * When reading a regular file with sparse_file_read, blocks that contain only
+ * zeros are left as "don't care" regions instead of becoming zero fill chunks.
+ * Only use this if the consumer of the image treats don't care as zero.
+ */
+void sparse_file_set_skip_zero(struct sparse_file *s, bool skip);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
@@ -303,6 +645,90 @@ void sparse_file_verbose(struct sparse_file *s);
  */
 extern void (*sparse_print_verbose)(const char *fmt, ...);
 
+/**
+ * sparse_set_log - send the calling thread's messages to a callback
+ *
+ * @log - function called with each formatted message, or NULL
+ * @priv - value that will be passed as the first argument to log
+ *
+ * Errors and verbose errors from libsparse calls made on the calling thread,
+ * including from worker threads those calls start, are passed to log instead
+ * of being printed to standard error and through sparse_print_verbose.  This
+ * keeps the messages of conversions running at the same time on different
+ * threads apart.  Verbose errors are still only produced when verbose is set.
+ * A NULL log restores the default.
+ *
+ * Apart from sparse_print_verbose, libsparse keeps no global state, so
+ * different sparse files can be used from different threads at the same
+ * time.  A single sparse file must not be used from two threads at once.
+ */
+void sparse_set_log(void (*log)(void *priv, const char *msg), void *priv);
+
+/* Chunk types counted in struct sparse_stats */
+enum sparse_stats_chunk {
+    SPARSE_STATS_CHUNK_RAW,
+    SPARSE_STATS_CHUNK_FILL,
+    SPARSE_STATS_CHUNK_DONT_CARE,
+    SPARSE_STATS_CHUNK_CRC32,
+    SPARSE_STATS_CHUNK_TYPES,
+};
+
+/* Phases the time spent in libsparse is split into */
+enum sparse_stats_phase {
+    /* Reading and checking sparse and chunk headers, writing the sparse header */
+    SPARSE_STATS_PHASE_HEADER,
+    /* Computing image checksums */
+    SPARSE_STATS_PHASE_CRC,
+    /* Reading and writing the payload of data chunks */
+    SPARSE_STATS_PHASE_IO,
+    /* Writing fill and don't care chunks and padding the output */
+    SPARSE_STATS_PHASE_PAD,
+    /* Reading raw images and finding their fill and zero blocks */
+    SPARSE_STATS_PHASE_SCAN,
+    /* Splitting sparse files with sparse_file_resparse */
+    SPARSE_STATS_PHASE_SPLIT,
+    SPARSE_STATS_PHASES,
+};
+
+struct sparse_stats {
+    /* Chunks parsed from sparse images */
+    uint64_t chunks_read[SPARSE_STATS_CHUNK_TYPES];
+    /* Chunks written, expanded or not */
+    uint64_t chunks_written[SPARSE_STATS_CHUNK_TYPES];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    /* read, pread, mmap, write, pwrite, writev, copy_file_range, splice,
+     * io_uring_enter and gzwrite calls */
+    uint64_t read_calls;
+    uint64_t write_calls;
+    /* lseek calls */
+    uint64_t seek_calls;
+    /* ftruncate, fallocate and fstat calls */
+    uint64_t other_calls;
+    /* Nanoseconds spent in each phase, summed over worker threads */
+    uint64_t phase_ns[SPARSE_STATS_PHASES];
+};
+
+/**
+ * sparse_set_stats - count what the calling thread's libsparse calls do
+ *
+ * @stats - statistics to add to, or NULL
+ *
+ * Counters and phase times of libsparse calls made on the calling thread,
+ * including from worker threads those calls start, are added to stats until
+ * sparse_set_stats is called again.  stats is not cleared first, so several
+ * calls can be added up.  A NULL stats, the default, turns counting off, which
+ * leaves a test of a thread local variable at each counting point.
+ */
+void sparse_set_stats(struct sparse_stats *stats);
+
+/**
+ * sparse_stats_print - print statistics to standard error
+ *
+ * @stats - statistics gathered with sparse_set_stats
+ */
+void sparse_stats_print(const struct sparse_stats *stats);
+
 #ifdef	__cplusplus
 }
 #endif
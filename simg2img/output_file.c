@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -33,9 +35,14 @@
 #include "output_file.h"
 #include "sparse_crc32.h"
 #include "sparse_format.h"
+#include "sparse_gz.h"
+#include "sparse_parallel.h"
+#include "sparse_stats.h"
+#include "sparse_uring.h"
 
 #ifndef USE_MINGW
 #include <sys/mman.h>
+#include <sys/uio.h>
 #define O_BINARY 0
 #else
 #define ftruncate ftruncate
@@ -50,12 +57,17 @@
 
 #define min(a, b) \
 	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+#define max(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a > _b) ? _a : _b; })
 
 #define SPARSE_HEADER_MAJOR_VER 1
 #define SPARSE_HEADER_MINOR_VER 0
 #define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
 #define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
 
+/* Largest run of a fill value written at once when expanding fill chunks */
+#define FILL_BUF_SIZE (1024U * 1024U)
+
 #define container_of(inner, outer_t, elem) \
 	((outer_t *)((char *)(inner) - offsetof(outer_t, elem)))
 
@@ -64,6 +76,9 @@ struct output_file_ops {
     int (*skip) (struct output_file *, int64_t);
     int (*pad) (struct output_file *, int64_t);
     int (*write) (struct output_file *, void *, size_t);
+    int (*copy_fd) (struct output_file *, int fd, int64_t *offset, unsigned int *len);
+    int (*flush) (struct output_file *);
+    int (*zero) (struct output_file *, int64_t len);
     void (*close) (struct output_file *);
 };
 
@@ -85,6 +100,10 @@ struct output_file {
     int64_t len;
     char *zero_buf;
     uint32_t *fill_buf;
+    /* Bytes allocated for fill_buf, and how many of them hold fill_val */
+    unsigned int fill_buf_size;
+    unsigned int fill_buf_len;
+    uint32_t fill_val;
     char *buf;
 };
 
@@ -96,14 +115,44 @@ struct output_file_gz {
 #define to_output_file_gz(_o) \
 	container_of((_o), struct output_file_gz, out)
 
+/* Ways of moving fd chunks to a normal output file, in order of preference */
+enum copy_mode {
+    COPY_FILE_RANGE,
+    COPY_SPLICE,
+    COPY_NONE,
+};
+
+/*
+ * Writes smaller than this are gathered in the write buffer of a normal
+ * output file, larger ones go out in one writev with whatever is buffered.
+ */
+#define NORMAL_BUF_SIZE (256U * 1024U)
+#define NORMAL_BYPASS_SIZE (64U * 1024U)
+
 struct output_file_normal {
     struct output_file out;
     int fd;
+    enum copy_mode copy_mode;
+    int pipe_fd[2];
+    char *buf;
+    size_t buf_len;
 };
 
 #define to_output_file_normal(_o) \
 	container_of((_o), struct output_file_normal, out)
 
+struct output_file_uring {
+    struct output_file out;
+    int fd;
+    /* Writes go to explicit offsets, the fd position is set again on close */
+    int64_t pos;
+    unsigned int depth;
+    struct sparse_uring *ring;
+};
+
+#define to_output_file_uring(_o) \
+	container_of((_o), struct output_file_uring, out)
+
 struct output_file_callback {
     struct output_file out;
     void *priv;
@@ -121,12 +170,78 @@ static int file_open(struct output_file *out, int fd)
     return 0;
 }
 
+/* Writes out the buffered bytes followed by len bytes of data */
+static int file_flush_with(struct output_file_normal *outn, const void *data, size_t len)
+{
+#ifndef USE_MINGW
+    struct iovec iov[2] = {
+        { .iov_base = outn->buf, .iov_len = outn->buf_len },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    struct iovec *v = iov;
+    int cnt = 2;
+    ssize_t ret;
+
+    while (cnt > 0) {
+        if (v->iov_len == 0) {
+            v++;
+            cnt--;
+            continue;
+        }
+
+        ret = writev(outn->fd, v, cnt);
+        stats_add(write_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_errno("writev");
+            return -1;
+        }
+        stats_add(bytes_written, ret);
+
+        for (; cnt > 0 && (size_t)ret >= v->iov_len; v++, cnt--) {
+            ret -= v->iov_len;
+            v->iov_len = 0;
+        }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+#else
+    if (write_all(outn->fd, outn->buf, outn->buf_len) < 0 || write_all(outn->fd, data, len) < 0) {
+        error_errno("write");
+        return -1;
+    }
+#endif
+
+    outn->buf_len = 0;
+    return 0;
+}
+
+static int file_flush(struct output_file *out)
+{
+    struct output_file_normal *outn = to_output_file_normal(out);
+
+    if (outn->buf_len == 0) {
+        return 0;
+    }
+
+    return file_flush_with(outn, NULL, 0);
+}
+
 static int file_skip(struct output_file *out, int64_t cnt)
 {
     off_t ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    if (file_flush(out) < 0) {
+        return -1;
+    }
+
     ret = lseek(outn->fd, cnt, SEEK_CUR);
+    stats_add(seek_calls, 1);
     if (ret < 0) {
         error_errno("lseek");
         return -1;
@@ -139,7 +254,13 @@ static int file_pad(struct output_file *out, int64_t len)
     int ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    ret = file_flush(out);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = ftruncate(outn->fd, len);
+    stats_add(other_calls, 1);
     if (ret < 0) {
         return -errno;
     }
@@ -147,32 +268,205 @@ static int file_pad(struct output_file *out, int64_t len)
     return 0;
 }
 
+/* Moves over len bytes that must read as zeros without writing them */
+static int file_zero(struct output_file *out, int64_t len)
+{
+    struct output_file_normal *outn = to_output_file_normal(out);
+    struct stat st;
+    off_t pos;
+    int ret;
+
+    if (file_flush(out) < 0) {
+        return -1;
+    }
+
+    pos = lseek(outn->fd, 0, SEEK_CUR);
+    stats_add(seek_calls, 1);
+    stats_add(other_calls, 1);
+    if (pos < 0 || fstat(outn->fd, &st) < 0) {
+        return -EOPNOTSUPP;
+    }
+
+    ret = zero_fd_range(outn->fd, pos, len, S_ISREG(st.st_mode) ? st.st_size : -1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return file_skip(out, len);
+}
+
+/*
+ * Sparse images from make_ext4fs are mostly tiny chunks, so chunk headers and
+ * small payloads are gathered into one buffer rather than each costing a
+ * write.  A large payload is written straight from the caller's memory, in
+ * one writev with the header buffered before it.
+ */
 static int file_write(struct output_file *out, void *data, size_t len)
 {
-    ssize_t ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
-    while (len > 0) {
-        ret = write(outn->fd, data, len);
+    if (len >= NORMAL_BYPASS_SIZE) {
+        return file_flush_with(outn, data, len);
+    }
+
+    if (outn->buf_len + len > NORMAL_BUF_SIZE && file_flush(out) < 0) {
+        return -1;
+    }
+
+    memcpy(outn->buf + outn->buf_len, data, len);
+    outn->buf_len += len;
+
+    return 0;
+}
+
+#ifdef __linux__
+/* Errors meaning the kernel can't move data between these two files */
+static bool copy_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+        err == EBADF || err == ESPIPE;
+}
+
+static int file_copy_range(struct output_file_normal *outn, int fd,
+                           int64_t *offset, unsigned int *len)
+{
+    loff_t off_in = *offset;
+    ssize_t ret;
+
+    while (*len > 0) {
+        ret = copy_file_range(fd, &off_in, outn->fd, NULL, *len, 0);
+        stats_add(write_calls, 1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret == 0) {
+            /* The source ends before the chunk does, like read_all */
+            error("copy_file_range: short read");
+            return -EINVAL;
+        }
         if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
+            if (copy_unsupported(errno)) {
+                return -EOPNOTSUPP;
             }
-            error_errno("write");
-            return -1;
+            ret = -errno;
+            error_errno("copy_file_range");
+            return ret;
         }
 
-        data = (char *)data + ret;
-        len -= ret;
+        stats_add(bytes_read, ret);
+        stats_add(bytes_written, ret);
+        *offset += ret;
+        *len -= ret;
     }
 
     return 0;
 }
 
+static int file_splice(struct output_file_normal *outn, int fd, int64_t *offset, unsigned int *len)
+{
+    loff_t off_in = *offset;
+    ssize_t in, ret;
+    char buf[4096];
+
+    if (outn->pipe_fd[0] < 0 && pipe(outn->pipe_fd) < 0) {
+        return -EOPNOTSUPP;
+    }
+
+    while (*len > 0) {
+        in = splice(fd, &off_in, outn->pipe_fd[1], NULL, *len, SPLICE_F_MOVE);
+        stats_add(read_calls, 1);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in == 0) {
+            error("splice: short read");
+            return -EINVAL;
+        }
+        if (in < 0) {
+            if (copy_unsupported(errno)) {
+                return -EOPNOTSUPP;
+            }
+            in = -errno;
+            error_errno("splice");
+            return in;
+        }
+
+        stats_add(bytes_read, in);
+        *offset += in;
+        *len -= in;
+
+        while (in > 0) {
+            ret = splice(outn->pipe_fd[0], NULL, outn->fd, NULL, in, SPLICE_F_MOVE);
+            stats_add(write_calls, 1);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0 && copy_unsupported(errno)) {
+                /* Drain what is already in the pipe the slow way */
+                while (in > 0) {
+                    ret = read(outn->pipe_fd[0], buf, min(in, (ssize_t) sizeof(buf)));
+                    if (ret <= 0 || file_write(&outn->out, buf, ret) < 0) {
+                        return -EIO;
+                    }
+                    in -= ret;
+                }
+                return -EOPNOTSUPP;
+            }
+            if (ret <= 0) {
+                error_errno("splice");
+                return -EIO;
+            }
+            stats_add(bytes_written, ret);
+            in -= ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Moves as much of [*offset, *offset + *len) of fd to the output as the
+ * kernel allows without a trip through user memory, advancing offset and
+ * len.  Returns -EOPNOTSUPP if the rest has to be copied by the caller.
+ */
+static int file_copy_fd(struct output_file *out, int fd, int64_t *offset, unsigned int *len)
+{
+    struct output_file_normal *outn = to_output_file_normal(out);
+    int ret = -EOPNOTSUPP;
+
+    if (outn->copy_mode != COPY_NONE && file_flush(out) < 0) {
+        return -EIO;
+    }
+
+    if (outn->copy_mode == COPY_FILE_RANGE) {
+        ret = file_copy_range(outn, fd, offset, len);
+        if (ret != -EOPNOTSUPP) {
+            return ret;
+        }
+        outn->copy_mode = COPY_SPLICE;
+    }
+
+    if (outn->copy_mode == COPY_SPLICE) {
+        ret = file_splice(outn, fd, offset, len);
+        if (ret != -EOPNOTSUPP) {
+            return ret;
+        }
+        outn->copy_mode = COPY_NONE;
+    }
+
+    return ret;
+}
+#endif
+
 static void file_close(struct output_file *out)
 {
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    if (outn->pipe_fd[0] >= 0) {
+        close(outn->pipe_fd[0]);
+        close(outn->pipe_fd[1]);
+    }
+    free(outn->buf);
     free(outn);
 }
 
@@ -181,9 +475,131 @@ static struct output_file_ops file_ops = {
     .skip = file_skip,
     .pad = file_pad,
     .write = file_write,
+#ifdef __linux__
+    .copy_fd = file_copy_fd,
+#endif
+    .flush = file_flush,
+    .zero = file_zero,
     .close = file_close,
 };
 
+static int uring_file_open(struct output_file *out, int fd)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+
+    outu->fd = fd;
+    outu->pos = lseek(fd, 0, SEEK_CUR);
+    if (outu->pos < 0) {
+        return -errno;
+    }
+
+    outu->ring = sparse_uring_new(fd, outu->depth);
+    if (!outu->ring) {
+        return -EOPNOTSUPP;
+    }
+
+    return 0;
+}
+
+static int uring_file_skip(struct output_file *out, int64_t cnt)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+
+    outu->pos += cnt;
+    return 0;
+}
+
+static int uring_file_pad(struct output_file *out, int64_t len)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+    int ret;
+
+    ret = sparse_uring_wait(outu->ring);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = ftruncate(outu->fd, len);
+    stats_add(other_calls, 1);
+    if (ret < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int uring_file_write(struct output_file *out, void *data, size_t len)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+    int ret;
+
+    ret = sparse_uring_write(outu->ring, data, len, outu->pos);
+    if (ret < 0) {
+        return ret;
+    }
+    outu->pos += len;
+
+    return 0;
+}
+
+static int uring_file_zero(struct output_file *out, int64_t len)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+    struct stat st;
+    int ret;
+
+    /* Queued writes all end at or before pos, so they can't overlap */
+    stats_add(other_calls, 1);
+    if (fstat(outu->fd, &st) < 0) {
+        return -EOPNOTSUPP;
+    }
+
+    ret = zero_fd_range(outu->fd, outu->pos, len, S_ISREG(st.st_mode) ? st.st_size : -1);
+    if (ret < 0) {
+        return ret;
+    }
+    outu->pos += len;
+
+    return 0;
+}
+
+static int uring_file_flush(struct output_file *out)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+    int ret;
+
+    ret = sparse_uring_wait(outu->ring);
+    stats_add(seek_calls, 1);
+    if (lseek(outu->fd, outu->pos, SEEK_SET) < 0 && ret == 0) {
+        ret = -errno;
+    }
+
+    return ret;
+}
+
+static void uring_file_close(struct output_file *out)
+{
+    struct output_file_uring *outu = to_output_file_uring(out);
+
+    sparse_uring_destroy(outu->ring);
+    free(outu);
+}
+
+/*
+ * Queues writes on an io_uring so several are in flight at once.  Chunks
+ * backed by a file are read and queued like any other data instead of being
+ * copied by the kernel, which would wait for each copy in turn.
+ */
+static struct output_file_ops uring_file_ops = {
+    .open = uring_file_open,
+    .skip = uring_file_skip,
+    .pad = uring_file_pad,
+    .write = uring_file_write,
+    .flush = uring_file_flush,
+    .zero = uring_file_zero,
+    .close = uring_file_close,
+};
+
 static int gz_file_open(struct output_file *out, int fd)
 {
     struct output_file_gz *outgz = to_output_file_gz(out);
@@ -207,66 +623,383 @@ static int gz_file_skip(struct output_file *out, int64_t cnt)
         error_errno("gzseek");
         return -1;
     }
-    return 0;
+    return 0;
+}
+
+static int gz_file_pad(struct output_file *out, int64_t len)
+{
+    off_t ret;
+    struct output_file_gz *outgz = to_output_file_gz(out);
+
+    ret = gztell(outgz->gz_fd);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (ret >= len) {
+        return 0;
+    }
+
+    ret = gzseek(outgz->gz_fd, len - 1, SEEK_SET);
+    if (ret < 0) {
+        return -1;
+    }
+
+    gzwrite(outgz->gz_fd, "", 1);
+
+    return 0;
+}
+
+static int gz_file_write(struct output_file *out, void *data, size_t len)
+{
+    int ret;
+    struct output_file_gz *outgz = to_output_file_gz(out);
+
+    while (len > 0) {
+        ret = gzwrite(outgz->gz_fd, data,
+                  min(len, (unsigned int)INT_MAX));
+        stats_add(write_calls, 1);
+        if (ret == 0) {
+            error("gzwrite %s", gzerror(outgz->gz_fd, NULL));
+            return -1;
+        }
+        stats_add(bytes_written, ret);
+        len -= ret;
+        data = (char *)data + ret;
+    }
+
+    return 0;
+}
+
+static void gz_file_close(struct output_file *out)
+{
+    struct output_file_gz *outgz = to_output_file_gz(out);
+
+    gzclose(outgz->gz_fd);
+    free(outgz);
+}
+
+static struct output_file_ops gz_file_ops = {
+    .open = gz_file_open,
+    .skip = gz_file_skip,
+    .pad = gz_file_pad,
+    .write = gz_file_write,
+    .close = gz_file_close,
+};
+
+/* Size of the blocks the parallel gzip output deflates independently */
+#define PGZ_BLOCK_SIZE (512U * 1024U)
+
+/* Deflate history carried into each block from the data before it */
+#define PGZ_DICT_SIZE (32U * 1024U)
+
+/* Blocks gathered per worker before a batch is deflated */
+#define PGZ_BLOCKS_PER_THREAD 2
+
+/* Largest distance between restart points */
+#define PGZ_RESTART_MAX (1024U * 1024U * 1024U)
+
+struct pgz_block {
+    unsigned char *out;
+    size_t out_size;
+    size_t out_len;
+    unsigned int len;
+    uint32_t crc;
+};
+
+/*
+ * Writes a single gzip member like the gz backend, but deflates
+ * PGZ_BLOCK_SIZE blocks of input on several threads.  Each block is primed
+ * with the last PGZ_DICT_SIZE bytes before it and ends in a sync flush, so
+ * the raw deflate streams can simply be concatenated, and their crcs are
+ * combined for the trailer.
+ *
+ * With restart points, every block starting a multiple of restart bytes
+ * into the data is deflated without a dictionary, so inflate can begin at it,
+ * and the points are listed in an index after the gzip member.
+ */
+struct output_file_pgz {
+    struct output_file out;
+    int fd;
+    unsigned int threads;
+    unsigned int nblocks;
+    /* PGZ_DICT_SIZE bytes of history, then nblocks blocks of input */
+    unsigned char *in;
+    size_t in_len;
+    struct pgz_block *blocks;
+    z_stream *strms;
+    bool *strm_init;
+    uint32_t crc;
+    uint64_t total;
+    /* Compressed bytes written so far */
+    int64_t written;
+    unsigned int restart;
+    sparse_gz_point_t *points;
+    unsigned int point_count;
+    unsigned int point_cap;
+};
+
+#define to_output_file_pgz(_o) \
+	container_of((_o), struct output_file_pgz, out)
+
+static int pgz_deflate_block(void *priv, unsigned int worker, unsigned int idx)
+{
+    struct output_file_pgz *outpgz = priv;
+    struct pgz_block *b = &outpgz->blocks[idx];
+    z_stream *strm = &outpgz->strms[worker];
+    unsigned char *start = outpgz->in + PGZ_DICT_SIZE + (size_t)idx * PGZ_BLOCK_SIZE;
+    uint64_t history = outpgz->total + (uint64_t)idx * PGZ_BLOCK_SIZE;
+    unsigned int dict_len = min(history, (uint64_t) PGZ_DICT_SIZE);
+    size_t bound;
+    int ret;
+
+    if (outpgz->restart && history % outpgz->restart == 0) {
+        dict_len = 0;
+    }
+
+    b->len = min(outpgz->in_len - (size_t)idx * PGZ_BLOCK_SIZE, (size_t) PGZ_BLOCK_SIZE);
+    b->crc = sparse_crc32(0, start, b->len);
+
+    if (!outpgz->strm_init[worker]) {
+        ret = deflateInit2(strm, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            return -ENOMEM;
+        }
+        outpgz->strm_init[worker] = true;
+    } else {
+        deflateReset(strm);
+    }
+
+    if (dict_len) {
+        deflateSetDictionary(strm, start - dict_len, dict_len);
+    }
+
+    /* Room for the worst case plus the empty stored block of the flush */
+    bound = deflateBound(strm, b->len) + 16;
+    if (b->out_size < bound) {
+        free(b->out);
+        b->out = malloc(bound);
+        if (!b->out) {
+            b->out_size = 0;
+            return -ENOMEM;
+        }
+        b->out_size = bound;
+    }
+
+    strm->next_in = start;
+    strm->avail_in = b->len;
+    strm->next_out = b->out;
+    strm->avail_out = b->out_size;
+    ret = deflate(strm, Z_SYNC_FLUSH);
+    if (ret != Z_OK || strm->avail_in != 0 || strm->avail_out == 0) {
+        return -EIO;
+    }
+    b->out_len = b->out_size - strm->avail_out;
+
+    return 0;
+}
+
+/* Records that inflate can start at the current output position */
+static int pgz_add_point(struct output_file_pgz *outpgz, uint64_t in)
+{
+    sparse_gz_point_t *points;
+
+    if (outpgz->point_count == outpgz->point_cap) {
+        outpgz->point_cap = outpgz->point_cap ? outpgz->point_cap * 2 : 64;
+        points = realloc(outpgz->points, outpgz->point_cap * sizeof(*points));
+        if (!points) {
+            return -ENOMEM;
+        }
+        outpgz->points = points;
+    }
+
+    outpgz->points[outpgz->point_count].in = in;
+    outpgz->points[outpgz->point_count].out = outpgz->written;
+    outpgz->point_count++;
+
+    return 0;
+}
+
+/* Deflates the buffered input and writes it out in order */
+static int pgz_flush(struct output_file_pgz *outpgz)
+{
+    unsigned int count = DIV_ROUND_UP(outpgz->in_len, PGZ_BLOCK_SIZE);
+    unsigned int i;
+    uint64_t in;
+    int ret;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    ret = sparse_parallel_for(outpgz->threads, count, pgz_deflate_block, outpgz);
+    if (ret < 0) {
+        error("deflate failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        in = outpgz->total + (uint64_t)i * PGZ_BLOCK_SIZE;
+        if (outpgz->restart && in % outpgz->restart == 0) {
+            ret = pgz_add_point(outpgz, in);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        ret = write_all(outpgz->fd, outpgz->blocks[i].out, outpgz->blocks[i].out_len);
+        if (ret < 0) {
+            error("write: %s", strerror(-ret));
+            return ret;
+        }
+        outpgz->written += outpgz->blocks[i].out_len;
+        outpgz->crc = sparse_crc32_combine(outpgz->crc, outpgz->blocks[i].crc,
+                                           outpgz->blocks[i].len);
+    }
+
+    /* The end of this batch is the history of the next one */
+    memmove(outpgz->in, outpgz->in + outpgz->in_len, PGZ_DICT_SIZE);
+    outpgz->total += outpgz->in_len;
+    outpgz->in_len = 0;
+
+    return 0;
+}
+
+/* Adds len bytes of data, or of zeros if data is NULL, to the input */
+static int pgz_add(struct output_file_pgz *outpgz, const void *data, uint64_t len)
+{
+    size_t cap = (size_t)outpgz->nblocks * PGZ_BLOCK_SIZE;
+    unsigned char *dst;
+    size_t n;
+    int ret;
+
+    while (len > 0) {
+        n = min((uint64_t) (cap - outpgz->in_len), len);
+        dst = outpgz->in + PGZ_DICT_SIZE + outpgz->in_len;
+        if (data) {
+            memcpy(dst, data, n);
+            data = (const char *)data + n;
+        } else {
+            memset(dst, 0, n);
+        }
+        outpgz->in_len += n;
+        len -= n;
+
+        if (outpgz->in_len == cap) {
+            ret = pgz_flush(outpgz);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Frees the buffers and the output itself, leaving fd open */
+static void pgz_release(struct output_file_pgz *outpgz)
+{
+    unsigned int i;
+
+    for (i = 0; outpgz->strm_init && i < outpgz->threads; i++) {
+        if (outpgz->strm_init[i]) {
+            deflateEnd(&outpgz->strms[i]);
+        }
+    }
+    for (i = 0; outpgz->blocks && i < outpgz->nblocks; i++) {
+        free(outpgz->blocks[i].out);
+    }
+    free(outpgz->points);
+    free(outpgz->strm_init);
+    free(outpgz->strms);
+    free(outpgz->blocks);
+    free(outpgz->in);
+    free(outpgz);
+}
+
+static int pgz_file_open(struct output_file *out, int fd)
+{
+    struct output_file_pgz *outpgz = to_output_file_pgz(out);
+    /* gzip header: deflate, no name or mtime, maximum compression, Unix */
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3
+    };
+
+    outpgz->fd = fd;
+    outpgz->nblocks = outpgz->threads * PGZ_BLOCKS_PER_THREAD;
+    outpgz->in = malloc(PGZ_DICT_SIZE + (size_t)outpgz->nblocks * PGZ_BLOCK_SIZE);
+    outpgz->blocks = calloc(outpgz->nblocks, sizeof(*outpgz->blocks));
+    outpgz->strms = calloc(outpgz->threads, sizeof(*outpgz->strms));
+    outpgz->strm_init = calloc(outpgz->threads, sizeof(*outpgz->strm_init));
+    if (!outpgz->in || !outpgz->blocks || !outpgz->strms || !outpgz->strm_init) {
+        error_errno("malloc pgz buffers");
+        return -ENOMEM;
+    }
+
+    outpgz->written = sizeof(header);
+
+    return write_all(fd, header, sizeof(header));
 }
 
-static int gz_file_pad(struct output_file *out, int64_t len)
+static int pgz_file_skip(struct output_file *out, int64_t cnt)
 {
-    off_t ret;
-    struct output_file_gz *outgz = to_output_file_gz(out);
+    return pgz_add(to_output_file_pgz(out), NULL, cnt);
+}
 
-    ret = gztell(outgz->gz_fd);
-    if (ret < 0) {
-        return -1;
-    }
+static int pgz_file_pad(struct output_file *out, int64_t len)
+{
+    struct output_file_pgz *outpgz = to_output_file_pgz(out);
+    int64_t cur = outpgz->total + outpgz->in_len;
 
-    if (ret >= len) {
+    if (cur >= len) {
         return 0;
     }
 
-    ret = gzseek(outgz->gz_fd, len - 1, SEEK_SET);
-    if (ret < 0) {
-        return -1;
-    }
-
-    gzwrite(outgz->gz_fd, "", 1);
+    return pgz_add(outpgz, NULL, len - cur);
+}
 
-    return 0;
+static int pgz_file_write(struct output_file *out, void *data, size_t len)
+{
+    return pgz_add(to_output_file_pgz(out), data, len);
 }
 
-static int gz_file_write(struct output_file *out, void *data, size_t len)
+static void pgz_file_close(struct output_file *out)
 {
-    int ret;
-    struct output_file_gz *outgz = to_output_file_gz(out);
+    struct output_file_pgz *outpgz = to_output_file_pgz(out);
+    unsigned char trailer[10];
+    unsigned int i;
 
-    while (len > 0) {
-        ret = gzwrite(outgz->gz_fd, data,
-                  min(len, (unsigned int)INT_MAX));
-        if (ret == 0) {
-            error("gzwrite %s", gzerror(outgz->gz_fd, NULL));
-            return -1;
+    if (outpgz->in && pgz_flush(outpgz) == 0) {
+        /* An empty final fixed block ends the deflate stream, followed by
+         * the crc and the length mod 2^32, both little endian */
+        trailer[0] = 3;
+        trailer[1] = 0;
+        for (i = 0; i < 4; i++) {
+            trailer[2 + i] = outpgz->crc >> (8 * i);
+            trailer[6 + i] = outpgz->total >> (8 * i);
+        }
+        if (write_all(outpgz->fd, trailer, sizeof(trailer)) < 0) {
+            error_errno("write");
+        } else if (outpgz->point_count &&
+                   sparse_gz_write_index(outpgz->fd, outpgz->points, outpgz->point_count,
+                                         outpgz->written + sizeof(trailer), outpgz->total,
+                                         outpgz->out.block_size, 0) < 0) {
+            error_errno("write gz index");
         }
-        len -= ret;
-        data = (char *)data + ret;
     }
 
-    return 0;
-}
-
-static void gz_file_close(struct output_file *out)
-{
-    struct output_file_gz *outgz = to_output_file_gz(out);
+    /* Like gzclose, this closes the fd the output was opened on */
+    close(outpgz->fd);
 
-    gzclose(outgz->gz_fd);
-    free(outgz);
+    pgz_release(outpgz);
 }
 
-static struct output_file_ops gz_file_ops = {
-    .open = gz_file_open,
-    .skip = gz_file_skip,
-    .pad = gz_file_pad,
-    .write = gz_file_write,
-    .close = gz_file_close,
+static struct output_file_ops pgz_file_ops = {
+    .open = pgz_file_open,
+    .skip = pgz_file_skip,
+    .pad = pgz_file_pad,
+    .write = pgz_file_write,
+    .close = pgz_file_close,
 };
 
 static int callback_file_open(struct output_file *out __unused, int fd __unused)
@@ -327,6 +1060,7 @@ int read_all(int fd, void *buf, size_t len)
 
     while (total < len) {
         ret = read(fd, ptr, len - total);
+        stats_add(read_calls, 1);
 
         if (ret < 0)
             return -errno;
@@ -334,6 +1068,7 @@ int read_all(int fd, void *buf, size_t len)
         if (ret == 0)
             return -EINVAL;
 
+        stats_add(bytes_read, ret);
         ptr += ret;
         total += ret;
     }
@@ -341,6 +1076,105 @@ int read_all(int fd, void *buf, size_t len)
     return 0;
 }
 
+int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+    const char *ptr = buf;
+
+    while (len > 0) {
+        ret = write(fd, ptr, len);
+        stats_add(write_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        stats_add(bytes_written, ret);
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+int pread_all(int fd, void *buf, size_t len, int64_t offset)
+{
+    ssize_t ret;
+    char *ptr = buf;
+
+    while (len > 0) {
+        ret = pread(fd, ptr, len, offset);
+        stats_add(read_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        if (ret == 0)
+            return -EINVAL;
+
+        stats_add(bytes_read, ret);
+        ptr += ret;
+        offset += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes len bytes of fd at offset read as zeros without writing them.  size
+ * is the size of fd if it is a regular file, or -1.  Anything at or beyond
+ * size is left alone to become a hole when the file is extended, the rest is
+ * punched out.  Returns -EOPNOTSUPP if the caller has to write the zeros.
+ */
+int zero_fd_range(int fd, int64_t offset, int64_t len, int64_t size)
+{
+    if (size >= 0 && offset >= size) {
+        return 0;
+    }
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (size >= 0) {
+        len = min(len, size - offset);
+    }
+    stats_add(other_calls, 1);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+#endif
+
+    return -EOPNOTSUPP;
+}
+
+int pwrite_all(int fd, const void *buf, size_t len, int64_t offset)
+{
+    ssize_t ret;
+    const char *ptr = buf;
+
+    while (len > 0) {
+        ret = pwrite(fd, ptr, len, offset);
+        stats_add(write_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        stats_add(bytes_written, ret);
+        ptr += ret;
+        offset += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
 static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 {
     chunk_header_t chunk_header;
@@ -361,6 +1195,10 @@ static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
     if (ret < 0)
         return -1;
 
+    /* Don't care blocks count as zeros in the image checksum */
+    if (out->use_crc)
+        out->crc32 = sparse_crc32_fill(out->crc32, 0, skip_len);
+
     out->cur_out_ptr += skip_len;
     out->chunk_cnt++;
 
@@ -370,7 +1208,7 @@ static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 static int write_sparse_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val)
 {
     chunk_header_t chunk_header;
-    int rnd_up_len, count;
+    int rnd_up_len;
     int ret;
 
     /* Round up the fill length to a multiple of the block size */
@@ -389,11 +1227,8 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len, ui
     if (ret < 0)
         return -1;
 
-    if (out->use_crc) {
-        count = out->block_size / sizeof(uint32_t);
-        while (count--)
-            out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
-    }
+    if (out->use_crc)
+        out->crc32 = sparse_crc32_fill(out->crc32, fill_val, rnd_up_len);
 
     out->cur_out_ptr += rnd_up_len;
     out->chunk_cnt++;
@@ -447,6 +1282,7 @@ int write_sparse_end_chunk(struct output_file *out)
     int ret;
 
     if (out->use_crc) {
+        stats_add(chunks_written[SPARSE_STATS_CHUNK_CRC32], 1);
         chunk_header.chunk_type = CHUNK_TYPE_CRC32;
         chunk_header.reserved1 = 0;
         chunk_header.chunk_sz = 0;
@@ -491,19 +1327,50 @@ static int write_normal_data_chunk(struct output_file *out, unsigned int len, vo
     return ret;
 }
 
+/* Makes fill_buf hold at least len bytes of fill_val, as far as memory allows */
+static void fill_buf_prepare(struct output_file *out, unsigned int len, uint32_t fill_val)
+{
+    uint32_t *buf;
+    unsigned int i;
+
+    len = ALIGN(min(len, FILL_BUF_SIZE), sizeof(uint32_t));
+    if (len > out->fill_buf_size) {
+        buf = realloc(out->fill_buf, len);
+        if (buf) {
+            out->fill_buf = buf;
+            out->fill_buf_size = len;
+        }
+    }
+
+    if (fill_val != out->fill_val) {
+        out->fill_val = fill_val;
+        out->fill_buf_len = 0;
+    }
+
+    len = min(len, out->fill_buf_size);
+    for (i = out->fill_buf_len / sizeof(uint32_t); i < len / sizeof(uint32_t); i++) {
+        out->fill_buf[i] = fill_val;
+    }
+    out->fill_buf_len = max(out->fill_buf_len, len);
+}
+
 static int write_normal_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val)
 {
     int ret;
-    unsigned int i;
     unsigned int write_len;
 
-    /* Initialize fill_buf with the fill_val */
-    for (i = 0; i < out->block_size / sizeof(uint32_t); i++) {
-        out->fill_buf[i] = fill_val;
+    /* Zeros can be left as a hole instead of being written */
+    if (fill_val == 0 && out->ops->zero) {
+        ret = out->ops->zero(out, len);
+        if (ret != -EOPNOTSUPP) {
+            return ret;
+        }
     }
 
+    fill_buf_prepare(out, len, fill_val);
+
     while (len) {
-        write_len = min(len, out->block_size);
+        write_len = min(len, out->fill_buf_len);
         ret = out->ops->write(out, out->fill_buf, write_len);
         if (ret < 0) {
             return ret;
@@ -522,7 +1389,13 @@ static int write_normal_skip_chunk(struct output_file *out, int64_t len)
 
 int write_normal_end_chunk(struct output_file *out)
 {
-    return out->ops->pad(out, out->len);
+    int phase = stats_enter(SPARSE_STATS_PHASE_PAD);
+    int ret;
+
+    ret = out->ops->pad(out, out->len);
+    stats_leave(phase);
+
+    return ret;
 }
 
 static struct sparse_file_ops normal_file_ops = {
@@ -532,15 +1405,28 @@ static struct sparse_file_ops normal_file_ops = {
     .write_end_chunk = write_normal_end_chunk,
 };
 
-void output_file_close(struct output_file *out)
+int output_file_close(struct output_file *out)
 {
+    int phase;
+    int ret = 0;
+
     out->sparse_ops->write_end_chunk(out);
+    if (out->ops->flush) {
+        phase = stats_enter(SPARSE_STATS_PHASE_IO);
+        ret = out->ops->flush(out);
+        stats_leave(phase);
+    }
+    free(out->zero_buf);
+    free(out->fill_buf);
     out->ops->close(out);
+
+    return ret;
 }
 
 static int output_file_init(struct output_file *out, int block_size,
                             int64_t len, bool sparse, int chunks, bool crc)
 {
+    int phase;
     int ret;
 
     out->len = len;
@@ -556,7 +1442,11 @@ static int output_file_init(struct output_file *out, int block_size,
         return -ENOMEM;
     }
 
+    /* Grows for long fills, starts out as a block of zeros */
     out->fill_buf = calloc(block_size, 1);
+    out->fill_buf_size = block_size;
+    out->fill_buf_len = block_size;
+    out->fill_val = 0;
     if (!out->fill_buf) {
         error_errno("malloc fill_buf");
         ret = -ENOMEM;
@@ -569,7 +1459,8 @@ static int output_file_init(struct output_file *out, int block_size,
         out->sparse_ops = &normal_file_ops;
     }
 
-    if (sparse) {
+    /* Appended chunks follow the header of an existing image */
+    if (sparse && chunks >= 0) {
         sparse_header_t sparse_header = {
             .magic = SPARSE_HEADER_MAGIC,
             .major_version = SPARSE_HEADER_MAJOR_VER,
@@ -586,7 +1477,9 @@ static int output_file_init(struct output_file *out, int block_size,
             sparse_header.total_chunks++;
         }
 
+        phase = stats_enter(SPARSE_STATS_PHASE_HEADER);
         ret = out->ops->write(out, &sparse_header, sizeof(sparse_header));
+        stats_leave(phase);
         if (ret < 0) {
             goto err_write;
         }
@@ -614,6 +1507,38 @@ static struct output_file *output_file_new_gz(void)
     return &outgz->out;
 }
 
+static struct output_file *output_file_new_pgz(unsigned int threads, unsigned int restart)
+{
+    struct output_file_pgz *outpgz = calloc(1, sizeof(struct output_file_pgz));
+    if (!outpgz) {
+        error_errno("malloc struct outpgz");
+        return NULL;
+    }
+
+    outpgz->out.ops = &pgz_file_ops;
+    outpgz->threads = threads ? threads : 1;
+    outpgz->fd = -1;
+    if (restart) {
+        outpgz->restart = ALIGN(min(restart, PGZ_RESTART_MAX), PGZ_BLOCK_SIZE);
+    }
+
+    return &outpgz->out;
+}
+
+static struct output_file *output_file_new_uring(unsigned int depth)
+{
+    struct output_file_uring *outu = calloc(1, sizeof(struct output_file_uring));
+    if (!outu) {
+        error_errno("malloc struct outu");
+        return NULL;
+    }
+
+    outu->out.ops = &uring_file_ops;
+    outu->depth = depth;
+
+    return &outu->out;
+}
+
 static struct output_file *output_file_new_normal(void)
 {
     struct output_file_normal *outn = calloc(1, sizeof(struct output_file_normal));
@@ -622,7 +1547,17 @@ static struct output_file *output_file_new_normal(void)
         return NULL;
     }
 
+    outn->buf = malloc(NORMAL_BUF_SIZE);
+    if (!outn->buf) {
+        error_errno("malloc write buffer");
+        free(outn);
+        return NULL;
+    }
+
     outn->out.ops = &file_ops;
+    outn->copy_mode = COPY_FILE_RANGE;
+    outn->pipe_fd[0] = -1;
+    outn->pipe_fd[1] = -1;
 
     return &outn->out;
 }
@@ -653,14 +1588,39 @@ struct output_file *output_file_open_callback(int (*write) (void *, const void *
     return &outc->out;
 }
 
+/* Frees an output that failed to open, leaving fd open */
+static void output_file_discard(struct output_file *out)
+{
+    /* Closing a gz output would close fd */
+    if (out->ops == &file_ops || out->ops == &uring_file_ops) {
+        out->ops->close(out);
+    } else if (out->ops == &pgz_file_ops) {
+        pgz_release(to_output_file_pgz(out));
+    } else {
+        free(out);
+    }
+}
+
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-                                        int gz, int sparse, int chunks, int crc)
+                                        int gz, int sparse, int chunks, int crc,
+                                        unsigned int threads, unsigned int gz_restart,
+                                        unsigned int queue_depth)
 {
     int ret;
     struct output_file *out;
 
-    if (gz) {
+    /* Restart points only map onto blocks of a raw image, and
+     * sparse_file_import_gz refuses sparse ones */
+    if (sparse) {
+        gz_restart = 0;
+    }
+
+    if (gz && (threads > 1 || gz_restart)) {
+        out = output_file_new_pgz(threads, gz_restart);
+    } else if (gz) {
         out = output_file_new_gz();
+    } else if (queue_depth) {
+        out = output_file_new_uring(queue_depth);
     } else {
         out = output_file_new_normal();
     }
@@ -668,13 +1628,58 @@ struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t
         return NULL;
     }
 
-    out->ops->open(out, fd);
+    ret = out->ops->open(out, fd);
+    /* Without io_uring (or for a pipe), write synchronously */
+    if (ret < 0 && out->ops == &uring_file_ops) {
+        out->ops->close(out);
+        out = output_file_new_normal();
+        if (!out) {
+            return NULL;
+        }
+        ret = out->ops->open(out, fd);
+    }
+    if (ret < 0) {
+        output_file_discard(out);
+        return NULL;
+    }
 
     ret = output_file_init(out, block_size, len, sparse, chunks, crc);
     if (ret < 0) {
-        free(out);
+        output_file_discard(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+/*
+ * Opens fd to write more sparse chunks at its current position, after the
+ * chunks of an existing image, without a sparse header.  The image crc
+ * continues from crc32, the crc of the existing image.
+ */
+struct output_file *output_file_open_append(int fd, unsigned int block_size, int64_t len,
+                                            int crc, uint32_t crc32)
+{
+    int ret;
+    struct output_file *out;
+
+    out = output_file_new_normal();
+    if (!out) {
+        return NULL;
+    }
+
+    ret = out->ops->open(out, fd);
+    if (ret < 0) {
+        output_file_discard(out);
+        return NULL;
+    }
+
+    ret = output_file_init(out, block_size, len, true, -1, crc);
+    if (ret < 0) {
+        output_file_discard(out);
         return NULL;
     }
+    out->crc32 = crc32;
 
     return out;
 }
@@ -691,7 +1696,9 @@ int write_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_va
     return out->sparse_ops->write_fill_chunk(out, len, fill_val);
 }
 
-int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset)
+/* Maps len bytes of fd at offset and passes them to write_data */
+static int write_fd_data(struct output_file *out, unsigned int len, int fd, int64_t offset,
+                         int (*write_data) (struct output_file *, unsigned int, void *))
 {
     int ret;
     int64_t aligned_offset;
@@ -711,19 +1718,17 @@ int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t of
     if (data == MAP_FAILED) {
         return -errno;
     }
+    /* The mapping is read as it is written out */
+    stats_add(read_calls, 1);
+    stats_add(bytes_read, len);
     ptr = data + aligned_diff;
 #else
-    off_t pos;
     char *data = malloc(len);
     if (!data) {
         return -errno;
     }
-    pos = lseek(fd, offset, SEEK_SET);
-    if (pos < 0) {
-        free(data);
-        return -errno;
-    }
-    ret = read_all(fd, data, len);
+    /* pread leaves the fd position alone, so other threads can share fd */
+    ret = pread_all(fd, data, len, offset);
     if (ret < 0) {
         free(data);
         return ret;
@@ -731,7 +1736,7 @@ int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t of
     ptr = data;
 #endif
 
-    ret = out->sparse_ops->write_data_chunk(out, len, ptr);
+    ret = write_data(out, len, ptr);
 
 #ifndef USE_MINGW
     munmap(data, buffer_size);
@@ -742,6 +1747,45 @@ int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t of
     return ret;
 }
 
+static int write_raw_data(struct output_file *out, unsigned int len, void *data)
+{
+    return out->ops->write(out, data, len);
+}
+
+static int write_normal_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset)
+{
+    unsigned int rnd_up_len = ALIGN(len, out->block_size);
+    unsigned int remain = len;
+    int ret;
+
+    ret = out->ops->copy_fd(out, fd, &offset, &remain);
+    if (ret < 0 && ret != -EOPNOTSUPP) {
+        return ret;
+    }
+
+    if (remain) {
+        ret = write_fd_data(out, remain, fd, offset, write_raw_data);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (rnd_up_len > len) {
+        ret = out->ops->skip(out, rnd_up_len - len);
+    }
+
+    return ret;
+}
+
+int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset)
+{
+    if (out->sparse_ops == &normal_file_ops && out->ops->copy_fd) {
+        return write_normal_fd_chunk(out, len, fd, offset);
+    }
+
+    return write_fd_data(out, len, fd, offset, out->sparse_ops->write_data_chunk);
+}
+
 /* Write a contiguous region of data blocks from a file */
 int write_file_chunk(struct output_file *out, unsigned int len, const char *file, int64_t offset)
 {
@@ -759,6 +1803,26 @@ int write_file_chunk(struct output_file *out, unsigned int len, const char *file
     return ret;
 }
 
+/* Write a contiguous region of data blocks inflated from a gz file */
+int write_gz_chunk(struct output_file *out, unsigned int len, struct sparse_gz *gz,
+                   int64_t offset)
+{
+    int ret;
+    char *data = malloc(len);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    ret = sparse_gz_read(gz, data, offset, len);
+    if (ret == 0) {
+        ret = out->sparse_ops->write_data_chunk(out, len, data);
+    }
+
+    free(data);
+
+    return ret;
+}
+
 int write_skip_chunk(struct output_file *out, int64_t len)
 {
     return out->sparse_ops->write_skip_chunk(out, len);
@@ -20,19 +20,30 @@
 #include <sparse/sparse.h>
 
 struct output_file;
+struct sparse_gz;
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-                                        int gz, int sparse, int chunks, int crc);
+                                        int gz, int sparse, int chunks, int crc,
+                                        unsigned int threads, unsigned int gz_restart,
+                                        unsigned int queue_depth);
 struct output_file *output_file_open_callback(int (*write) (void *, const void *, int),
                                               void *priv, unsigned int block_size, int64_t len,
                                               int gz, int sparse, int chunks, int crc);
+struct output_file *output_file_open_append(int fd, unsigned int block_size, int64_t len,
+                                            int crc, uint32_t crc32);
 int write_data_chunk(struct output_file *out, unsigned int len, void *data);
 int write_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val);
 int write_file_chunk(struct output_file *out, unsigned int len, const char *file, int64_t offset);
 int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset);
+int write_gz_chunk(struct output_file *out, unsigned int len, struct sparse_gz *gz,
+                   int64_t offset);
 int write_skip_chunk(struct output_file *out, int64_t len);
-void output_file_close(struct output_file *out);
+int output_file_close(struct output_file *out);
 
 int read_all(int fd, void *buf, size_t len);
+int write_all(int fd, const void *buf, size_t len);
+int pread_all(int fd, void *buf, size_t len, int64_t offset);
+int pwrite_all(int fd, const void *buf, size_t len, int64_t offset);
+int zero_fd_range(int fd, int64_t offset, int64_t len, int64_t size);
 
 #endif
@@ -16,44 +16,230 @@
 
 #include <sparse/sparse.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "output_file.h"
+#include "simg_opt.h"
+#include "sparse_parallel.h"
+#include "sparse_uring.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
 void usage()
 {
-    fprintf(stderr, "Usage: simg2img <sparse_image_files> <raw_image_file>\n");
+    fprintf(stderr, "Usage: simg2img [-j <threads>] [-q <depth>] [-z] [-R <MiB>] [-v] [--stats] "
+            "[--index] <sparse_image_files> <raw_image_file>\n"
+            "       (use - for stdin or stdout; pipes are expanded as they are read)\n"
+            "       (gzipped raw images written with -R are read through their restart points)\n"
+            "  -q    keep up to depth writes in flight with io_uring when available\n"
+            "  -z    gzip the raw image\n"
+            "  -R    gzip the raw image with a restart point every MiB, so any block of it\n"
+            "        can be read back without inflating what comes before\n"
+            "  --stats  print chunk, i/o and time statistics to stderr\n"
+            "  --index  read the chunks of each image from <image>.idx, writing it if\n"
+            "           missing or out of date\n");
+}
+
+struct stream_out {
+    int fd;
+    bool seekable;
+    int64_t len;
+};
+
+/* Writes expanded chunks from sparse_file_stream, seeking over skips when it can */
+static int stream_write(void *priv, const void *data, int len)
+{
+    static const char zeros[64 * 1024];
+    struct stream_out *out = priv;
+    int chunk;
+    int ret;
+
+    out->len += len;
+
+    if (data) {
+        return write_all(out->fd, data, len);
+    }
+
+    if (out->seekable) {
+        return lseek(out->fd, len, SEEK_CUR) < 0 ? -errno : 0;
+    }
+
+    while (len > 0) {
+        chunk = len < (int)sizeof(zeros) ? len : (int)sizeof(zeros);
+        ret = write_all(out->fd, zeros, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Expands a sparse image read from a pipe straight into out */
+static int stream_image(int in, int out, bool seekable)
+{
+    struct stream_out priv = { out, seekable, 0 };
+    int ret;
+
+    ret = sparse_file_stream(in, true, false, stream_write, &priv);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (seekable && ftruncate(out, priv.len) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* Gzip members start with these two bytes */
+static bool is_gzip(int fd)
+{
+    unsigned char magic[2];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+static double tv_seconds(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* Prints throughput and resource usage of the conversion to stderr */
+static void print_usage_stats(int out, struct timeval *start)
+{
+    struct timeval end;
+    struct rusage ru;
+    struct stat st;
+    double elapsed;
+
+    gettimeofday(&end, NULL);
+    elapsed = tv_seconds(&end) - tv_seconds(start);
+    if (fstat(out, &st) < 0 || getrusage(RUSAGE_SELF, &ru) < 0) {
+        return;
+    }
+
+    fprintf(stderr, "wrote %lld bytes (%lld allocated) in %.3f s, %.1f MB/s\n",
+            (long long)st.st_size, (long long)st.st_blocks * 512, elapsed,
+            elapsed > 0 ? st.st_size / elapsed / 1000000.0 : 0.0);
+    fprintf(stderr, "cpu: user %.3f s, sys %.3f s; max rss %ld KiB\n",
+            tv_seconds(&ru.ru_utime), tv_seconds(&ru.ru_stime), ru.ru_maxrss);
 }
 
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 'S'},
+        {"index", no_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0},
+    };
     int in;
     int out;
     int i;
+    int opt;
+    unsigned int threads = 1;
+    unsigned int queue_depth = 0;
+    unsigned int gz_restart = 0;
+    bool gz = false;
+    bool verbose = false;
+    bool out_seekable;
+    bool in_piped;
+    bool in_gz;
+    bool print_stats = false;
+    bool use_index = false;
+    struct sparse_stats stats;
+    struct timeval start;
     struct sparse_file *s;
 
-    if (argc < 3) {
+    gettimeofday(&start, NULL);
+
+    while ((opt = getopt_long(argc, argv, "j:q:zR:v", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'q':
+            queue_depth = parse_count(optarg, SPARSE_URING_MAX_DEPTH);
+            if (queue_depth < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'z':
+            gz = true;
+            break;
+        case 'R':
+            gz_restart = parse_count(optarg, 1024);
+            if (gz_restart < 1) {
+                usage();
+                exit(-1);
+            }
+            gz_restart *= 1024 * 1024;
+            gz = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        case 'I':
+            use_index = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (argc - optind < 2) {
         usage();
         exit(-1);
     }
 
-    out = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
-    if (out < 0) {
-        fprintf(stderr, "Cannot open output file %s\n", argv[argc - 1]);
+    if (print_stats) {
+        memset(&stats, 0, sizeof(stats));
+        sparse_set_stats(&stats);
+    }
+
+    if (strcmp(argv[argc - 1], "-") == 0) {
+        out = STDOUT_FILENO;
+    } else {
+        out = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+        if (out < 0) {
+            fprintf(stderr, "Cannot open output file %s\n", argv[argc - 1]);
+            exit(-1);
+        }
+    }
+    out_seekable = lseek(out, 0, SEEK_CUR) >= 0;
+
+    if ((!out_seekable || gz) && argc - optind > 2) {
+        fprintf(stderr, "Cannot combine several images into an unseekable or gzipped output\n");
         exit(-1);
     }
 
-    for (i = 1; i < argc - 1; i++) {
+    for (i = optind; i < argc - 1; i++) {
         if (strcmp(argv[i], "-") == 0) {
             in = STDIN_FILENO;
         } else {
@@ -64,18 +250,44 @@ int main(int argc, char *argv[])
             }
         }
 
-        s = sparse_file_import(in, true, false);
-        if (!s) {
-            fprintf(stderr, "Failed to read sparse file\n");
+        if (out_seekable && lseek(out, 0, SEEK_SET) == -1) {
+            perror("lseek failed");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Pipes can't be imported, expand them chunk by chunk instead.  Gzip
+         * in either direction needs the imported file. */
+        in_piped = lseek(in, 0, SEEK_CUR) < 0;
+        in_gz = !in_piped && is_gzip(in);
+        if (gz && in_piped) {
+            fprintf(stderr, "Cannot gzip an image read from a pipe\n");
             exit(-1);
         }
+        if (in_piped || (!out_seekable && !gz && !in_gz)) {
+            if (stream_image(in, out, out_seekable) < 0) {
+                fprintf(stderr, "Failed to expand sparse file\n");
+                exit(-1);
+            }
+            close(in);
+            continue;
+        }
 
-        if (lseek(out, 0, SEEK_SET) == -1) {
-            perror("lseek failed");
-            exit(EXIT_FAILURE);
+        if (in_gz) {
+            s = sparse_file_import_gz(in, true);
+        } else if (use_index) {
+            s = import_indexed(in, argv[i], true);
+        } else {
+            s = sparse_file_import(in, true, false);
+        }
+        if (!s) {
+            fprintf(stderr, "Failed to read sparse file\n");
+            exit(-1);
         }
+        sparse_file_set_threads(s, threads);
+        sparse_file_set_queue_depth(s, queue_depth);
+        sparse_file_set_gz_restart(s, gz_restart);
 
-        if (sparse_file_write(s, out, false, false, false) < 0) {
+        if (sparse_file_write(s, out, gz, false, false) < 0) {
             fprintf(stderr, "Cannot write output file\n");
             exit(-1);
         }
@@ -83,6 +295,13 @@ int main(int argc, char *argv[])
         close(in);
     }
 
+    if (verbose) {
+        print_usage_stats(out, &start);
+    }
+    if (print_stats) {
+        sparse_stats_print(&stats);
+    }
+
     close(out);
 
     exit(0);
@@ -19,6 +19,7 @@
 #define _GNU_SOURCE
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,26 +31,66 @@
 
 #include <sparse/sparse.h>
 
+#include "simg_opt.h"
+#include "sparse_parallel.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
 void usage()
 {
-    fprintf(stderr, "Usage: simg2simg <sparse image file> <sparse_image_file> <max_size>\n");
+    fprintf(stderr, "Usage: simg2simg [-j <threads>] [--stats] [--index] <sparse image file> <sparse_image_file> <max_size>\n");
+    fprintf(stderr, "  --stats  print chunk, i/o and time statistics to stderr\n");
+    fprintf(stderr, "  --index  read the chunks of the input from <input>.idx, writing it if\n"
+            "           missing or out of date\n");
 }
 
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 'S'},
+        {"index", no_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0},
+    };
     int in;
-    int out;
     int i;
     int ret;
     struct sparse_file *s;
     int64_t max_size;
     struct sparse_file **out_s;
     int files;
+    int *fds;
+    int opt;
+    unsigned int threads = 1;
     char filename[4096];
+    bool print_stats = false;
+    bool use_index = false;
+    struct sparse_stats stats;
+
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        case 'I':
+            use_index = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc != 4) {
         usage();
@@ -58,33 +99,36 @@ int main(int argc, char *argv[])
 
     max_size = atoll(argv[3]);
 
+    if (print_stats) {
+        memset(&stats, 0, sizeof(stats));
+        sparse_set_stats(&stats);
+    }
+
     in = open(argv[1], O_RDONLY | O_BINARY);
     if (in < 0) {
         fprintf(stderr, "Cannot open input file %s\n", argv[1]);
         exit(-1);
     }
 
-    s = sparse_file_import(in, true, false);
+    if (use_index) {
+        s = import_indexed(in, argv[1], true);
+    } else {
+        s = sparse_file_import(in, true, false);
+    }
     if (!s) {
         fprintf(stderr, "Failed to import sparse file\n");
         exit(-1);
     }
 
-    files = sparse_file_resparse(s, max_size, NULL, 0);
+    files = sparse_file_resparse_alloc(s, max_size, &out_s);
     if (files < 0) {
         fprintf(stderr, "Failed to resparse\n");
         exit(-1);
     }
 
-    out_s = calloc(sizeof(struct sparse_file *), files);
-    if (!out_s) {
-        fprintf(stderr, "Failed to allocate sparse file array\n");
-        exit(-1);
-    }
-
-    files = sparse_file_resparse(s, max_size, out_s, files);
-    if (files < 0) {
-        fprintf(stderr, "Failed to resparse\n");
+    fds = calloc(sizeof(int), files);
+    if (!fds) {
+        fprintf(stderr, "Failed to allocate file descriptor array\n");
         exit(-1);
     }
 
@@ -95,18 +139,26 @@ int main(int argc, char *argv[])
             exit(-1);
         }
 
-        out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
-        if (out < 0) {
+        fds[i] = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+        if (fds[i] < 0) {
             fprintf(stderr, "Cannot open output file %s\n", argv[2]);
             exit(-1);
         }
+    }
 
-        ret = sparse_file_write(out_s[i], out, false, true, false);
-        if (ret) {
-            fprintf(stderr, "Failed to write sparse file\n");
-            exit(-1);
-        }
-        close(out);
+    /* The split files are independent, write several at a time */
+    ret = sparse_file_write_split(out_s, fds, files, false, true, false, threads);
+    if (ret) {
+        fprintf(stderr, "Failed to write sparse file\n");
+        exit(-1);
+    }
+
+    if (print_stats) {
+        sparse_stats_print(&stats);
+    }
+
+    for (i = 0; i < files; i++) {
+        close(fds[i]);
     }
 
     close(in);
@@ -0,0 +1,1163 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "simg_opt.h"
+#include "sparse_crc32.h"
+#include "sparse_format.h"
+#include "sparse_parallel.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define BENCH_FORMAT_VERSION 1
+
+/* Largest number of operations a results file can hold */
+#define MAX_RESULTS 32
+
+/* Largest test image and iteration count accepted on the command line */
+#define MAX_SIZE_MB (1024U * 1024U)
+#define MAX_ITERATIONS 1000U
+
+/* Part of the middle of the image read back from the gzipped copy */
+#define CHECK_GZ_WINDOW (2 * 1024 * 1024)
+
+struct bench_config {
+    unsigned int size_mb;
+    unsigned int chunks;
+    unsigned int raw_pct;
+    unsigned int fill_pct;
+    unsigned int block_size;
+    unsigned int iterations;
+    unsigned int threads;
+    uint32_t seed;
+    const char *dir;
+};
+
+struct bench_result {
+    char op[32];
+    double mb_per_s;
+    double chunks_per_s;
+};
+
+struct bench {
+    struct bench_config cfg;
+    char image[4096];
+    char crc_image[4096];
+    char raw_image[4096];
+    char out[4096];
+    int64_t len;
+    unsigned int chunks;
+
+    struct bench_result results[MAX_RESULTS];
+    unsigned int count;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_bench [options]\n");
+    fprintf(stderr, "  -s <MiB>        size of the expanded test image (default 256)\n");
+    fprintf(stderr, "  -c <chunks>     number of chunks in the test image (default 4096)\n");
+    fprintf(stderr, "  -r <percent>    share of chunks that are raw data (default 40)\n");
+    fprintf(stderr, "  -f <percent>    share of chunks that are fill, the rest are don't care (default 40)\n");
+    fprintf(stderr, "  -B <bytes>      block size (default 4096)\n");
+    fprintf(stderr, "  -n <count>      iterations per operation, the best is kept (default 3)\n");
+    fprintf(stderr, "  -j <threads>    threads for the operations that can use them (default 1)\n");
+    fprintf(stderr, "  -S <seed>       seed for the generated image (default 1)\n");
+    fprintf(stderr, "  -d <dir>        directory for the test files (default /tmp)\n");
+    fprintf(stderr, "  -o <file>       write the results to file\n");
+    fprintf(stderr, "  -b <file>       compare against a results file written by -o\n");
+    fprintf(stderr, "  -t <percent>    slowdown against the baseline that counts as a regression (default 10)\n");
+    fprintf(stderr, "  -C <threads>    instead of timing, convert the image on this many threads at\n");
+    fprintf(stderr, "                  once, -n times each, and check every result\n");
+}
+
+/* xorshift32, so the same seed gives the same image everywhere */
+static uint32_t next_random(uint32_t * state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int open_out(const char *path)
+{
+    return open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0664);
+}
+
+/*
+ * Builds the test image: the expanded size is split into cfg.chunks runs of
+ * random length, each raw data, a fill or a don't care gap with the chosen
+ * mix.  Raw data is random, so gz gets no help from it.  The image is
+ * written as a sparse file, a sparse file with a crc and a raw image.
+ */
+static int generate(struct bench *b)
+{
+    struct bench_config *cfg = &b->cfg;
+    struct sparse_file *s;
+    unsigned int blocks = (uint64_t) cfg->size_mb * 1024 * 1024 / cfg->block_size;
+    unsigned int *lens;
+    unsigned int *kinds;
+    unsigned int block;
+    unsigned int left;
+    unsigned int c;
+    uint32_t state = cfg->seed ? cfg->seed : 1;
+    uint32_t *pool = NULL;
+    size_t pool_len = 0;
+    size_t i;
+    char *data;
+    sparse_header_t header;
+    int fd;
+    int ret = 0;
+
+    if (cfg->chunks == 0 || cfg->chunks > blocks) {
+        return -EINVAL;
+    }
+
+    b->len = (int64_t) blocks * cfg->block_size;
+    s = sparse_file_new(cfg->block_size, b->len);
+    lens = calloc(cfg->chunks, sizeof(unsigned int));
+    kinds = calloc(cfg->chunks, sizeof(unsigned int));
+    if (!s || !lens || !kinds) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Lay out the runs first so all raw data is one allocation.  Each run
+     * averages the blocks left over the runs left, leaving at least one
+     * block for each of those. */
+    block = 0;
+    for (c = 0; c < cfg->chunks; c++) {
+        left = cfg->chunks - c - 1;
+        lens[c] = left ? 1 + next_random(&state) % (2 * (blocks - block) / (left + 1)) :
+            blocks - block;
+        if (lens[c] > blocks - block - left) {
+            lens[c] = blocks - block - left;
+        }
+        kinds[c] = next_random(&state) % 100;
+        if (kinds[c] < cfg->raw_pct) {
+            pool_len += (size_t) lens[c] * cfg->block_size;
+        }
+        block += lens[c];
+    }
+
+    pool = malloc(pool_len ? pool_len : 1);
+    if (!pool) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < pool_len / sizeof(uint32_t); i++) {
+        pool[i] = next_random(&state);
+    }
+
+    block = 0;
+    data = (char *)pool;
+    for (c = 0; c < cfg->chunks && ret == 0; c++) {
+        if (kinds[c] < cfg->raw_pct) {
+            ret = sparse_file_add_data(s, data, lens[c] * cfg->block_size, block);
+            data += (size_t) lens[c] * cfg->block_size;
+        } else if (kinds[c] < cfg->raw_pct + cfg->fill_pct) {
+            ret = sparse_file_add_fill(s, next_random(&state), lens[c] * cfg->block_size, block);
+        }
+        block += lens[c];
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Count chunks as written, after runs of the same kind are merged */
+    fd = open_out(b->image);
+    ret = fd < 0 ? -errno : sparse_file_write(s, fd, false, true, false);
+    if (ret == 0) {
+        ret = pread(fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -EIO;
+        b->chunks = header.total_chunks;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    fd = open_out(b->crc_image);
+    ret = fd < 0 ? -errno : sparse_file_write(s, fd, false, true, true);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    fd = open_out(b->raw_image);
+    ret = fd < 0 ? -errno : sparse_file_write(s, fd, false, false, false);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+ out:
+    if (s) {
+        sparse_file_destroy(s);
+    }
+    free(pool);
+    free(kinds);
+    free(lens);
+    return ret;
+}
+
+static struct sparse_file *import(const char *path, bool crc, int *fd)
+{
+    struct sparse_file *s;
+
+    *fd = open(path, O_RDONLY | O_BINARY);
+    if (*fd < 0) {
+        return NULL;
+    }
+
+    s = sparse_file_import(*fd, false, crc);
+    if (!s) {
+        close(*fd);
+    }
+
+    return s;
+}
+
+enum bench_op {
+    OP_IMPORT,
+    OP_IMPORT_CRC,
+    OP_READ_RAW,
+    OP_WRITE_RAW,
+    OP_WRITE_SPARSE,
+    OP_WRITE_GZ,
+    OP_RESPARSE,
+    OP_APPEND,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+    "import", "import_crc", "read_raw", "write_raw", "write_sparse", "write_gz", "resparse",
+    "append",
+};
+
+/*
+ * Runs one iteration of op and returns the seconds spent in the operation
+ * itself, leaving out setup such as importing the image it works on.
+ */
+static int run_op(struct bench *b, enum bench_op op, double *elapsed)
+{
+    struct sparse_file *s = NULL;
+    struct sparse_file **split;
+    double start = 0;
+    int in = -1;
+    int out = -1;
+    int ret = 0;
+    int i;
+
+    switch (op) {
+    case OP_IMPORT:
+    case OP_IMPORT_CRC:
+        start = now();
+        s = import(op == OP_IMPORT ? b->image : b->crc_image, op == OP_IMPORT_CRC, &in);
+        *elapsed = now() - start;
+        if (!s) {
+            return -EINVAL;
+        }
+        break;
+
+    case OP_READ_RAW:
+        in = open(b->raw_image, O_RDONLY | O_BINARY);
+        s = sparse_file_new(b->cfg.block_size, b->len);
+        if (in < 0 || !s) {
+            ret = -ENOMEM;
+            break;
+        }
+        start = now();
+        ret = sparse_file_read(s, in, SPARSE_READ_MODE_NORMAL, false);
+        *elapsed = now() - start;
+        break;
+
+    case OP_WRITE_RAW:
+    case OP_WRITE_SPARSE:
+    case OP_WRITE_GZ:
+        s = import(b->image, false, &in);
+        out = open_out(b->out);
+        if (!s || out < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        sparse_file_set_threads(s, b->cfg.threads);
+        start = now();
+        ret = sparse_file_write(s, out, op == OP_WRITE_GZ, op != OP_WRITE_RAW, false);
+        *elapsed = now() - start;
+        break;
+
+    case OP_RESPARSE:
+        s = import(b->image, false, &in);
+        if (!s) {
+            return -EINVAL;
+        }
+        start = now();
+        ret = sparse_file_resparse_alloc(s, b->len / 16 + 4096, &split);
+        *elapsed = now() - start;
+        for (i = 0; i < ret; i++) {
+            sparse_file_destroy(split[i]);
+        }
+        if (ret >= 0) {
+            free(split);
+            ret = 0;
+        }
+        break;
+
+    case OP_APPEND:
+        /* Appends the whole raw image to a copy of the sparse image */
+        s = import(b->image, false, &in);
+        out = open_out(b->out);
+        if (!s || out < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = sparse_file_write(s, out, false, true, false);
+        sparse_file_destroy(s);
+        close(in);
+        s = NULL;
+        in = open(b->raw_image, O_RDONLY | O_BINARY);
+        if (ret < 0 || in < 0) {
+            ret = ret < 0 ? ret : -errno;
+            break;
+        }
+        s = sparse_file_new(b->cfg.block_size, b->len);
+        if (!s) {
+            ret = -ENOMEM;
+            break;
+        }
+        start = now();
+        ret = sparse_file_read(s, in, SPARSE_READ_MODE_NORMAL, false);
+        if (ret == 0) {
+            ret = sparse_file_append(s, out);
+        }
+        *elapsed = now() - start;
+        break;
+
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    if (s) {
+        sparse_file_destroy(s);
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+
+    return ret;
+}
+
+struct stress {
+    struct bench *b;
+    uint8_t root[SPARSE_SHA256_DIGEST_SIZE];
+};
+
+struct stress_worker {
+    struct stress *st;
+    unsigned int id;
+    pthread_t thread;
+    char out[4096];
+    unsigned int messages;
+    int ret;
+};
+
+static void stress_log(void *priv, const char *msg __unused)
+{
+    struct stress_worker *w = priv;
+
+    w->messages++;
+}
+
+/* Checks the raw image written to path matches the generated one */
+static int compare_files(const char *path, const char *ref_path)
+{
+    char a[65536];
+    char b[65536];
+    ssize_t len;
+    int fd;
+    int ref;
+    int ret = 0;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    ref = open(ref_path, O_RDONLY | O_BINARY);
+    if (fd < 0 || ref < 0) {
+        ret = -errno;
+    }
+
+    while (ret == 0) {
+        len = read(ref, b, sizeof(b));
+        if (len < 0) {
+            ret = -errno;
+        } else if (read(fd, a, sizeof(a)) != len || memcmp(a, b, len) != 0) {
+            ret = -EIO;
+        } else if (len == 0) {
+            break;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ref >= 0) {
+        close(ref);
+    }
+
+    return ret;
+}
+
+/*
+ * One conversion job: import the crc image with crc checking, expand it,
+ * compare the result with the raw image and rebuild the hash tree root.
+ * Every worker uses its own sparse file and its own log.
+ */
+static void *stress_run(void *arg)
+{
+    struct stress_worker *w = arg;
+    struct bench *b = w->st->b;
+    struct sparse_file *s;
+    uint8_t root[SPARSE_SHA256_DIGEST_SIZE];
+    unsigned int i;
+    int in;
+    int out;
+
+    sparse_set_log(stress_log, w);
+
+    for (i = 0; i < b->cfg.iterations && w->ret == 0; i++) {
+        s = import(b->crc_image, true, &in);
+        if (!s) {
+            w->ret = -EINVAL;
+            break;
+        }
+        sparse_file_set_threads(s, b->cfg.threads);
+
+        out = open_out(w->out);
+        w->ret = out < 0 ? -errno : sparse_file_write(s, out, false, false, false);
+        if (out >= 0) {
+            close(out);
+        }
+        if (w->ret == 0) {
+            w->ret = compare_files(w->out, b->raw_image);
+        }
+        if (w->ret == 0) {
+            w->ret = sparse_file_hash_tree(s, NULL, 0, -1, root);
+        }
+        if (w->ret == 0 && memcmp(root, w->st->root, sizeof(root)) != 0) {
+            w->ret = -EIO;
+        }
+
+        sparse_file_destroy(s);
+        close(in);
+    }
+
+    unlink(w->out);
+    return NULL;
+}
+
+/*
+ * Reads around a data block whose length is not a multiple of the block
+ * size.  The rest of its last block must read back as zeros, like the
+ * padding a written image has there.
+ */
+static int check_unaligned_pread(void)
+{
+    struct sparse_file *s;
+    char data[1000];
+    char buf[8192];
+    int64_t ret;
+    unsigned int i;
+
+    s = sparse_file_new(4096, sizeof(buf));
+    if (!s) {
+        return -ENOMEM;
+    }
+
+    memset(data, 0xa5, sizeof(data));
+    ret = sparse_file_add_data(s, data, sizeof(data), 0);
+    if (ret == 0) {
+        memset(buf, 0xff, sizeof(buf));
+        ret = sparse_file_pread(s, buf, 100, sizeof(data));
+        for (i = 0; ret >= 0 && i < 100; i++) {
+            if (buf[i] != 0) {
+                ret = -EIO;
+            }
+        }
+        if (ret == 100) {
+            ret = sparse_file_pread(s, buf, sizeof(buf), 0);
+        }
+        if (ret >= 0 && ret != sizeof(buf)) {
+            ret = -EIO;
+        }
+        for (i = 0; ret >= 0 && i < sizeof(buf); i++) {
+            if (buf[i] != (i < sizeof(data) ? data[i] : 0)) {
+                ret = -EIO;
+            }
+        }
+    }
+
+    sparse_file_destroy(s);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Imports the sparse image through the index at idx, expands it and checks
+ * the result against the raw image.  Sets ino to the inode of the index
+ * afterwards, which changes whenever the import rewrote it.
+ */
+static int check_indexed_import(struct bench *b, const char *idx, ino_t *ino)
+{
+    struct sparse_file *s;
+    struct stat st;
+    int in;
+    int out;
+    int ret;
+
+    in = open(b->image, O_RDONLY | O_BINARY);
+    if (in < 0) {
+        return -errno;
+    }
+
+    s = sparse_file_import_indexed(in, idx, false);
+    if (!s) {
+        close(in);
+        return -EINVAL;
+    }
+
+    out = open_out(b->out);
+    ret = out < 0 ? -errno : sparse_file_write(s, out, false, false, false);
+    if (out >= 0) {
+        close(out);
+    }
+    sparse_file_destroy(s);
+    close(in);
+
+    if (ret == 0) {
+        ret = compare_files(b->out, b->raw_image);
+    }
+    if (ret == 0) {
+        ret = stat(idx, &st) < 0 ? -errno : 0;
+        *ino = st.st_ino;
+    }
+
+    return ret;
+}
+
+/* Overwrites len bytes at offset of the index at idx, fixing up its crc */
+static int patch_index(const char *idx, const void *data, size_t len, off_t offset)
+{
+    sparse_index_header_t header;
+    struct stat st;
+    char *buf = NULL;
+    int fd;
+    int ret;
+
+    fd = open(idx, O_RDWR | O_BINARY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    buf = malloc(st.st_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (pread(fd, buf, st.st_size, 0) != st.st_size || offset + (off_t) len > st.st_size) {
+        ret = -EIO;
+        goto out;
+    }
+
+    memcpy(buf + offset, data, len);
+    memcpy(&header, buf, sizeof(header));
+    header.entries_crc = sparse_crc32(0, buf + sizeof(header), st.st_size - sizeof(header));
+    memcpy(buf, &header, sizeof(header));
+    ret = pwrite(fd, buf, st.st_size, 0) == st.st_size ? 0 : -EIO;
+
+ out:
+    free(buf);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+/*
+ * Imports the image through a missing, an up to date, a corrupt, an out of
+ * order and a stale index.  All of them must expand to the raw image, and
+ * only the up to date one may be used rather than rewritten.
+ */
+static int check_index(struct bench *b)
+{
+    struct timespec times[2] = { {0, UTIME_NOW}, {0, UTIME_NOW} };
+    sparse_index_entry_t entries[2];
+    char idx[sizeof(b->image) + 4];
+    ino_t ino, prev;
+    int fd;
+    int ret;
+
+    snprintf(idx, sizeof(idx), "%s.idx", b->image);
+    unlink(idx);
+
+    ret = check_indexed_import(b, idx, &prev);
+    if (ret == 0) {
+        ret = check_indexed_import(b, idx, &ino);
+    }
+    if (ret == 0 && ino != prev) {
+        fprintf(stderr, "index: up to date index was not used\n");
+        ret = -EIO;
+    }
+
+    /* A flipped byte in the last entry breaks the crc */
+    fd = ret == 0 ? open(idx, O_RDWR | O_BINARY) : -1;
+    if (fd >= 0) {
+        ret = pwrite(fd, "\xff", 1, lseek(fd, 0, SEEK_END) - 1) == 1 ? 0 : -EIO;
+        close(fd);
+        if (ret == 0) {
+            ret = check_indexed_import(b, idx, &ino);
+        }
+        if (ret == 0 && ino == prev) {
+            fprintf(stderr, "index: corrupt index was used\n");
+            ret = -EIO;
+        }
+        prev = ino;
+    }
+
+    /* Swapping the first two entries keeps the crc valid but breaks the order */
+    fd = ret == 0 ? open(idx, O_RDONLY | O_BINARY) : -1;
+    if (fd >= 0) {
+        if (pread(fd, entries, sizeof(entries), sizeof(sparse_index_header_t)) !=
+            sizeof(entries)) {
+            ret = -EIO;
+        }
+        close(fd);
+        entries[0].block ^= entries[1].block;
+        entries[1].block ^= entries[0].block;
+        entries[0].block ^= entries[1].block;
+        if (ret == 0) {
+            ret = patch_index(idx, entries, sizeof(entries), sizeof(sparse_index_header_t));
+        }
+        if (ret == 0) {
+            ret = check_indexed_import(b, idx, &ino);
+        }
+        if (ret == 0 && ino == prev) {
+            fprintf(stderr, "index: out of order index was used\n");
+            ret = -EIO;
+        }
+        prev = ino;
+    }
+
+    /* Touching the image makes the index stale */
+    if (ret == 0 && utimensat(AT_FDCWD, b->image, times, 0) < 0) {
+        ret = -errno;
+    }
+    if (ret == 0) {
+        ret = check_indexed_import(b, idx, &ino);
+    }
+    if (ret == 0 && ino == prev) {
+        fprintf(stderr, "index: stale index was used\n");
+        ret = -EIO;
+    }
+
+    unlink(idx);
+    return ret;
+}
+
+/*
+ * Writes the image gzipped with a restart point every MiB on threads
+ * threads, imports it with sparse_file_import_gz and checks that the MiB
+ * either side of the middle of the image, which straddles a restart point,
+ * reads back the same as from the raw image.
+ */
+static int check_gz_restart(struct bench *b, unsigned int threads)
+{
+    struct sparse_file *s;
+    size_t len = b->len < CHECK_GZ_WINDOW ? b->len : CHECK_GZ_WINDOW;
+    int64_t offset = (b->len - len) / 2;
+    char *buf;
+    char *ref;
+    int in;
+    int out;
+    int raw;
+    int64_t ret;
+
+    buf = malloc(len);
+    ref = malloc(len);
+    if (!buf || !ref) {
+        free(buf);
+        free(ref);
+        return -ENOMEM;
+    }
+
+    s = import(b->image, false, &in);
+    if (!s) {
+        ret = -EINVAL;
+        goto out_free;
+    }
+    out = open_out(b->out);
+    if (out < 0) {
+        ret = -errno;
+    } else {
+        sparse_file_set_threads(s, threads);
+        sparse_file_set_gz_restart(s, 1024 * 1024);
+        ret = sparse_file_write(s, out, true, false, false);
+        close(out);
+    }
+    sparse_file_destroy(s);
+    close(in);
+    if (ret < 0) {
+        goto out_free;
+    }
+
+    in = open(b->out, O_RDONLY | O_BINARY);
+    s = in < 0 ? NULL : sparse_file_import_gz(in, false);
+    if (!s) {
+        ret = in < 0 ? -errno : -EINVAL;
+        goto out_close;
+    }
+    ret = sparse_file_pread(s, buf, len, offset);
+    sparse_file_destroy(s);
+
+    raw = open(b->raw_image, O_RDONLY | O_BINARY);
+    if (raw < 0) {
+        ret = -errno;
+    } else if (ret >= 0 && pread(raw, ref, len, offset) != (ssize_t) len) {
+        ret = -EIO;
+    }
+    if (raw >= 0) {
+        close(raw);
+    }
+    if (ret >= 0 && (ret != (int64_t) len || memcmp(buf, ref, len) != 0)) {
+        ret = -EIO;
+    }
+
+ out_close:
+    if (in >= 0) {
+        close(in);
+    }
+ out_free:
+    free(buf);
+    free(ref);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Runs count conversions at once to shake out shared state in the library.
+ * Build with SANITIZE=-fsanitize=thread to have ThreadSanitizer watch it.
+ */
+static int run_stress(struct bench *b, unsigned int count)
+{
+    struct stress st;
+    struct stress_worker *workers;
+    struct sparse_file *s;
+    unsigned int started;
+    unsigned int i;
+    int in;
+    int ret = 0;
+
+    ret = check_unaligned_pread();
+    if (ret < 0) {
+        fprintf(stderr, "unaligned pread: %s\n", strerror(-ret));
+        return ret;
+    }
+
+    ret = check_index(b);
+    if (ret < 0) {
+        fprintf(stderr, "index: %s\n", strerror(-ret));
+        return ret;
+    }
+
+    for (i = 1; i <= 2; i++) {
+        ret = check_gz_restart(b, i);
+        if (ret < 0) {
+            fprintf(stderr, "gz restart on %u threads: %s\n", i, strerror(-ret));
+            return ret;
+        }
+    }
+
+    st.b = b;
+    s = import(b->image, false, &in);
+    if (!s) {
+        return -EINVAL;
+    }
+    ret = sparse_file_hash_tree(s, NULL, 0, -1, st.root);
+    sparse_file_destroy(s);
+    close(in);
+    if (ret < 0) {
+        return ret;
+    }
+
+    workers = calloc(count, sizeof(struct stress_worker));
+    if (!workers) {
+        return -ENOMEM;
+    }
+
+    for (started = 0; started < count; started++) {
+        workers[started].st = &st;
+        workers[started].id = started;
+        if (snprintf(workers[started].out, sizeof(workers[started].out), "%s.%u", b->out,
+                     started) >= (int)sizeof(workers[started].out)) {
+            ret = -ENAMETOOLONG;
+            break;
+        }
+        if (pthread_create(&workers[started].thread, NULL, stress_run, &workers[started])) {
+            ret = -EAGAIN;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].ret < 0 || workers[i].messages) {
+            fprintf(stderr, "worker %u: %s, %u messages\n", i,
+                    workers[i].ret < 0 ? strerror(-workers[i].ret) : "ok", workers[i].messages);
+            ret = workers[i].ret < 0 ? workers[i].ret : -EIO;
+        }
+    }
+
+    if (ret == 0) {
+        printf("stress: %u conversions on %u threads, %u threads each: ok\n",
+               count * b->cfg.iterations, count, b->cfg.threads);
+    }
+
+    free(workers);
+    return ret;
+}
+
+static int run_all(struct bench *b)
+{
+    struct bench_result *r;
+    double best;
+    double elapsed;
+    unsigned int i;
+    unsigned int op;
+    int ret;
+
+    for (op = 0; op < OP_COUNT; op++) {
+        best = 0;
+        for (i = 0; i < b->cfg.iterations; i++) {
+            elapsed = 0;
+            ret = run_op(b, op, &elapsed);
+            if (ret < 0) {
+                fprintf(stderr, "%s failed (%s)\n", op_names[op], strerror(-ret));
+                return ret;
+            }
+            if (i == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        /* Guard against timer resolution on tiny images */
+        if (best < 1e-6) {
+            best = 1e-6;
+        }
+
+        r = &b->results[b->count++];
+        snprintf(r->op, sizeof(r->op), "%s", op_names[op]);
+        r->mb_per_s = b->len / (1024.0 * 1024.0) / best;
+        r->chunks_per_s = b->chunks / best;
+    }
+
+    return 0;
+}
+
+/* The first line of a results file, describing what was measured */
+static void format_header(struct bench *b, char *buf, size_t len)
+{
+    struct bench_config *cfg = &b->cfg;
+
+    snprintf(buf, len, "# simg_bench %d size_mb=%u chunks=%u raw_pct=%u fill_pct=%u "
+             "block_size=%u threads=%u seed=%u\n", BENCH_FORMAT_VERSION, cfg->size_mb,
+             cfg->chunks, cfg->raw_pct, cfg->fill_pct, cfg->block_size, cfg->threads, cfg->seed);
+}
+
+static int write_results(struct bench *b, const char *path)
+{
+    char header[256];
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        return -errno;
+    }
+
+    format_header(b, header, sizeof(header));
+    fputs(header, f);
+    fprintf(f, "# op mb_per_s chunks_per_s\n");
+    for (i = 0; i < b->count; i++) {
+        fprintf(f, "%s %.2f %.2f\n", b->results[i].op, b->results[i].mb_per_s,
+                b->results[i].chunks_per_s);
+    }
+
+    if (fclose(f) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int read_results(const char *path, char *header, size_t header_len,
+                        struct bench_result *results, unsigned int *count)
+{
+    char line[256];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        return -errno;
+    }
+
+    *count = 0;
+    header[0] = '\0';
+    while (fgets(line, sizeof(line), f) && *count < MAX_RESULTS) {
+        if (strncmp(line, "# simg_bench ", 13) == 0) {
+            snprintf(header, header_len, "%s", line);
+        }
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%31s %lf %lf", results[*count].op, &results[*count].mb_per_s,
+                   &results[*count].chunks_per_s) == 3) {
+            (*count)++;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Prints the results, against the baseline if there is one, and returns the
+ * number of operations that got slower by more than tolerance percent */
+static int report(struct bench *b, struct bench_result *baseline, unsigned int baseline_count,
+                  unsigned int tolerance)
+{
+    struct bench_result *r;
+    struct bench_result *base;
+    double change;
+    int regressions = 0;
+    unsigned int i;
+    unsigned int j;
+
+    printf("image: %u MiB expanded, %u chunks, %u%% raw, %u%% fill, block size %u\n",
+           b->cfg.size_mb, b->chunks, b->cfg.raw_pct, b->cfg.fill_pct, b->cfg.block_size);
+    printf("%-14s %12s %14s", "op", "MB/s", "chunks/s");
+    if (baseline_count) {
+        printf(" %12s %8s", "base MB/s", "change");
+    }
+    printf("\n");
+
+    for (i = 0; i < b->count; i++) {
+        r = &b->results[i];
+        printf("%-14s %12.2f %14.2f", r->op, r->mb_per_s, r->chunks_per_s);
+
+        base = NULL;
+        for (j = 0; j < baseline_count; j++) {
+            if (strcmp(baseline[j].op, r->op) == 0) {
+                base = &baseline[j];
+            }
+        }
+        if (base && base->mb_per_s > 0) {
+            change = 100.0 * (r->mb_per_s - base->mb_per_s) / base->mb_per_s;
+            printf(" %12.2f %+7.1f%%", base->mb_per_s, change);
+            if (change < -(double)tolerance) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+    }
+
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench *b;
+    struct bench_result baseline[MAX_RESULTS];
+    unsigned int baseline_count = 0;
+    char baseline_header[256];
+    char header[256];
+    const char *results_path = NULL;
+    const char *baseline_path = NULL;
+    unsigned int tolerance = 10;
+    unsigned int stress = 0;
+    int regressions;
+    int opt;
+    int ret;
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        exit(-1);
+    }
+    b->cfg.size_mb = 256;
+    b->cfg.chunks = 4096;
+    b->cfg.raw_pct = 40;
+    b->cfg.fill_pct = 40;
+    b->cfg.block_size = 4096;
+    b->cfg.iterations = 3;
+    b->cfg.threads = 1;
+    b->cfg.seed = 1;
+    b->cfg.dir = "/tmp";
+
+    while ((opt = getopt(argc, argv, "s:c:r:f:B:n:j:S:d:o:b:t:C:")) != -1) {
+        switch (opt) {
+        case 's':
+            b->cfg.size_mb = parse_count(optarg, MAX_SIZE_MB);
+            break;
+        case 'c':
+            b->cfg.chunks = atoi(optarg);
+            break;
+        case 'r':
+            b->cfg.raw_pct = atoi(optarg);
+            break;
+        case 'f':
+            b->cfg.fill_pct = atoi(optarg);
+            break;
+        case 'B':
+            b->cfg.block_size = atoi(optarg);
+            break;
+        case 'n':
+            b->cfg.iterations = parse_count(optarg, MAX_ITERATIONS);
+            break;
+        case 'j':
+            b->cfg.threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            break;
+        case 'S':
+            b->cfg.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            b->cfg.dir = optarg;
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 't':
+            tolerance = atoi(optarg);
+            break;
+        case 'C':
+            stress = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (stress == 0) {
+                usage();
+                exit(-1);
+            }
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (optind != argc || b->cfg.size_mb == 0 || b->cfg.iterations == 0 ||
+        b->cfg.threads == 0 || b->cfg.raw_pct + b->cfg.fill_pct > 100 ||
+        b->cfg.block_size < 1024 || b->cfg.block_size % 4 != 0) {
+        usage();
+        exit(-1);
+    }
+
+    if (baseline_path) {
+        if (read_results(baseline_path, baseline_header, sizeof(baseline_header), baseline,
+                         &baseline_count) < 0) {
+            fprintf(stderr, "Cannot read baseline %s\n", baseline_path);
+            exit(-1);
+        }
+        format_header(b, header, sizeof(header));
+        if (strcmp(header, baseline_header) != 0) {
+            fprintf(stderr, "Warning: baseline %s was measured with different settings\n",
+                    baseline_path);
+        }
+    }
+
+    snprintf(b->image, sizeof(b->image), "%s/simg_bench.%d.simg", b->cfg.dir, (int)getpid());
+    snprintf(b->crc_image, sizeof(b->crc_image), "%s/simg_bench.%d.crc.simg", b->cfg.dir,
+             (int)getpid());
+    snprintf(b->raw_image, sizeof(b->raw_image), "%s/simg_bench.%d.img", b->cfg.dir,
+             (int)getpid());
+    snprintf(b->out, sizeof(b->out), "%s/simg_bench.%d.out", b->cfg.dir, (int)getpid());
+
+    ret = generate(b);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to generate test image (%s)\n", strerror(-ret));
+    } else if (stress) {
+        ret = run_stress(b, stress);
+    } else {
+        ret = run_all(b);
+    }
+
+    unlink(b->image);
+    unlink(b->crc_image);
+    unlink(b->raw_image);
+    unlink(b->out);
+
+    if (ret < 0) {
+        exit(-1);
+    }
+    if (stress) {
+        free(b);
+        exit(0);
+    }
+
+    regressions = report(b, baseline, baseline_count, tolerance);
+
+    if (results_path && write_results(b, results_path) < 0) {
+        fprintf(stderr, "Cannot write results to %s\n", results_path);
+        exit(-1);
+    }
+
+    free(b);
+    exit(regressions ? 1 : 0);
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "simg_opt.h"
+#include "sparse_parallel.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_delta [-j <threads>] [-v] <old image> <new image> <delta image>\n");
+    fprintf(stderr, "  -j    number of threads comparing blocks\n");
+    fprintf(stderr, "  -v    print verbose errors while importing\n");
+    fprintf(stderr, "Writes a sparse image holding only the blocks of the new sparse or raw image\n");
+    fprintf(stderr, "that differ from the old one.  Flashing it over the old image gives the new.\n");
+}
+
+static struct sparse_file *import(const char *path, bool verbose, int *fd)
+{
+    struct sparse_file *s;
+
+    *fd = open(path, O_RDONLY | O_BINARY);
+    if (*fd < 0) {
+        fprintf(stderr, "Cannot open input file %s\n", path);
+        exit(-1);
+    }
+
+    s = sparse_file_import_auto(*fd, false, verbose);
+    if (!s) {
+        fprintf(stderr, "Failed to import %s\n", path);
+        exit(-1);
+    }
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    int old_fd;
+    int new_fd;
+    int out;
+    int ret;
+    int opt;
+    int64_t changed;
+    bool verbose = false;
+    unsigned int threads = 1;
+    unsigned int block_size;
+    struct sparse_file *old_s;
+    struct sparse_file *new_s;
+    struct sparse_file *delta_s;
+
+    while ((opt = getopt(argc, argv, "j:v")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 4) {
+        usage();
+        exit(-1);
+    }
+
+    old_s = import(argv[1], verbose, &old_fd);
+    new_s = import(argv[2], verbose, &new_fd);
+    sparse_file_set_threads(new_s, threads);
+
+    changed = sparse_file_delta(old_s, new_s, &delta_s);
+    if (changed < 0) {
+        fprintf(stderr, "Failed to compare images (%s)\n", strerror(-changed));
+        exit(-1);
+    }
+
+    out = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", argv[3]);
+        exit(-1);
+    }
+
+    ret = sparse_file_write(delta_s, out, false, true, false);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write delta image\n");
+        exit(-1);
+    }
+
+    block_size = sparse_file_block_size(new_s);
+    printf("%lld of %lld blocks changed, delta is %lld bytes\n", (long long)changed,
+           (long long)((sparse_file_len(new_s, false, false) + block_size - 1) / block_size),
+           (long long)sparse_file_len(delta_s, true, false));
+
+    close(out);
+    sparse_file_destroy(delta_s);
+    sparse_file_destroy(new_s);
+    sparse_file_destroy(old_s);
+    close(new_fd);
+    close(old_fd);
+
+    exit(0);
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "simg_opt.h"
+#include "sparse_parallel.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct diff_out {
+    bool json;
+    unsigned int ranges;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_diff [-j <threads>] [-J] [-v] <image a> <image b>\n");
+    fprintf(stderr, "  -j    number of threads comparing blocks\n");
+    fprintf(stderr, "  -J    print the differing ranges as JSON\n");
+    fprintf(stderr, "  -v    print verbose errors while importing\n");
+    fprintf(stderr, "Prints the ranges of blocks that differ between two sparse or raw images, as\n");
+    fprintf(stderr, "first-last block numbers, without expanding them.  Exits with 0 if the images\n");
+    fprintf(stderr, "are the same and 1 if they differ.\n");
+}
+
+static struct sparse_file *import(const char *path, bool verbose, int *fd)
+{
+    struct sparse_file *s;
+
+    *fd = open(path, O_RDONLY | O_BINARY);
+    if (*fd < 0) {
+        fprintf(stderr, "Cannot open input file %s\n", path);
+        exit(-1);
+    }
+
+    s = sparse_file_import_auto(*fd, false, verbose);
+    if (!s) {
+        fprintf(stderr, "Failed to import %s\n", path);
+        exit(-1);
+    }
+
+    return s;
+}
+
+static int print_range(void *priv, unsigned int block, unsigned int count)
+{
+    struct diff_out *o = priv;
+
+    if (o->json) {
+        printf("%s\n    {\"start\": %u, \"count\": %u}", o->ranges ? "," : "", block, count);
+    } else if (count == 1) {
+        printf("%u\n", block);
+    } else {
+        printf("%u-%u\n", block, block + count - 1);
+    }
+    o->ranges++;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int a_fd;
+    int b_fd;
+    int opt;
+    int64_t changed;
+    int64_t a_len, b_len;
+    bool verbose = false;
+    unsigned int threads = 1;
+    unsigned int block_size;
+    long long blocks;
+    struct diff_out o;
+    struct sparse_file *a_s;
+    struct sparse_file *b_s;
+
+    memset(&o, 0, sizeof(o));
+
+    while ((opt = getopt(argc, argv, "j:Jv")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'J':
+            o.json = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 3) {
+        usage();
+        exit(-1);
+    }
+
+    a_s = import(argv[1], verbose, &a_fd);
+    b_s = import(argv[2], verbose, &b_fd);
+    sparse_file_set_threads(a_s, threads);
+
+    block_size = sparse_file_block_size(a_s);
+    a_len = sparse_file_len(a_s, false, false);
+    b_len = sparse_file_len(b_s, false, false);
+    blocks = ((a_len > b_len ? a_len : b_len) + block_size - 1) / block_size;
+
+    if (o.json) {
+        printf("{\n  \"block_size\": %u,\n  \"ranges\": [", block_size);
+    }
+
+    changed = sparse_file_diff(a_s, b_s, print_range, &o);
+    if (changed < 0) {
+        fprintf(stderr, "Failed to compare images (%s)\n", strerror(-changed));
+        exit(-1);
+    }
+
+    if (o.json) {
+        printf("%s],\n", o.ranges ? "\n  " : "");
+        printf("  \"differing_blocks\": %lld,\n", (long long)changed);
+        printf("  \"blocks\": %lld,\n", blocks);
+        printf("  \"size_a\": %lld,\n", (long long)a_len);
+        printf("  \"size_b\": %lld\n}\n", (long long)b_len);
+    } else {
+        printf("%lld of %lld blocks differ", (long long)changed, blocks);
+        if (a_len != b_len) {
+            printf(", images are %lld and %lld bytes", (long long)a_len, (long long)b_len);
+        }
+        printf("\n");
+    }
+
+    sparse_file_destroy(b_s);
+    sparse_file_destroy(a_s);
+    close(b_fd);
+    close(a_fd);
+
+    exit(changed ? 1 : 0);
+}
@@ -0,0 +1,703 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef USE_MINGW
+#include <sys/mman.h>
+#endif
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "simg_opt.h"
+#include "sparse_format.h"
+#include "sparse_parallel.h"
+#include "sparse_sha256.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Chunk sizes are counted in power of two buckets of output bytes */
+#define HISTOGRAM_BUCKETS 48
+
+/* Number of largest chunks listed */
+#define LARGEST_CHUNKS 10
+
+/* Amount of a fill pattern hashed at a time */
+#define FILL_HASH_SIZE (64U * 1024U)
+
+enum chunk_kind {
+    KIND_RAW,
+    KIND_FILL,
+    KIND_DONT_CARE,
+    KIND_CRC32,
+    KIND_COUNT,
+};
+
+static const char *kind_names[KIND_COUNT] = {
+    "raw", "fill", "dont_care", "crc32",
+};
+
+struct chunk {
+    enum chunk_kind kind;
+    unsigned int index;
+    int64_t in_offset;
+    uint32_t data_sz;
+    uint32_t out_block;
+    uint32_t blocks;
+    uint32_t value;
+    uint8_t hash[SPARSE_SHA256_DIGEST_SIZE];
+};
+
+struct kind_stats {
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t hist_chunks[HISTOGRAM_BUCKETS];
+    uint64_t hist_bytes[HISTOGRAM_BUCKETS];
+};
+
+struct image {
+    const char *path;
+    const unsigned char *map;
+    int64_t len;
+    sparse_header_t header;
+
+    struct chunk *chunks;
+    unsigned int count;
+    uint64_t out_blocks;
+    int64_t end;
+    const char *error;
+
+    struct kind_stats stats[KIND_COUNT];
+    uint64_t extents;
+    unsigned int largest[LARGEST_CHUNKS];
+    unsigned int largest_count;
+};
+
+struct options {
+    bool verbose;
+    bool hash;
+    bool json;
+    unsigned int threads;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_dump [-v] [-s] [-j <threads>] [--json] <sparse image file> ...\n");
+    fprintf(stderr, "  -v, --verbose      list every chunk\n");
+    fprintf(stderr, "  -s, --showhash     show the sha256 of the output of each chunk\n");
+    fprintf(stderr, "  -j, --threads <n>  number of threads hashing chunks\n");
+    fprintf(stderr, "      --json         print JSON instead of text\n");
+}
+
+static int map_image(struct image *img)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(img->path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(sparse_header_t)) {
+        close(fd);
+        return -1;
+    }
+    img->len = st.st_size;
+
+#ifndef USE_MINGW
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+#else
+    map = malloc(st.st_size);
+    if (!map || read(fd, map, st.st_size) != st.st_size) {
+        free(map);
+        close(fd);
+        return -1;
+    }
+#endif
+    close(fd);
+
+    img->map = map;
+    return 0;
+}
+
+static void unmap_image(struct image *img)
+{
+#ifndef USE_MINGW
+    munmap((void *)img->map, img->len);
+#else
+    free((void *)img->map);
+#endif
+}
+
+/* Walks the chunk headers, stopping at the first one that makes no sense */
+static int parse_image(struct image *img)
+{
+    sparse_header_t *header = &img->header;
+    chunk_header_t chunk_header;
+    struct chunk *c;
+    int64_t offset;
+    uint32_t data_sz;
+    unsigned int i;
+
+    memcpy(header, img->map, sizeof(*header));
+    if (header->magic != SPARSE_HEADER_MAGIC) {
+        img->error = "bad magic";
+        return -1;
+    }
+    if (header->major_version != 1) {
+        img->error = "unknown major version";
+        return -1;
+    }
+    if (header->file_hdr_sz < sizeof(sparse_header_t) ||
+        header->chunk_hdr_sz < sizeof(chunk_header_t) || header->blk_sz == 0 ||
+        header->blk_sz % 4) {
+        img->error = "bad header sizes";
+        return -1;
+    }
+
+    img->chunks = calloc(header->total_chunks ? header->total_chunks : 1, sizeof(struct chunk));
+    if (!img->chunks) {
+        img->error = "out of memory";
+        return -1;
+    }
+
+    offset = header->file_hdr_sz;
+    for (i = 0; i < header->total_chunks; i++) {
+        if (offset + header->chunk_hdr_sz > img->len) {
+            img->error = "truncated chunk header";
+            break;
+        }
+        memcpy(&chunk_header, img->map + offset, sizeof(chunk_header));
+        if (chunk_header.total_sz < header->chunk_hdr_sz) {
+            img->error = "chunk smaller than its header";
+            break;
+        }
+        data_sz = chunk_header.total_sz - header->chunk_hdr_sz;
+
+        c = &img->chunks[i];
+        c->index = i;
+        c->in_offset = offset + header->chunk_hdr_sz;
+        c->data_sz = data_sz;
+        c->out_block = img->out_blocks;
+        c->blocks = chunk_header.chunk_sz;
+
+        switch (chunk_header.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            c->kind = KIND_RAW;
+            if (data_sz != (uint64_t) chunk_header.chunk_sz * header->blk_sz) {
+                img->error = "raw chunk input size does not match output size";
+            }
+            break;
+        case CHUNK_TYPE_FILL:
+            c->kind = KIND_FILL;
+            if (data_sz != sizeof(uint32_t)) {
+                img->error = "fill chunk without 4 bytes of fill";
+            }
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            c->kind = KIND_DONT_CARE;
+            if (data_sz != 0) {
+                img->error = "don't care chunk with data";
+            }
+            break;
+        case CHUNK_TYPE_CRC32:
+            c->kind = KIND_CRC32;
+            if (data_sz != sizeof(uint32_t)) {
+                img->error = "crc32 chunk without 4 bytes of crc";
+            }
+            break;
+        default:
+            img->error = "unknown chunk type";
+            break;
+        }
+        if (!img->error && c->in_offset + data_sz > img->len) {
+            img->error = "truncated chunk data";
+        }
+        if (img->error) {
+            break;
+        }
+
+        if (c->kind == KIND_FILL || c->kind == KIND_CRC32) {
+            memcpy(&c->value, img->map + c->in_offset, sizeof(c->value));
+        }
+
+        img->out_blocks += chunk_header.chunk_sz;
+        offset += chunk_header.total_sz;
+        img->count++;
+    }
+    img->end = offset;
+
+    if (!img->error && img->out_blocks != header->total_blks) {
+        img->error = "output blocks do not match the header";
+    }
+
+    return 0;
+}
+
+static unsigned int bucket(uint64_t bytes)
+{
+    unsigned int b = 0;
+
+    while (bytes > 1 && b < HISTOGRAM_BUCKETS - 1) {
+        bytes >>= 1;
+        b++;
+    }
+
+    return b;
+}
+
+static void collect_stats(struct image *img)
+{
+    struct chunk *c;
+    struct kind_stats *ks;
+    uint64_t bytes;
+    bool in_extent = false;
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < img->count; i++) {
+        c = &img->chunks[i];
+        bytes = (uint64_t) c->blocks * img->header.blk_sz;
+        ks = &img->stats[c->kind];
+        ks->chunks++;
+        ks->bytes += bytes;
+        if (c->kind != KIND_CRC32) {
+            ks->hist_chunks[bucket(bytes)]++;
+            ks->hist_bytes[bucket(bytes)] += bytes;
+        }
+
+        /* An extent is a run of chunks with data between don't care chunks */
+        if (c->kind == KIND_RAW || c->kind == KIND_FILL) {
+            if (!in_extent) {
+                img->extents++;
+            }
+            in_extent = true;
+        } else if (c->kind == KIND_DONT_CARE) {
+            in_extent = false;
+        }
+
+        /* Insertion into the short list of largest chunks */
+        if (c->kind == KIND_CRC32) {
+            continue;
+        }
+        for (j = img->largest_count; j > 0; j--) {
+            if (img->chunks[img->largest[j - 1]].blocks >= c->blocks) {
+                break;
+            }
+            if (j < LARGEST_CHUNKS) {
+                img->largest[j] = img->largest[j - 1];
+            }
+        }
+        if (j < LARGEST_CHUNKS) {
+            img->largest[j] = i;
+            if (img->largest_count < LARGEST_CHUNKS) {
+                img->largest_count++;
+            }
+        }
+    }
+}
+
+struct hash_order {
+    uint32_t blocks;
+    unsigned int chunk;
+};
+
+struct hash_work {
+    struct image *img;
+    struct hash_order *order;
+};
+
+static int hash_chunk(void *priv, unsigned int worker __unused, unsigned int idx)
+{
+    struct hash_work *hw = priv;
+    struct chunk *c = &hw->img->chunks[hw->order[idx].chunk];
+    uint64_t len = (uint64_t) c->blocks * hw->img->header.blk_sz;
+    uint32_t pattern[FILL_HASH_SIZE / sizeof(uint32_t)];
+    sparse_sha256_ctx ctx;
+    uint64_t n;
+    unsigned int i;
+
+    sparse_sha256_init(&ctx);
+    if (c->kind == KIND_RAW) {
+        sparse_sha256_update(&ctx, hw->img->map + c->in_offset, c->data_sz);
+    } else {
+        for (i = 0; i < FILL_HASH_SIZE / sizeof(uint32_t); i++) {
+            pattern[i] = c->kind == KIND_FILL ? c->value : 0;
+        }
+        while (len > 0) {
+            n = len < FILL_HASH_SIZE ? len : FILL_HASH_SIZE;
+            sparse_sha256_update(&ctx, pattern, n);
+            len -= n;
+        }
+    }
+    sparse_sha256_final(&ctx, c->hash);
+
+    return 0;
+}
+
+static int compare_size_desc(const void *a, const void *b)
+{
+    uint32_t sa = ((const struct hash_order *)a)->blocks;
+    uint32_t sb = ((const struct hash_order *)b)->blocks;
+
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/*
+ * Hashes the expanded output of every raw, fill and don't care chunk.  The
+ * biggest chunks are handed out first so one huge chunk doesn't end up last
+ * on a single thread.
+ */
+static int hash_chunks(struct image *img, unsigned int threads)
+{
+    struct hash_work hw;
+    unsigned int count = 0;
+    unsigned int i;
+    int ret;
+
+    hw.img = img;
+    hw.order = calloc(img->count ? img->count : 1, sizeof(struct hash_order));
+    if (!hw.order) {
+        return -1;
+    }
+
+    for (i = 0; i < img->count; i++) {
+        if (img->chunks[i].kind != KIND_CRC32) {
+            hw.order[count].blocks = img->chunks[i].blocks;
+            hw.order[count].chunk = i;
+            count++;
+        }
+    }
+    qsort(hw.order, count, sizeof(struct hash_order), compare_size_desc);
+
+    ret = sparse_parallel_for(threads, count, hash_chunk, &hw);
+
+    free(hw.order);
+    return ret;
+}
+
+static void print_hex(const uint8_t * data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        printf("%02x", data[i]);
+    }
+}
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void print_chunk_type(const struct chunk *c)
+{
+    switch (c->kind) {
+    case KIND_RAW:
+        printf("Raw data");
+        break;
+    case KIND_FILL:
+        printf("Fill with 0x%08X", c->value);
+        break;
+    case KIND_DONT_CARE:
+        printf("Don't care");
+        break;
+    default:
+        printf("Unverified CRC32 0x%08X", c->value);
+        break;
+    }
+}
+
+static void print_text(struct image *img, const struct options *opts)
+{
+    const sparse_header_t *header = &img->header;
+    const struct kind_stats *ks;
+    const struct chunk *c;
+    uint64_t total = (uint64_t) header->total_blks * header->blk_sz;
+    unsigned int i;
+    unsigned int k;
+    unsigned int b;
+
+    /* Nothing but the error if the header itself is unusable */
+    if (!img->chunks) {
+        printf("%s: error: %s\n", img->path, img->error);
+        return;
+    }
+
+    printf("%s: Total of %u %u-byte output blocks in %u input chunks.\n",
+           img->path, header->total_blks, header->blk_sz, header->total_chunks);
+    if (header->image_checksum) {
+        printf("checksum=0x%08X\n", header->image_checksum);
+    }
+
+    if (opts->verbose || opts->hash) {
+        printf("            input_bytes      output_blocks\n");
+        printf("chunk    offset     number  offset  number\n");
+        for (i = 0; i < img->count; i++) {
+            c = &img->chunks[i];
+            printf("%4u %10" PRId64 " %10u %7u %7u ", i + 1, c->in_offset, c->data_sz,
+                   c->out_block, c->blocks);
+            print_chunk_type(c);
+            if (opts->hash && c->kind != KIND_CRC32) {
+                printf(" ");
+                print_hex(c->hash, sizeof(c->hash));
+            }
+            printf("\n");
+        }
+        printf("     %10" PRId64 "            %7" PRIu64 "         End\n", img->end,
+               img->out_blocks);
+    }
+
+    if (img->error) {
+        printf("%s: error: %s\n", img->path, img->error);
+    }
+    if (!img->error && img->end < img->len) {
+        printf("There were %" PRId64 " bytes of extra data at the end of the file.\n",
+               img->len - img->end);
+    }
+
+    printf("\n%-10s %10s %16s %7s\n", "type", "chunks", "output bytes", "share");
+    for (k = 0; k < KIND_COUNT; k++) {
+        ks = &img->stats[k];
+        printf("%-10s %10" PRIu64 " %16" PRIu64 " %6.2f%%\n", kind_names[k], ks->chunks,
+               ks->bytes, total ? 100.0 * ks->bytes / total : 0.0);
+    }
+
+    printf("\ndata extents %" PRIu64 ", average %.1f blocks, %.2f chunks per extent\n",
+           img->extents,
+           img->extents ? (double)(img->stats[KIND_RAW].bytes + img->stats[KIND_FILL].bytes) /
+           header->blk_sz / img->extents : 0.0,
+           img->extents ? (double)(img->stats[KIND_RAW].chunks + img->stats[KIND_FILL].chunks) /
+           img->extents : 0.0);
+
+    for (k = KIND_RAW; k <= KIND_DONT_CARE; k++) {
+        ks = &img->stats[k];
+        if (!ks->chunks) {
+            continue;
+        }
+        printf("\n%s chunk sizes\n", kind_names[k]);
+        for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (ks->hist_chunks[b]) {
+                printf("  >= %14" PRIu64 " bytes: %10" PRIu64 " chunks %16" PRIu64 " bytes\n",
+                       (uint64_t) 1 << b, ks->hist_chunks[b], ks->hist_bytes[b]);
+            }
+        }
+    }
+
+    if (img->largest_count) {
+        printf("\nlargest chunks\n");
+        for (i = 0; i < img->largest_count; i++) {
+            c = &img->chunks[img->largest[i]];
+            printf("  %4u %10u blocks at %10u  ", c->index + 1, c->blocks, c->out_block);
+            print_chunk_type(c);
+            printf("\n");
+        }
+    }
+}
+
+static void print_json(struct image *img, const struct options *opts)
+{
+    const sparse_header_t *header = &img->header;
+    const struct kind_stats *ks;
+    const struct chunk *c;
+    unsigned int i;
+    unsigned int k;
+    unsigned int b;
+    bool first;
+
+    printf("{\"file\": ");
+    print_json_string(img->path);
+    printf(", \"file_size\": %" PRId64 ", \"blk_sz\": %u, \"total_blks\": %u, "
+           "\"total_chunks\": %u, \"image_checksum\": %u",
+           img->len, header->blk_sz, header->total_blks, header->total_chunks,
+           header->image_checksum);
+    printf(", \"error\": ");
+    if (img->error) {
+        print_json_string(img->error);
+    } else {
+        printf("null");
+    }
+    printf(", \"trailing_bytes\": %" PRId64, img->error ? 0 : img->len - img->end);
+
+    printf(", \"stats\": {");
+    for (k = 0; k < KIND_COUNT; k++) {
+        ks = &img->stats[k];
+        printf("%s\"%s\": {\"chunks\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"histogram\": [",
+               k ? ", " : "", kind_names[k], ks->chunks, ks->bytes);
+        first = true;
+        for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (ks->hist_chunks[b]) {
+                printf("%s{\"min_bytes\": %" PRIu64 ", \"chunks\": %" PRIu64
+                       ", \"bytes\": %" PRIu64 "}", first ? "" : ", ", (uint64_t) 1 << b,
+                       ks->hist_chunks[b], ks->hist_bytes[b]);
+                first = false;
+            }
+        }
+        printf("]}");
+    }
+    printf("}, \"extents\": %" PRIu64, img->extents);
+
+    printf(", \"largest\": [");
+    for (i = 0; i < img->largest_count; i++) {
+        c = &img->chunks[img->largest[i]];
+        printf("%s{\"chunk\": %u, \"type\": \"%s\", \"blocks\": %u, \"out_block\": %u}",
+               i ? ", " : "", c->index + 1, kind_names[c->kind], c->blocks, c->out_block);
+    }
+    printf("]");
+
+    if (opts->verbose || opts->hash) {
+        printf(", \"chunks\": [");
+        for (i = 0; i < img->count; i++) {
+            c = &img->chunks[i];
+            printf("%s{\"chunk\": %u, \"type\": \"%s\", \"in_offset\": %" PRId64
+                   ", \"in_bytes\": %u, \"out_block\": %u, \"blocks\": %u",
+                   i ? ", " : "", i + 1, kind_names[c->kind], c->in_offset, c->data_sz,
+                   c->out_block, c->blocks);
+            if (c->kind == KIND_FILL || c->kind == KIND_CRC32) {
+                printf(", \"value\": %u", c->value);
+            }
+            if (opts->hash && c->kind != KIND_CRC32) {
+                printf(", \"sha256\": \"");
+                print_hex(c->hash, sizeof(c->hash));
+                printf("\"");
+            }
+            printf("}");
+        }
+        printf("]");
+    }
+
+    printf("}");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"verbose", no_argument, NULL, 'v'},
+        {"showhash", no_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 'j'},
+        {"json", no_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options opts = {.threads = 1 };
+    struct image img;
+    int status = 0;
+    int printed = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, "vsj:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 's':
+            opts.hash = true;
+            break;
+        case 'j':
+            opts.threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (opts.threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 'J':
+            opts.json = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        exit(-1);
+    }
+
+    if (opts.json) {
+        printf("[");
+    }
+
+    for (i = optind; i < argc; i++) {
+        memset(&img, 0, sizeof(img));
+        img.path = argv[i];
+
+        if (map_image(&img) < 0) {
+            fprintf(stderr, "Cannot read %s\n", img.path);
+            status = -1;
+            continue;
+        }
+
+        if (parse_image(&img) == 0) {
+            collect_stats(&img);
+            if (opts.hash && hash_chunks(&img, opts.threads) < 0) {
+                img.error = "hashing failed";
+            }
+        }
+        if (img.error) {
+            status = -1;
+        }
+
+        if (opts.json) {
+            if (printed++) {
+                printf(",\n ");
+            }
+            print_json(&img, &opts);
+        } else {
+            print_text(&img, &opts);
+        }
+
+        free(img.chunks);
+        unmap_image(&img);
+    }
+
+    if (opts.json) {
+        printf("]\n");
+    }
+
+    exit(status);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "simg_opt.h"
+#include "sparse_parallel.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_hashtree [-j <threads>] [-s <salt>] <image file> [<hash tree file>]\n");
+    fprintf(stderr, "  -j    number of threads hashing blocks with data\n");
+    fprintf(stderr, "  -s    salt as a hex string\n");
+    fprintf(stderr, "Prints the root digest and salt of the dm-verity hash tree of a sparse or\n");
+    fprintf(stderr, "raw image, and writes the tree if a hash tree file is given.\n");
+}
+
+static int parse_hex(const char *hex, uint8_t ** out, size_t *out_len)
+{
+    size_t len = strlen(hex);
+    unsigned int byte;
+    size_t i;
+
+    if (len % 2) {
+        return -1;
+    }
+
+    *out_len = len / 2;
+    *out = malloc(*out_len ? *out_len : 1);
+    if (!*out) {
+        return -1;
+    }
+
+    for (i = 0; i < *out_len; i++) {
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            free(*out);
+            return -1;
+        }
+        (*out)[i] = byte;
+    }
+
+    return 0;
+}
+
+static void print_hex(const uint8_t * data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        printf("%02x", data[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int in;
+    int out = -1;
+    int ret;
+    int opt;
+    struct sparse_file *s;
+    unsigned int threads = 1;
+    uint8_t *salt = NULL;
+    size_t salt_len = 0;
+    uint8_t root[SPARSE_SHA256_DIGEST_SIZE];
+
+    while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = parse_count(optarg, SPARSE_PARALLEL_MAX_THREADS);
+            if (threads < 1) {
+                usage();
+                exit(-1);
+            }
+            break;
+        case 's':
+            free(salt);
+            if (parse_hex(optarg, &salt, &salt_len) < 0) {
+                fprintf(stderr, "Invalid salt %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2 || argc > 3) {
+        usage();
+        exit(-1);
+    }
+
+    in = open(argv[1], O_RDONLY | O_BINARY);
+    if (in < 0) {
+        fprintf(stderr, "Cannot open input file %s\n", argv[1]);
+        exit(-1);
+    }
+
+    s = sparse_file_import_auto(in, false, false);
+    if (!s) {
+        fprintf(stderr, "Failed to import image\n");
+        exit(-1);
+    }
+    sparse_file_set_threads(s, threads);
+
+    if (argc == 3) {
+        out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+        if (out < 0) {
+            fprintf(stderr, "Cannot open output file %s\n", argv[2]);
+            exit(-1);
+        }
+    }
+
+    ret = sparse_file_hash_tree(s, salt, salt_len, out, root);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to build hash tree (%s)\n", strerror(-ret));
+        exit(-1);
+    }
+
+    print_hex(root, sizeof(root));
+    printf(" ");
+    print_hex(salt, salt_len);
+    printf("\n");
+
+    if (out >= 0) {
+        close(out);
+    }
+    sparse_file_destroy(s);
+    close(in);
+    free(salt);
+
+    exit(0);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIMG_OPT_H_
+#define _SIMG_OPT_H_
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+/*
+ * Parses a count given on the command line, such as a number of threads.
+ * Values above max are clamped to it.  Returns 0 if arg is not a positive
+ * number, which the tools treat as a usage error.
+ */
+static inline unsigned int parse_count(const char *arg, unsigned int max)
+{
+    char *end;
+    long val;
+
+    errno = 0;
+    val = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || val < 1) {
+        return 0;
+    }
+    if (errno == ERANGE || (unsigned long)val > max) {
+        return max;
+    }
+
+    return val;
+}
+
+/*
+ * Imports the sparse image at path, open on fd, through the chunk index
+ * <path>.idx that --index asks for.  The index is written on the first import
+ * and reused while the image is unchanged.  Returns NULL if fd is not a sparse
+ * image, with fd back at its start for the caller's usual import.
+ */
+static inline struct sparse_file *import_indexed(int fd, const char *path, bool verbose)
+{
+    struct sparse_file *s;
+    char *idx;
+
+    idx = malloc(strlen(path) + sizeof(".idx"));
+    if (!idx) {
+        return NULL;
+    }
+    sprintf(idx, "%s.idx", path);
+
+    s = sparse_file_import_indexed(fd, idx, verbose);
+    free(idx);
+    if (!s) {
+        lseek(fd, 0, SEEK_SET);
+    }
+
+    return s;
+}
+
+#endif
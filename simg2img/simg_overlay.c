@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+void usage()
+{
+    fprintf(stderr, "Usage: simg_overlay [-v] <base image> <top image> [<top image> ...] <output image>\n");
+    fprintf(stderr, "  -v    print verbose errors while importing\n");
+    fprintf(stderr, "Writes a sparse image of the base sparse or raw image with each top image laid\n");
+    fprintf(stderr, "over it in turn.  Blocks defined in a top image replace those below it.\n");
+}
+
+static struct sparse_file *import(const char *path, bool verbose, int *fd)
+{
+    struct sparse_file *s;
+
+    *fd = open(path, O_RDONLY | O_BINARY);
+    if (*fd < 0) {
+        fprintf(stderr, "Cannot open input file %s\n", path);
+        exit(-1);
+    }
+
+    s = sparse_file_import_auto(*fd, false, verbose);
+    if (!s) {
+        fprintf(stderr, "Failed to import %s\n", path);
+        exit(-1);
+    }
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    int out;
+    int ret;
+    int opt;
+    int i;
+    int inputs;
+    bool verbose = false;
+    int *fds;
+    struct sparse_file **in_s;
+    struct sparse_file **merged_s;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 4) {
+        usage();
+        exit(-1);
+    }
+
+    inputs = argc - 2;
+    fds = calloc(inputs, sizeof(int));
+    in_s = calloc(inputs, sizeof(struct sparse_file *));
+    merged_s = calloc(inputs, sizeof(struct sparse_file *));
+    if (!fds || !in_s || !merged_s) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < inputs; i++) {
+        in_s[i] = import(argv[i + 1], verbose, &fds[i]);
+    }
+
+    /* Each overlay refers to the one before it, so all are kept until written */
+    merged_s[0] = in_s[0];
+    for (i = 1; i < inputs; i++) {
+        ret = sparse_file_overlay(merged_s[i - 1], in_s[i], &merged_s[i]);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to overlay %s (%s)\n", argv[i + 1], strerror(-ret));
+            exit(-1);
+        }
+    }
+
+    out = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", argv[argc - 1]);
+        exit(-1);
+    }
+
+    ret = sparse_file_write(merged_s[inputs - 1], out, false, true, false);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write output image\n");
+        exit(-1);
+    }
+
+    close(out);
+    for (i = inputs - 1; i >= 0; i--) {
+        if (i > 0) {
+            sparse_file_destroy(merged_s[i]);
+        }
+        sparse_file_destroy(in_s[i]);
+        close(fds[i]);
+    }
+    free(merged_s);
+    free(in_s);
+    free(fds);
+
+    exit(0);
+}
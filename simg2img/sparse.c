@@ -14,8 +14,16 @@
  * limitations under the License.
  */
 
-#include <assert.h>
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <sparse/sparse.h>
 
@@ -26,6 +34,25 @@
 #include "backed_block.h"
 #include "sparse_defs.h"
 #include "sparse_format.h"
+#include "sparse_gz.h"
+#include "sparse_parallel.h"
+#include "sparse_stats.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef USE_MINGW
+#define fsync _commit
+#endif
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+#define SPARSE_HEADER_MAJOR_VER 1
+
+/* Largest piece of a backed block expanded by one worker at a time */
+#define PARALLEL_TASK_SIZE (4U * 1024U * 1024U)
 
 struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 {
@@ -49,6 +76,7 @@ struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 void sparse_file_destroy(struct sparse_file *s)
 {
     backed_block_list_destroy(s->backed_block_list);
+    sparse_gz_destroy(s->gz);
     free(s);
 }
 
@@ -99,8 +127,12 @@ unsigned int sparse_count_chunks(struct sparse_file *s)
 
 static int sparse_file_write_block(struct output_file *out, struct backed_block *bb)
 {
+    bool fill = backed_block_type(bb) == BACKED_BLOCK_FILL;
+    int phase = stats_enter(fill ? SPARSE_STATS_PHASE_PAD : SPARSE_STATS_PHASE_IO);
     int ret = -EINVAL;
 
+    stats_add(chunks_written[fill ? SPARSE_STATS_CHUNK_FILL : SPARSE_STATS_CHUNK_RAW], 1);
+
     switch (backed_block_type(bb)) {
     case BACKED_BLOCK_DATA:
         ret = write_data_chunk(out, backed_block_len(bb), backed_block_data(bb));
@@ -116,11 +148,26 @@ static int sparse_file_write_block(struct output_file *out, struct backed_block
     case BACKED_BLOCK_FILL:
         ret = write_fill_chunk(out, backed_block_len(bb), backed_block_fill_val(bb));
         break;
+    case BACKED_BLOCK_GZ:
+        ret = write_gz_chunk(out, backed_block_len(bb),
+                             backed_block_gz(bb), backed_block_file_offset(bb));
+        break;
     }
 
+    stats_leave(phase);
     return ret;
 }
 
+/* Writes a don't care chunk over a gap between backed blocks */
+static void sparse_file_write_skip(struct output_file *out, int64_t len)
+{
+    int phase = stats_enter(SPARSE_STATS_PHASE_PAD);
+
+    stats_add(chunks_written[SPARSE_STATS_CHUNK_DONT_CARE], 1);
+    write_skip_chunk(out, len);
+    stats_leave(phase);
+}
+
 static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 {
     struct backed_block *bb;
@@ -131,7 +178,7 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
     for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
         if (backed_block_block(bb) > last_block) {
             unsigned int blocks = backed_block_block(bb) - last_block;
-            write_skip_chunk(out, (int64_t) blocks * s->block_size);
+            sparse_file_write_skip(out, (int64_t) blocks * s->block_size);
         }
         ret = sparse_file_write_block(out, bb);
         if (ret)
@@ -140,9 +187,203 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
     }
 
     pad = s->len - (int64_t) last_block *s->block_size;
-    assert(pad >= 0);
+    if (pad < 0) {
+        error("blocks extend %" PRId64 " bytes past the end of the file", -pad);
+        return -EINVAL;
+    }
     if (pad > 0) {
-        write_skip_chunk(out, pad);
+        sparse_file_write_skip(out, pad);
+    }
+
+    return 0;
+}
+
+struct write_task {
+    struct backed_block *bb;
+    unsigned int offset;
+    unsigned int len;
+};
+
+struct parallel_write {
+    struct sparse_file *s;
+    int fd;
+    int64_t base;
+    /* Size of fd before writing if it is a regular file, or -1 */
+    int64_t size;
+    struct write_task *tasks;
+    char **bufs;
+};
+
+int backed_block_read(struct backed_block *bb, void *buf, unsigned int offset,
+                      unsigned int len)
+{
+    uint32_t fill_val;
+    unsigned char *ptr = buf;
+    unsigned char pattern[sizeof(uint32_t)];
+    unsigned int i;
+    int file_fd;
+    int ret;
+
+    switch (backed_block_type(bb)) {
+    case BACKED_BLOCK_DATA:
+        memcpy(buf, (char *)backed_block_data(bb) + offset, len);
+        return 0;
+    case BACKED_BLOCK_FILE:
+        file_fd = open(backed_block_filename(bb), O_RDONLY | O_BINARY);
+        if (file_fd < 0) {
+            return -errno;
+        }
+        ret = pread_all(file_fd, buf, len, backed_block_file_offset(bb) + offset);
+        close(file_fd);
+        return ret;
+    case BACKED_BLOCK_FD:
+        return pread_all(backed_block_fd(bb), buf, len, backed_block_file_offset(bb) + offset);
+    case BACKED_BLOCK_FILL:
+        /* Rotate the fill value so the pattern lines up with offset */
+        fill_val = backed_block_fill_val(bb);
+        for (i = 0; i < sizeof(pattern); i++) {
+            pattern[i] = ((unsigned char *)&fill_val)[(offset + i) % sizeof(pattern)];
+        }
+        for (i = 0; i + sizeof(pattern) <= len; i += sizeof(pattern)) {
+            memcpy(ptr + i, pattern, sizeof(pattern));
+        }
+        memcpy(ptr + i, pattern, len - i);
+        return 0;
+    case BACKED_BLOCK_GZ:
+        return sparse_gz_read(backed_block_gz(bb), buf, backed_block_file_offset(bb) + offset,
+                              len);
+    default:
+        return -EINVAL;
+    }
+}
+
+static int do_parallel_write_task(struct parallel_write *pw, unsigned int worker,
+                                  struct write_task *task)
+{
+    struct backed_block *bb = task->bb;
+    int64_t out_offset;
+    int ret;
+
+    out_offset = pw->base + (int64_t) backed_block_block(bb) * pw->s->block_size + task->offset;
+
+    if (backed_block_type(bb) == BACKED_BLOCK_DATA) {
+        return pwrite_all(pw->fd, (char *)backed_block_data(bb) + task->offset,
+                          task->len, out_offset);
+    }
+
+    if (backed_block_type(bb) == BACKED_BLOCK_FILL && backed_block_fill_val(bb) == 0 &&
+        zero_fd_range(pw->fd, out_offset, task->len, pw->size) == 0) {
+        return 0;
+    }
+
+    if (!pw->bufs[worker]) {
+        pw->bufs[worker] = malloc(PARALLEL_TASK_SIZE);
+        if (!pw->bufs[worker]) {
+            return -ENOMEM;
+        }
+    }
+
+    ret = backed_block_read(bb, pw->bufs[worker], task->offset, task->len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return pwrite_all(pw->fd, pw->bufs[worker], task->len, out_offset);
+}
+
+static int parallel_write_task(void *priv, unsigned int worker, unsigned int idx)
+{
+    struct parallel_write *pw = priv;
+    struct write_task *task = &pw->tasks[idx];
+    bool fill = backed_block_type(task->bb) == BACKED_BLOCK_FILL;
+    int phase = stats_enter(fill ? SPARSE_STATS_PHASE_PAD : SPARSE_STATS_PHASE_IO);
+    int ret;
+
+    ret = do_parallel_write_task(pw, worker, task);
+    stats_leave(phase);
+
+    return ret;
+}
+
+/*
+ * Expands every backed block straight to its final offset in fd, splitting
+ * the work into PARALLEL_TASK_SIZE pieces spread over s->threads workers.
+ * Produces the same file as write_all_blocks through a normal output file:
+ * gaps are left untouched and the file is truncated to s->len at the end.
+ */
+static int write_all_blocks_parallel(struct sparse_file *s, int fd)
+{
+    struct parallel_write pw;
+    struct stat st;
+    struct backed_block *bb;
+    unsigned int count = 0;
+    unsigned int offset;
+    unsigned int len;
+    unsigned int i;
+    int ret;
+
+    pw.base = lseek(fd, 0, SEEK_CUR);
+    stats_add(seek_calls, 1);
+    if (pw.base < 0) {
+        return -errno;
+    }
+
+    stats_add(other_calls, 1);
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+    pw.size = S_ISREG(st.st_mode) ? st.st_size : -1;
+
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        count += DIV_ROUND_UP(backed_block_len(bb), PARALLEL_TASK_SIZE);
+        stats_add(chunks_written[backed_block_type(bb) == BACKED_BLOCK_FILL ?
+                                 SPARSE_STATS_CHUNK_FILL : SPARSE_STATS_CHUNK_RAW], 1);
+    }
+
+    pw.s = s;
+    pw.fd = fd;
+    pw.tasks = calloc(count ? count : 1, sizeof(struct write_task));
+    pw.bufs = calloc(s->threads, sizeof(char *));
+    if (!pw.tasks || !pw.bufs) {
+        free(pw.tasks);
+        free(pw.bufs);
+        return -ENOMEM;
+    }
+
+    i = 0;
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        for (offset = 0; offset < backed_block_len(bb); offset += len) {
+            len = backed_block_len(bb) - offset;
+            if (len > PARALLEL_TASK_SIZE) {
+                len = PARALLEL_TASK_SIZE;
+            }
+            pw.tasks[i].bb = bb;
+            pw.tasks[i].offset = offset;
+            pw.tasks[i].len = len;
+            i++;
+        }
+    }
+
+    ret = sparse_parallel_for(s->threads, count, parallel_write_task, &pw);
+
+    for (i = 0; i < s->threads; i++) {
+        free(pw.bufs[i]);
+    }
+    free(pw.bufs);
+    free(pw.tasks);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Match the serial writer, which pads with ftruncate and leaves the
+     * file offset at the end of the expanded image.  Like there, a failed
+     * ftruncate (e.g. on a block device) is not an error. */
+    ret = ftruncate(fd, s->len);
+    stats_add(other_calls, 1);
+    stats_add(seek_calls, 1);
+    if (lseek(fd, pw.base + s->len, SEEK_SET) < 0) {
+        return -errno;
     }
 
     return 0;
@@ -151,22 +392,84 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse, bool crc)
 {
     int ret;
+    int close_ret;
     int chunks;
     struct output_file *out;
 
+    if (!gz && !sparse && !crc && s->threads > 1) {
+        ret = write_all_blocks_parallel(s, fd);
+        /* Pipes can't be written at an offset, fall back to streaming */
+        if (ret != -ESPIPE) {
+            return ret;
+        }
+    }
+
     chunks = sparse_count_chunks(s);
-    out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc);
+    out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc, s->threads,
+                              s->gz_restart, s->queue_depth);
 
     if (!out)
         return -ENOMEM;
 
     ret = write_all_blocks(s, out);
 
-    output_file_close(out);
+    /* Queued writes can still fail after the last chunk */
+    close_ret = output_file_close(out);
+    if (ret == 0) {
+        ret = close_ret;
+    }
 
     return ret;
 }
 
+int64_t sparse_file_pread(struct sparse_file *s, void *buf, size_t len, int64_t offset)
+{
+    struct backed_block *bb;
+    char *ptr = buf;
+    int64_t end;
+    int64_t pos;
+    int64_t bb_start;
+    int64_t bb_end;
+    int64_t chunk;
+    int ret;
+
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    if (offset >= s->len) {
+        return 0;
+    }
+    end = offset + (int64_t) min(len, (size_t) (s->len - offset));
+
+    for (pos = offset; pos < end; pos += chunk) {
+        bb = backed_block_lookup(s->backed_block_list, pos / s->block_size);
+        bb_start = bb ? (int64_t) backed_block_block(bb) * s->block_size : end;
+        if (bb_start > pos) {
+            /* Not backed by anything, reads as zeros like a written image */
+            chunk = min(bb_start, end) - pos;
+            memset(ptr + (pos - offset), 0, chunk);
+            continue;
+        }
+
+        bb_end = bb_start + backed_block_len(bb);
+        if (bb_end <= pos) {
+            /* Padding after data that does not fill its last block */
+            chunk = min((int64_t) ALIGN(bb_end, s->block_size), end) - pos;
+            memset(ptr + (pos - offset), 0, chunk);
+            continue;
+        }
+
+        chunk = min(bb_end, end) - pos;
+        ret = backed_block_read(bb, ptr + (pos - offset), pos - bb_start, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return end - offset;
+}
+
 int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
                          int (*write) (void *priv, const void *data, int len), void *priv)
 {
@@ -238,32 +541,46 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
     return ret;
 }
 
-static int out_counter_write(void *priv, const void *data __unused, int len)
+/* Number of bytes bb takes up when written out by sparse_file_write_block */
+static int64_t backed_block_encoded_len(struct backed_block *bb, unsigned int block_size,
+                                        bool sparse)
 {
-    int64_t *count = priv;
-    *count += len;
-    return 0;
+    int64_t len = backed_block_len(bb);
+
+    if (backed_block_type(bb) == BACKED_BLOCK_FILL) {
+        return sparse ? sizeof(chunk_header_t) + sizeof(uint32_t) : len;
+    }
+
+    return (sparse ? sizeof(chunk_header_t) : 0) + ALIGN(len, block_size);
 }
 
+/*
+ * Works out the size of the output from the backed block list alone, the
+ * same way write_all_blocks lays it out, without reading any data.
+ */
 int64_t sparse_file_len(struct sparse_file * s, bool sparse, bool crc)
 {
-    int ret;
-    int chunks = sparse_count_chunks(s);
-    int64_t count = 0;
-    struct output_file *out;
+    struct backed_block *bb;
+    unsigned int last_block = 0;
+    int64_t count = sparse ? sizeof(sparse_header_t) : 0;
+    int64_t pad;
 
-    out = output_file_open_callback(out_counter_write, &count,
-                                    s->block_size, s->len, false, sparse, chunks, crc);
-    if (!out) {
-        return -1;
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_block(bb) > last_block) {
+            count += sparse ? sizeof(chunk_header_t) :
+                (int64_t) (backed_block_block(bb) - last_block) * s->block_size;
+        }
+        count += backed_block_encoded_len(bb, s->block_size, sparse);
+        last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), s->block_size);
     }
 
-    ret = write_all_blocks(s, out);
-
-    output_file_close(out);
+    pad = s->len - (int64_t) last_block * s->block_size;
+    if (pad > 0) {
+        count += sparse ? (int64_t) sizeof(chunk_header_t) : pad;
+    }
 
-    if (ret < 0) {
-        return -1;
+    if (sparse && crc) {
+        count += sizeof(chunk_header_t) + sizeof(uint32_t);
     }
 
     return count;
@@ -278,13 +595,11 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
                                                   struct sparse_file *to, unsigned int len)
 {
     int64_t count = 0;
-    struct output_file *out_counter;
     struct backed_block *last_bb = NULL;
     struct backed_block *bb;
     struct backed_block *start;
     unsigned int last_block = 0;
     int64_t file_len = 0;
-    int ret;
 
     /*
      * overhead is sparse file header, the potential end skip
@@ -294,11 +609,6 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
     len -= overhead;
 
     start = backed_block_iter_new(from->backed_block_list);
-    out_counter = output_file_open_callback(out_counter_write, &count,
-                                            to->block_size, to->len, false, true, 0, false);
-    if (!out_counter) {
-        return NULL;
-    }
 
     for (bb = start; bb; bb = backed_block_iter_next(bb)) {
         count = 0;
@@ -306,12 +616,7 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
             count += sizeof(chunk_header_t);
         last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), to->block_size);
 
-        /* will call out_counter_write to update count */
-        ret = sparse_file_write_block(out_counter, bb);
-        if (ret) {
-            bb = NULL;
-            goto out;
-        }
+        count += backed_block_encoded_len(bb, to->block_size, true);
         if (file_len + count > len) {
             /*
              * If the remaining available size is more than 1/8th of the
@@ -332,9 +637,6 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
  move:
     backed_block_list_move(from->backed_block_list, to->backed_block_list, start, last_bb);
 
- out:
-    output_file_close(out_counter);
-
     return bb;
 }
 
@@ -345,12 +647,15 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
     struct sparse_file *s;
     struct sparse_file *tmp;
     int c = 0;
+    int phase;
 
     tmp = sparse_file_new(in_s->block_size, in_s->len);
     if (!tmp) {
         return -ENOMEM;
     }
 
+    phase = stats_enter(SPARSE_STATS_PHASE_SPLIT);
+
     do {
         s = sparse_file_new(in_s->block_size, in_s->len);
 
@@ -368,11 +673,275 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
     backed_block_list_move(tmp->backed_block_list, in_s->backed_block_list, NULL, NULL);
 
     sparse_file_destroy(tmp);
+    stats_leave(phase);
 
     return c;
 }
 
+int sparse_file_resparse_alloc(struct sparse_file *in_s, unsigned int max_len,
+                               struct sparse_file ***out_s)
+{
+    struct backed_block *bb;
+    struct sparse_file **files = NULL;
+    struct sparse_file **tmp;
+    int count = 0;
+    int cap = 0;
+    int phase = stats_enter(SPARSE_STATS_PHASE_SPLIT);
+    int i;
+
+    do {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 8;
+            tmp = realloc(files, cap * sizeof(*files));
+            if (!tmp) {
+                goto err;
+            }
+            files = tmp;
+        }
+
+        files[count] = sparse_file_new(in_s->block_size, in_s->len);
+        if (!files[count]) {
+            goto err;
+        }
+
+        bb = move_chunks_up_to_len(in_s, files[count], max_len);
+        count++;
+    } while (bb);
+
+    *out_s = files;
+    stats_leave(phase);
+    return count;
+
+ err:
+    /* Give the blocks already moved back to in_s */
+    for (i = 0; i < count; i++) {
+        backed_block_list_move(files[i]->backed_block_list, in_s->backed_block_list, NULL,
+                               NULL);
+        sparse_file_destroy(files[i]);
+    }
+    free(files);
+    stats_leave(phase);
+    return -ENOMEM;
+}
+
+struct split_write {
+    struct sparse_file **files;
+    const int *fds;
+    bool gz;
+    bool sparse;
+    bool crc;
+};
+
+static int split_write_task(void *priv, unsigned int worker __unused, unsigned int idx)
+{
+    struct split_write *sw = priv;
+
+    return sparse_file_write(sw->files[idx], sw->fds[idx], sw->gz, sw->sparse, sw->crc);
+}
+
+int sparse_file_write_split(struct sparse_file **files, const int *fds, int count,
+                            bool gz, bool sparse, bool crc, unsigned int threads)
+{
+    struct split_write sw = {
+        .files = files,
+        .fds = fds,
+        .gz = gz,
+        .sparse = sparse,
+        .crc = crc,
+    };
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    return sparse_parallel_for(threads, count, split_write_task, &sw);
+}
+
+/* Where chunks can be appended to the sparse image in fd, and its crc */
+struct append_point {
+    sparse_header_t header;
+    int64_t end;
+    bool crc;
+    uint32_t crc32;
+};
+
+/*
+ * Walks the chunk headers of the sparse image in fd, checking they add up to
+ * the header, to find the end of the last chunk.  If the image ends with a
+ * crc chunk its value is the crc of the whole image, and new chunks can carry
+ * it on.  Anything after the last chunk, such as the remains of an
+ * interrupted append, is ignored.
+ */
+static int read_append_point(int fd, unsigned int block_size, struct append_point *ap)
+{
+    sparse_header_t *header = &ap->header;
+    chunk_header_t chunk_header;
+    int64_t file_len;
+    int64_t total_sz;
+    uint64_t blocks = 0;
+    unsigned int i;
+    int ret;
+
+    file_len = lseek(fd, 0, SEEK_END);
+    if (file_len < 0) {
+        return -errno;
+    }
+
+    ret = pread_all(fd, header, sizeof(*header), 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* New chunks are written with the standard header sizes */
+    if (header->magic != SPARSE_HEADER_MAGIC ||
+        header->major_version != SPARSE_HEADER_MAJOR_VER ||
+        header->file_hdr_sz < sizeof(sparse_header_t) ||
+        header->chunk_hdr_sz != sizeof(chunk_header_t) || header->blk_sz != block_size) {
+        return -EINVAL;
+    }
+
+    ap->end = header->file_hdr_sz;
+    ap->crc = false;
+    for (i = 0; i < header->total_chunks; i++) {
+        if (ap->end + (int64_t) sizeof(chunk_header) > file_len) {
+            return -EINVAL;
+        }
+        ret = pread_all(fd, &chunk_header, sizeof(chunk_header), ap->end);
+        if (ret < 0) {
+            return ret;
+        }
+
+        switch (chunk_header.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            total_sz = sizeof(chunk_header) + (int64_t) chunk_header.chunk_sz * block_size;
+            break;
+        case CHUNK_TYPE_FILL:
+        case CHUNK_TYPE_CRC32:
+            total_sz = sizeof(chunk_header) + sizeof(uint32_t);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            total_sz = sizeof(chunk_header);
+            break;
+        default:
+            return -EINVAL;
+        }
+        if (chunk_header.total_sz != total_sz || ap->end + total_sz > file_len) {
+            return -EINVAL;
+        }
+
+        ap->crc = chunk_header.chunk_type == CHUNK_TYPE_CRC32;
+        if (ap->crc) {
+            ret = pread_all(fd, &ap->crc32, sizeof(ap->crc32), ap->end + sizeof(chunk_header));
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        blocks += chunk_header.chunk_sz;
+        ap->end += total_sz;
+    }
+
+    if (blocks != header->total_blks) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int sparse_file_append(struct sparse_file *s, int fd)
+{
+    struct append_point ap;
+    struct output_file *out;
+    sparse_header_t *header = &ap.header;
+    int64_t end;
+    unsigned int chunks;
+    int ret;
+
+    if (s->len % s->block_size) {
+        return -EINVAL;
+    }
+
+    ret = read_append_point(fd, s->block_size, &ap);
+    if (ret < 0) {
+        return ret;
+    }
+
+    chunks = sparse_count_chunks(s) + (ap.crc ? 1 : 0);
+    if ((uint64_t) header->total_blks + s->len / s->block_size > UINT32_MAX ||
+        (uint64_t) header->total_chunks + chunks > UINT32_MAX) {
+        return -E2BIG;
+    }
+
+    if (lseek(fd, ap.end, SEEK_SET) < 0) {
+        return -errno;
+    }
+
+    out = output_file_open_append(fd, s->block_size, s->len, ap.crc, ap.crc32);
+    if (!out) {
+        return -ENOMEM;
+    }
+
+    ret = write_all_blocks(s, out);
+
+    output_file_close(out);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The output file doesn't report a failed crc chunk, so check everything
+     * made it out */
+    end = ap.end + sparse_file_len(s, true, ap.crc) - sizeof(sparse_header_t);
+    if (lseek(fd, 0, SEEK_CUR) != end) {
+        return -EIO;
+    }
+
+    /* Drop anything left over from an earlier interrupted append.  Not being
+     * able to (e.g. on a block device) is not an error. */
+    ret = ftruncate(fd, end);
+
+    /* Until the header is updated the image still reads as it was, so the
+     * new chunks must be on disk before the header points at them.  The
+     * header fits in one sector and is rewritten last. */
+    if (fsync(fd) < 0) {
+        return -errno;
+    }
+
+    header->total_blks += s->len / s->block_size;
+    header->total_chunks += chunks;
+    ret = pwrite_all(fd, header, sizeof(*header), 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fsync(fd) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
 void sparse_file_verbose(struct sparse_file *s)
 {
     s->verbose = true;
 }
+
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads)
+{
+    s->threads = min(threads, SPARSE_PARALLEL_MAX_THREADS);
+}
+
+void sparse_file_set_skip_zero(struct sparse_file *s, bool skip)
+{
+    s->skip_zero = skip;
+}
+
+void sparse_file_set_queue_depth(struct sparse_file *s, unsigned int depth)
+{
+    s->queue_depth = depth;
+}
+
+void sparse_file_set_gz_restart(struct sparse_file *s, unsigned int interval)
+{
+    s->gz_restart = interval;
+}
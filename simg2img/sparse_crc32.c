@@ -43,7 +43,17 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "sparse_crc32.h"
+#include "sparse_stats.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32_X86 1
+#include <immintrin.h>
+#endif
 
 static uint32_t crc32_tab[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -91,20 +101,243 @@ static uint32_t crc32_tab[] = {
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
+#define CRC32_POLY 0xedb88320
+
+/* Slice-by-8 tables, crc32_slice[0] is crc32_tab */
+static uint32_t crc32_slice[8][256];
+
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t * p, size_t size)
+{
+    while (size--)
+        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t * p, size_t size)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t one, two;
+
+    while (size >= 8) {
+        memcpy(&one, p, sizeof(one));
+        memcpy(&two, p + 4, sizeof(two));
+        one ^= crc;
+        crc = crc32_slice[7][one & 0xFF] ^ crc32_slice[6][(one >> 8) & 0xFF] ^
+            crc32_slice[5][(one >> 16) & 0xFF] ^ crc32_slice[4][one >> 24] ^
+            crc32_slice[3][two & 0xFF] ^ crc32_slice[2][(two >> 8) & 0xFF] ^
+            crc32_slice[1][(two >> 16) & 0xFF] ^ crc32_slice[0][two >> 24];
+        p += 8;
+        size -= 8;
+    }
+#endif
+    return crc32_bytes(crc, p, size);
+}
+
+#ifdef CRC32_X86
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * Folds 64 bytes at a time with carry-less multiplies, then Barrett reduces
+ * to 32 bits.  Constants are the bit-reflected ones from "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).  size
+ * must be at least 64 and a multiple of 16.
  */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t * p, size_t size)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    p += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        size -= 64;
+    }
+
+    /* Fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (size >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        size -= 16;
+    }
+
+    /* Fold 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduce to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t * p, size_t size)
+{
+    size_t fold;
+
+    if (size >= 64) {
+        fold = size & ~(size_t) 15;
+        crc = crc32_fold_pclmul(crc, p, fold);
+        p += fold;
+        size -= fold;
+    }
+
+    return crc32_slice8(crc, p, size);
+}
+#endif
+
+static uint32_t (*crc32_impl) (uint32_t, const uint8_t *, size_t) = crc32_slice8;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    unsigned int i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc32_slice[0][i] = crc32_tab[i];
+    }
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            crc32_slice[k][i] = (crc32_slice[k - 1][i] >> 8) ^
+                crc32_tab[crc32_slice[k - 1][i] & 0xFF];
+        }
+    }
+
+#ifdef CRC32_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc32_impl = crc32_pclmul;
+    }
+#endif
+}
 
-uint32_t sparse_crc32(uint32_t crc_in, const void *buf, int size)
+uint32_t sparse_crc32(uint32_t crc_in, const void *buf, size_t size)
 {
-    const uint8_t *p = buf;
+    int phase = stats_enter(SPARSE_STATS_PHASE_CRC);
     uint32_t crc;
 
-    crc = crc_in ^ ~0U;
-    while (size--)
-        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-    return crc ^ ~0U;
+    pthread_once(&crc32_once, crc32_init);
+
+    crc = crc32_impl(crc_in ^ ~0U, buf, size) ^ ~0U;
+    stats_leave(phase);
+
+    return crc;
+}
+
+/*
+ * Multiplies a and b modulo the CRC polynomial.  Polynomials are stored
+ * reflected, with x^0 in the top bit.
+ */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+
+    while (m) {
+        if (a & m) {
+            p ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/* x^(8 * len) modulo the CRC polynomial, by repeated squaring */
+static uint32_t crc32_x8nmodp(uint64_t len)
+{
+    uint32_t p = 1U << 31;      /* x^0 */
+    uint32_t sq = 1U << 23;     /* x^8 */
+
+    while (len) {
+        if (len & 1) {
+            p = crc32_multmodp(sq, p);
+        }
+        sq = crc32_multmodp(sq, sq);
+        len >>= 1;
+    }
+
+    return p;
+}
+
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return crc32_multmodp(crc32_x8nmodp(len2), crc1) ^ crc2;
+}
+
+uint32_t sparse_crc32_fill(uint32_t crc, uint32_t fill_val, uint64_t len)
+{
+    uint64_t count = len / sizeof(fill_val);
+    uint64_t unit_len = sizeof(fill_val);
+    uint32_t unit = sparse_crc32(0, &fill_val, sizeof(fill_val));
+    uint32_t run = 0;
+    int phase = stats_enter(SPARSE_STATS_PHASE_CRC);
+
+    /* Build the crc of count copies by doubling, like fast exponentiation */
+    while (count) {
+        if (count & 1) {
+            run = sparse_crc32_combine(run, unit, unit_len);
+        }
+        unit = sparse_crc32_combine(unit, unit, unit_len);
+        unit_len *= 2;
+        count >>= 1;
+    }
+
+    crc = sparse_crc32_combine(crc, run, len - len % sizeof(fill_val));
+    crc = sparse_crc32(crc, &fill_val, len % sizeof(fill_val));
+    stats_leave(phase);
+
+    return crc;
 }
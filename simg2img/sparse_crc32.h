@@ -17,6 +17,7 @@
 #ifndef _LIBSPARSE_SPARSE_CRC32_H_
 #define _LIBSPARSE_SPARSE_CRC32_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -25,6 +26,12 @@ extern "C" {
 
     uint32_t sparse_crc32(uint32_t crc, const void *buf, size_t size);
 
+    /* Returns the crc of A followed by B, given crc1 of A, crc2 of B and B's length */
+    uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+    /* Extends crc over len bytes of fill_val repeated, in O(log len) time */
+    uint32_t sparse_crc32_fill(uint32_t crc, uint32_t fill_val, uint64_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,8 @@
 #include <errno.h>
 #include <stdio.h>
 
+#include "sparse_err.h"
+
 #define __le64 u64
 #define __le32 u32
 #define __le16 u16
@@ -43,7 +45,7 @@ typedef unsigned char u8;
 #define ALIGN(x, y) ((y) * DIV_ROUND_UP((x), (y)))
 #define ALIGN_DOWN(x, y) ((y) * ((x) / (y)))
 
-#define error(fmt, args...) do { fprintf(stderr, "error: %s: " fmt "\n", __func__, ## args); } while (0)
+#define error(fmt, args...) sparse_log_error("error: %s: " fmt "\n", __func__, ## args)
 #define error_errno(s, args...) error(s ": %s", ##args, strerror(errno))
 
 #endif
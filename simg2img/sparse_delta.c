@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+
+/*
+ * Blocks of new_s over a don't care gap of old_s, whose contents on the
+ * device are unknown, are always changed.  Fills over fills are decided from
+ * their values alone.  Everything else is queued to be read and compared.
+ * Don't care blocks of new_s are never changed.
+ */
+static int delta_run(void *priv, struct backed_block *new_bb, struct backed_block *old_bb,
+                     unsigned int block, unsigned int count)
+{
+    struct backed_block_compare *c = priv;
+
+    if (!new_bb) {
+        return 0;
+    }
+    if (!old_bb) {
+        memset(c->changed + block, 1, count);
+        return 0;
+    }
+    if (backed_block_type(new_bb) == BACKED_BLOCK_FILL &&
+        backed_block_type(old_bb) == BACKED_BLOCK_FILL) {
+        if (backed_block_fill_val(new_bb) != backed_block_fill_val(old_bb)) {
+            memset(c->changed + block, 1, count);
+        }
+        return 0;
+    }
+
+    return backed_block_compare_add(c, new_bb, old_bb, block, count);
+}
+
+/* Adds each run of changed blocks of new_s to s and returns how many blocks that is */
+static int64_t delta_build(struct sparse_file *new_s, const uint8_t *changed,
+                           struct sparse_file *s)
+{
+    unsigned int block_size = new_s->block_size;
+    struct backed_block *bb;
+    unsigned int pos;
+    unsigned int end;
+    unsigned int run;
+    int64_t total = 0;
+    int ret;
+
+    for (bb = backed_block_iter_new(new_s->backed_block_list); bb;
+         bb = backed_block_iter_next(bb)) {
+        end = backed_block_end(bb, block_size);
+        for (pos = backed_block_block(bb); pos < end; pos = run) {
+            run = pos + 1;
+            while (run < end && changed[run] == changed[pos]) {
+                run++;
+            }
+            if (changed[pos]) {
+                ret = backed_block_add_blocks(s->backed_block_list, bb, pos, run - pos);
+                if (ret < 0) {
+                    return ret;
+                }
+                total += run - pos;
+            }
+        }
+    }
+
+    return total;
+}
+
+int64_t sparse_file_delta(struct sparse_file *old_s, struct sparse_file *new_s,
+                          struct sparse_file **delta_s)
+{
+    struct backed_block_compare c;
+    struct sparse_file *s = NULL;
+    unsigned int blocks = DIV_ROUND_UP(new_s->len, new_s->block_size);
+    int64_t ret;
+
+    *delta_s = NULL;
+    if (old_s->block_size != new_s->block_size) {
+        error("block sizes differ: %u and %u", old_s->block_size, new_s->block_size);
+        return -EINVAL;
+    }
+
+    ret = backed_block_compare_init(&c, new_s->block_size, blocks, new_s->threads);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = backed_block_walk_pair(new_s->backed_block_list, old_s->backed_block_list, blocks,
+                                 delta_run, &c);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = backed_block_compare_run(&c);
+    if (ret < 0) {
+        goto out;
+    }
+
+    s = sparse_file_new(new_s->block_size, new_s->len);
+    if (!s) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = delta_build(new_s, c.changed, s);
+    if (ret < 0) {
+        sparse_file_destroy(s);
+        goto out;
+    }
+    *delta_s = s;
+
+ out:
+    backed_block_compare_free(&c);
+
+    return ret;
+}
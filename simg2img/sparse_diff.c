@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+#define max(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a > _b) ? _a : _b; })
+
+/*
+ * Don't care blocks read as zeros, the way they are written out when an image
+ * is expanded, so runs that are don't care or fill in both files are decided
+ * from the fill values alone.  Runs with data in either file are queued to be
+ * read and compared.
+ */
+static int diff_run(void *priv, struct backed_block *a_bb, struct backed_block *b_bb,
+                    unsigned int block, unsigned int count)
+{
+    struct backed_block_compare *c = priv;
+    uint32_t a_val, b_val;
+
+    if ((!a_bb || backed_block_type(a_bb) == BACKED_BLOCK_FILL) &&
+        (!b_bb || backed_block_type(b_bb) == BACKED_BLOCK_FILL)) {
+        a_val = a_bb ? backed_block_fill_val(a_bb) : 0;
+        b_val = b_bb ? backed_block_fill_val(b_bb) : 0;
+        if (a_val != b_val) {
+            memset(c->changed + block, 1, count);
+        }
+        return 0;
+    }
+
+    return backed_block_compare_add(c, a_bb, b_bb, block, count);
+}
+
+int64_t sparse_file_diff(struct sparse_file *a, struct sparse_file *b,
+                         int (*range) (void *priv, unsigned int block, unsigned int count),
+                         void *priv)
+{
+    struct backed_block_compare c;
+    unsigned int a_blocks, b_blocks;
+    unsigned int common;
+    unsigned int blocks;
+    unsigned int pos;
+    unsigned int run;
+    int64_t changed = 0;
+    int64_t ret;
+
+    if (a->block_size != b->block_size) {
+        error("block sizes differ: %u and %u", a->block_size, b->block_size);
+        return -EINVAL;
+    }
+
+    a_blocks = DIV_ROUND_UP(a->len, a->block_size);
+    b_blocks = DIV_ROUND_UP(b->len, b->block_size);
+    common = min(a_blocks, b_blocks);
+    blocks = max(a_blocks, b_blocks);
+    ret = backed_block_compare_init(&c, a->block_size, blocks, a->threads);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = backed_block_walk_pair(a->backed_block_list, b->backed_block_list, common,
+                                 diff_run, &c);
+    if (ret < 0) {
+        goto out;
+    }
+    /* Blocks only one of the files has always differ */
+    memset(c.changed + common, 1, blocks - common);
+
+    ret = backed_block_compare_run(&c);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (pos = 0; pos < blocks; pos = run) {
+        run = pos + 1;
+        while (run < blocks && c.changed[run] == c.changed[pos]) {
+            run++;
+        }
+        if (!c.changed[pos]) {
+            continue;
+        }
+        if (range) {
+            ret = range(priv, pos, run - pos);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        changed += run - pos;
+    }
+    ret = changed;
+
+ out:
+    backed_block_compare_free(&c);
+
+    return ret;
+}
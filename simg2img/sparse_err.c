@@ -18,8 +18,16 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include "sparse_err.h"
+
+/* Messages that fit are formatted on the stack */
+#define LOG_BUF_SIZE 256
+
+static __thread struct sparse_log thread_log;
+
 void sparse_default_print(const char *fmt, ...)
 {
     va_list argp;
@@ -31,3 +39,71 @@ void sparse_default_print(const char *fmt, ...)
 
 void (*sparse_print_error) (const char *fmt, ...) = sparse_default_print;
 void (*sparse_print_verbose) (const char *fmt, ...) = sparse_default_print;
+
+void sparse_set_log(void (*log) (void *priv, const char *msg), void *priv)
+{
+    thread_log.fn = log;
+    thread_log.priv = priv;
+}
+
+void sparse_log_get(struct sparse_log *log)
+{
+    *log = thread_log;
+}
+
+void sparse_log_set(const struct sparse_log *log)
+{
+    thread_log = *log;
+}
+
+/* Formats a message and passes it to the thread's log, or print */
+static void log_message(void (*print) (const char *fmt, ...), const char *fmt, va_list argp)
+{
+    char buf[LOG_BUF_SIZE];
+    char *msg = buf;
+    va_list copy;
+    int size;
+
+    va_copy(copy, argp);
+    size = vsnprintf(buf, sizeof(buf), fmt, copy);
+    va_end(copy);
+    if (size < 0) {
+        return;
+    }
+
+    if (size >= (int)sizeof(buf)) {
+        msg = malloc(size + 1);
+        if (!msg) {
+            return;
+        }
+        vsnprintf(msg, size + 1, fmt, argp);
+    }
+
+    if (thread_log.fn) {
+        thread_log.fn(thread_log.priv, msg);
+    } else {
+        print("%s", msg);
+    }
+
+    if (msg != buf) {
+        free(msg);
+    }
+}
+
+void sparse_log_error(const char *fmt, ...)
+{
+    va_list argp;
+
+    va_start(argp, fmt);
+    log_message(sparse_default_print, fmt, argp);
+    va_end(argp);
+}
+
+void sparse_log_verbose(const char *fmt, ...)
+{
+    va_list argp;
+
+    va_start(argp, fmt);
+    log_message(sparse_print_verbose, fmt, argp);
+    va_end(argp);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_ERR_H_
+#define _LIBSPARSE_SPARSE_ERR_H_
+
+/* Where the messages of libsparse calls on one thread go, see sparse_set_log */
+struct sparse_log {
+    void (*fn) (void *priv, const char *msg);
+    void *priv;
+};
+
+void sparse_log_error(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
+void sparse_log_verbose(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
+
+/* Used to hand the caller's log on to worker threads */
+void sparse_log_get(struct sparse_log *log);
+void sparse_log_set(const struct sparse_log *log);
+
+#endif
@@ -19,13 +19,30 @@
 
 #include <sparse/sparse.h>
 
+struct backed_block;
+
 struct sparse_file {
     unsigned int block_size;
     int64_t len;
     bool verbose;
+    unsigned int threads;
+    bool skip_zero;
+    unsigned int gz_restart;
+    /* Writes kept in flight on an io_uring, 0 to write synchronously */
+    unsigned int queue_depth;
+    /* Compressed file the blocks of an imported gz file are read from */
+    struct sparse_gz *gz;
 
     struct backed_block_list *backed_block_list;
     struct output_file *out;
 };
 
+/*
+ * Copies len bytes of the expanded contents of bb, starting offset bytes
+ * into it, to buf.  Data is read from the backing file or fd with pread, so
+ * the file position of a shared fd is left alone.
+ */
+int backed_block_read(struct backed_block *bb, void *buf, unsigned int offset,
+                      unsigned int len);
+
 #endif                          /* _LIBSPARSE_SPARSE_FILE_H_ */
@@ -52,4 +52,38 @@ typedef struct chunk_header {
  *  For a CRC32 chunk, it's 4 bytes of CRC32
  */
 
+/* An index sidecar (image.simg.idx) lists the chunks of a sparse image so it
+ * can be opened without reading every chunk header.  It describes one image,
+ * identified by its size, inode, mtime and ctime to the nanosecond and the
+ * crc32 of its sparse header.
+ */
+typedef struct sparse_index_header {
+    __le32 magic;               /* 0x58444953 "SIDX" */
+    __le16 major_version;       /* (0x2) - reject indexes with other major versions */
+    __le16 entry_sz;            /* 24 bytes for first revision of the index format */
+    __le32 blk_sz;              /* block size of the image */
+    __le32 total_blks;          /* total blocks in the non-sparse output image */
+    __le32 total_entries;       /* number of entries following the header */
+    __le32 header_crc;          /* crc32 of the image's sparse header */
+    __le64 image_size;          /* size of the image in bytes */
+    __le64 image_ino;           /* inode number of the image */
+    __le64 image_mtime;         /* modification time of the image in seconds */
+    __le64 image_ctime;         /* status change time of the image in seconds */
+    __le32 image_mtime_nsec;    /* nanoseconds of image_mtime */
+    __le32 image_ctime_nsec;    /* nanoseconds of image_ctime */
+    __le32 entries_crc;         /* crc32 of all the entries */
+    __le32 reserved;
+} sparse_index_header_t;
+
+#define SPARSE_INDEX_MAGIC	0x58444953
+
+typedef struct sparse_index_entry {
+    __le16 chunk_type;          /* CHUNK_TYPE_RAW or CHUNK_TYPE_FILL */
+    __le16 reserved1;
+    __le32 block;               /* first block in the output image */
+    __le32 len;                 /* length in bytes in the output image */
+    __le32 fill_val;            /* fill value for a fill entry */
+    __le64 offset;              /* offset of the data in the image for a raw entry */
+} sparse_index_entry_t;
+
 #endif
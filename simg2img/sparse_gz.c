@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "output_file.h"
+#include "sparse_err.h"
+#include "sparse_file.h"
+#include "sparse_gz.h"
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+/* gzip member header with only FEXTRA set, followed by XLEN */
+#define GZ_HEADER_LEN 12
+/* Subfield id and length inside the extra field */
+#define GZ_SUBFIELD_LEN 4
+/* An empty final fixed deflate block, then a zero crc and ISIZE */
+#define GZ_EMPTY_TAIL_LEN 10
+
+/* Amount of compressed data read at a time while inflating */
+#define GZ_READ_SIZE (64U * 1024U)
+
+struct sparse_gz {
+    int fd;
+    unsigned int count;
+    sparse_gz_point_t *points;
+    /* End of the compressed data, where the index members start */
+    int64_t end;
+    uint64_t isize;
+};
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+/* Writes one empty gzip member holding count points and a footer */
+static int write_index_member(int fd, const sparse_gz_point_t * points, unsigned int count,
+                              const sparse_gz_footer_t * footer)
+{
+    unsigned char header[GZ_HEADER_LEN + GZ_SUBFIELD_LEN] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3
+    };
+    static const unsigned char tail[GZ_EMPTY_TAIL_LEN] = { 3, 0 };
+    unsigned int payload = count * sizeof(*points) + sizeof(*footer);
+    int ret;
+
+    put_le16(header + 10, GZ_SUBFIELD_LEN + payload);
+    header[12] = SPARSE_GZ_INDEX_SI1;
+    header[13] = SPARSE_GZ_INDEX_SI2;
+    put_le16(header + 14, payload);
+
+    ret = write_all(fd, header, sizeof(header));
+    if (ret == 0) {
+        ret = write_all(fd, points, count * sizeof(*points));
+    }
+    if (ret == 0) {
+        ret = write_all(fd, footer, sizeof(*footer));
+    }
+    if (ret == 0) {
+        ret = write_all(fd, tail, sizeof(tail));
+    }
+
+    return ret;
+}
+
+int sparse_gz_write_index(int fd, const sparse_gz_point_t * points, unsigned int count,
+                          int64_t offset, uint64_t isize, unsigned int blk_sz, uint32_t flags)
+{
+    sparse_gz_footer_t footer = {
+        .magic = SPARSE_GZ_INDEX_MAGIC,
+        .blk_sz = blk_sz,
+        .flags = flags,
+        .first_member = offset,
+        .isize = isize,
+    };
+    unsigned int n;
+    int ret;
+
+    do {
+        n = min(count, (unsigned int)SPARSE_GZ_POINTS_PER_MEMBER);
+        footer.points = n;
+        ret = write_index_member(fd, points, n, &footer);
+        if (ret < 0) {
+            return ret;
+        }
+        points += n;
+        count -= n;
+    } while (count > 0);
+
+    return 0;
+}
+
+/* Reads the index members at the end of fd */
+static int read_index(struct sparse_gz *gz, sparse_gz_footer_t * footer)
+{
+    unsigned char header[GZ_HEADER_LEN + GZ_SUBFIELD_LEN];
+    sparse_gz_footer_t member_footer;
+    sparse_gz_point_t *points;
+    unsigned int payload;
+    unsigned int n;
+    int64_t offset;
+    int64_t end;
+    struct stat st;
+    int ret;
+
+    if (fstat(gz->fd, &st) < 0) {
+        return -errno;
+    }
+    end = st.st_size;
+
+    if (end < (int64_t) (sizeof(*footer) + GZ_EMPTY_TAIL_LEN)) {
+        return -EINVAL;
+    }
+
+    ret = pread_all(gz->fd, footer, sizeof(*footer), end - GZ_EMPTY_TAIL_LEN - sizeof(*footer));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (footer->magic != SPARSE_GZ_INDEX_MAGIC || footer->first_member >= (uint64_t) end) {
+        return -EINVAL;
+    }
+
+    gz->end = footer->first_member;
+    gz->isize = footer->isize;
+
+    for (offset = gz->end; offset < end;) {
+        ret = pread_all(gz->fd, header, sizeof(header), offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (header[0] != 0x1f || header[1] != 0x8b || header[3] != 4 ||
+            header[12] != SPARSE_GZ_INDEX_SI1 || header[13] != SPARSE_GZ_INDEX_SI2) {
+            return -EINVAL;
+        }
+
+        payload = get_le16(header + 14);
+        if (payload < sizeof(member_footer) ||
+            get_le16(header + 10) != GZ_SUBFIELD_LEN + payload) {
+            return -EINVAL;
+        }
+
+        ret = pread_all(gz->fd, &member_footer, sizeof(member_footer),
+                        offset + sizeof(header) + payload - sizeof(member_footer));
+        if (ret < 0) {
+            return ret;
+        }
+
+        n = member_footer.points;
+        if (member_footer.magic != SPARSE_GZ_INDEX_MAGIC ||
+            n * sizeof(*points) + sizeof(member_footer) != payload) {
+            return -EINVAL;
+        }
+
+        points = realloc(gz->points, (gz->count + n) * sizeof(*points));
+        if (!points) {
+            return -ENOMEM;
+        }
+        gz->points = points;
+
+        ret = pread_all(gz->fd, gz->points + gz->count, n * sizeof(*points),
+                        offset + sizeof(header));
+        if (ret < 0) {
+            return ret;
+        }
+        gz->count += n;
+
+        offset += sizeof(header) + payload + GZ_EMPTY_TAIL_LEN;
+    }
+
+    return 0;
+}
+
+/* Checks the points start at the beginning and only move forwards */
+static int check_points(struct sparse_gz *gz)
+{
+    unsigned int i;
+
+    if (gz->count == 0 || gz->points[0].in != 0) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < gz->count; i++) {
+        if (gz->points[i].in > gz->isize || (int64_t) gz->points[i].out >= gz->end) {
+            return -EINVAL;
+        }
+        if (i > 0 && (gz->points[i].in <= gz->points[i - 1].in ||
+                      gz->points[i].out <= gz->points[i - 1].out)) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/* Finds the last restart point at or before offset */
+static unsigned int find_point(struct sparse_gz *gz, uint64_t offset)
+{
+    unsigned int lo = 0;
+    unsigned int hi = gz->count;
+    unsigned int mid;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (gz->points[mid].in <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+int sparse_gz_read(struct sparse_gz *gz, void *buf, int64_t offset, unsigned int len)
+{
+    sparse_gz_point_t *point = &gz->points[find_point(gz, offset)];
+    unsigned char *in;
+    unsigned char *discard;
+    uint64_t pos = point->in;
+    int64_t in_offset = point->out;
+    unsigned int in_len;
+    unsigned int produced;
+    z_stream strm;
+    int ret;
+
+    if (offset < 0 || (uint64_t) offset + len > gz->isize) {
+        return -EINVAL;
+    }
+
+    in = malloc(GZ_READ_SIZE * 2);
+    if (!in) {
+        return -ENOMEM;
+    }
+    discard = in + GZ_READ_SIZE;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        free(in);
+        return -ENOMEM;
+    }
+
+    ret = 0;
+    while (len > 0) {
+        if (strm.avail_in == 0) {
+            in_len = min(gz->end - in_offset, (int64_t) GZ_READ_SIZE);
+            if (in_len == 0) {
+                ret = -EINVAL;
+                break;
+            }
+            ret = pread_all(gz->fd, in, in_len, in_offset);
+            if (ret < 0) {
+                break;
+            }
+            in_offset += in_len;
+            strm.next_in = in;
+            strm.avail_in = in_len;
+        }
+
+        /* Inflate into a scratch buffer until offset is reached */
+        if (pos < (uint64_t) offset) {
+            strm.next_out = discard;
+            strm.avail_out = min((uint64_t) offset - pos, (uint64_t) GZ_READ_SIZE);
+        } else {
+            strm.next_out = buf;
+            strm.avail_out = len;
+        }
+        produced = strm.avail_out;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ret = -EIO;
+            break;
+        }
+
+        produced -= strm.avail_out;
+        if (pos >= (uint64_t) offset) {
+            buf = (char *)buf + produced;
+            len -= produced;
+        }
+        pos += produced;
+
+        if (ret == Z_STREAM_END && len > 0) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    free(in);
+
+    return ret;
+}
+
+void sparse_gz_destroy(struct sparse_gz *gz)
+{
+    if (gz) {
+        free(gz->points);
+        free(gz);
+    }
+}
+
+/* Adds the data between restart points to s as gz backed blocks */
+static int add_gz_blocks(struct sparse_file *s, struct sparse_gz *gz)
+{
+    unsigned int i;
+    uint64_t start = 0;
+    uint64_t end;
+    int ret;
+
+    for (i = 1; i <= gz->count; i++) {
+        end = i < gz->count ? ALIGN(gz->points[i].in, s->block_size) : gz->isize;
+        end = min(end, gz->isize);
+        if (end <= start) {
+            continue;
+        }
+
+        if (end - start > UINT_MAX - s->block_size) {
+            return -E2BIG;
+        }
+
+        ret = backed_block_add_gz(s->backed_block_list, gz, start, end - start,
+                                  start / s->block_size);
+        if (ret < 0) {
+            return ret;
+        }
+        start = end;
+    }
+
+    return 0;
+}
+
+struct sparse_file *sparse_file_import_gz(int fd, bool verbose)
+{
+    sparse_gz_footer_t footer;
+    struct sparse_file *s;
+    struct sparse_gz *gz;
+    int ret;
+
+    gz = calloc(1, sizeof(*gz));
+    if (!gz) {
+        return NULL;
+    }
+    gz->fd = fd;
+
+    ret = read_index(gz, &footer);
+    if (ret == 0) {
+        ret = check_points(gz);
+    }
+    if (ret < 0) {
+        if (verbose) {
+            sparse_log_verbose("No valid restart point index in gzip file\n");
+        }
+        sparse_gz_destroy(gz);
+        return NULL;
+    }
+
+    if (footer.flags & SPARSE_GZ_FLAG_SPARSE || footer.blk_sz == 0 ||
+        footer.blk_sz % 4 != 0) {
+        if (verbose) {
+            sparse_log_verbose("Compressed data is not a raw image\n");
+        }
+        sparse_gz_destroy(gz);
+        return NULL;
+    }
+
+    s = sparse_file_new(footer.blk_sz, footer.isize);
+    if (!s) {
+        sparse_gz_destroy(gz);
+        return NULL;
+    }
+    s->verbose = verbose;
+    s->gz = gz;
+
+    ret = add_gz_blocks(s, gz);
+    if (ret < 0) {
+        sparse_file_destroy(s);
+        return NULL;
+    }
+
+    return s;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_GZ_H_
+#define _LIBSPARSE_SPARSE_GZ_H_
+
+#include <stdint.h>
+
+#include "sparse_defs.h"
+
+/*
+ * Gzip output written with restart points is followed by one or more empty
+ * gzip members carrying the restart point index in an extra field with the
+ * subfield id "SI".  gunzip decompresses the empty members to nothing.  The
+ * payload of each subfield is a list of points followed by a footer, and the
+ * footer of the last member locates the first one.
+ */
+#define SPARSE_GZ_INDEX_SI1 'S'
+#define SPARSE_GZ_INDEX_SI2 'I'
+#define SPARSE_GZ_INDEX_MAGIC 0x495a4753        /* "SGZI" */
+#define SPARSE_GZ_POINTS_PER_MEMBER 4000
+
+/* The data is in the Android sparse file format rather than a raw image */
+#define SPARSE_GZ_FLAG_SPARSE 1
+
+typedef struct sparse_gz_point {
+    __le64 in;                  /* offset in the uncompressed data */
+    __le64 out;                 /* offset in the gzip file where raw inflate can start */
+} sparse_gz_point_t;
+
+typedef struct sparse_gz_footer {
+    __le32 magic;               /* 0x495a4753 "SGZI" */
+    __le32 points;              /* points in this member */
+    __le32 blk_sz;              /* block size of the image */
+    __le32 flags;               /* SPARSE_GZ_FLAG_* */
+    __le64 first_member;        /* offset of the first index member */
+    __le64 isize;               /* total size of the uncompressed data */
+} sparse_gz_footer_t;
+
+struct sparse_gz;
+
+int sparse_gz_write_index(int fd, const sparse_gz_point_t * points, unsigned int count,
+                          int64_t offset, uint64_t isize, unsigned int blk_sz, uint32_t flags);
+int sparse_gz_read(struct sparse_gz *gz, void *buf, int64_t offset, unsigned int len);
+void sparse_gz_destroy(struct sparse_gz *gz);
+
+#endif
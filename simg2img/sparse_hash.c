@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "output_file.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+#include "sparse_parallel.h"
+#include "sparse_sha256.h"
+
+/* Largest piece of a backed block read and hashed by one worker at a time */
+#define HASH_TASK_SIZE (4U * 1024U * 1024U)
+
+/* Number of distinct fill values whose block hash is remembered */
+#define FILL_CACHE_SIZE 16
+
+/* More levels than 2^32 blocks can need with the smallest hash blocks */
+#define MAX_LEVELS 64
+
+struct hash_task {
+    struct backed_block *bb;
+    unsigned int offset;
+    unsigned int len;
+};
+
+struct fill_hash {
+    uint32_t fill_val;
+    uint8_t digest[SPARSE_SHA256_DIGEST_SIZE];
+};
+
+struct block_hash {
+    struct sparse_file *s;
+    sparse_sha256_ctx salted;
+    uint8_t *hashes;
+    struct hash_task *tasks;
+    unsigned int task_size;
+    char **bufs;
+
+    struct fill_hash fill_cache[FILL_CACHE_SIZE];
+    unsigned int fill_cached;
+    char *fill_buf;
+};
+
+/* Hashes len bytes, a whole number of blocks, into consecutive digests */
+static void hash_blocks(struct block_hash *bh, const char *data, unsigned int len, uint8_t * out)
+{
+    sparse_sha256_ctx ctx;
+    unsigned int i;
+
+    for (i = 0; i < len; i += bh->s->block_size) {
+        ctx = bh->salted;
+        sparse_sha256_update(&ctx, data + i, bh->s->block_size);
+        sparse_sha256_final(&ctx, out);
+        out += SPARSE_SHA256_DIGEST_SIZE;
+    }
+}
+
+/*
+ * Returns the hash of a block filled with fill_val.  Most of a typical image
+ * is one of a handful of fill values, so each is only hashed once.
+ */
+static const uint8_t *fill_hash(struct block_hash *bh, uint32_t fill_val)
+{
+    struct fill_hash *fh;
+    unsigned int i;
+
+    for (i = 0; i < bh->fill_cached && i < FILL_CACHE_SIZE; i++) {
+        if (bh->fill_cache[i].fill_val == fill_val) {
+            return bh->fill_cache[i].digest;
+        }
+    }
+
+    /* Replace the oldest entry once the cache is full */
+    fh = &bh->fill_cache[bh->fill_cached++ % FILL_CACHE_SIZE];
+    fh->fill_val = fill_val;
+    for (i = 0; i < bh->s->block_size; i += sizeof(fill_val)) {
+        memcpy(bh->fill_buf + i, &fill_val, sizeof(fill_val));
+    }
+    hash_blocks(bh, bh->fill_buf, bh->s->block_size, fh->digest);
+
+    return fh->digest;
+}
+
+static void fill_hashes(struct block_hash *bh, uint32_t fill_val, unsigned int block,
+                        unsigned int count)
+{
+    const uint8_t *digest = fill_hash(bh, fill_val);
+    uint8_t *out = bh->hashes + (size_t) block * SPARSE_SHA256_DIGEST_SIZE;
+
+    while (count--) {
+        memcpy(out, digest, SPARSE_SHA256_DIGEST_SIZE);
+        out += SPARSE_SHA256_DIGEST_SIZE;
+    }
+}
+
+static int hash_task(void *priv, unsigned int worker, unsigned int idx)
+{
+    struct block_hash *bh = priv;
+    struct hash_task *task = &bh->tasks[idx];
+    unsigned int block_size = bh->s->block_size;
+    unsigned int block = backed_block_block(task->bb) + task->offset / block_size;
+    unsigned int len = ALIGN(task->len, block_size);
+    int ret;
+
+    if (!bh->bufs[worker]) {
+        bh->bufs[worker] = malloc(bh->task_size);
+        if (!bh->bufs[worker]) {
+            return -ENOMEM;
+        }
+    }
+
+    ret = backed_block_read(task->bb, bh->bufs[worker], task->offset, task->len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The last block of a backed block may be short, it hashes as if padded
+     * with zeros like in the expanded image */
+    memset(bh->bufs[worker] + task->len, 0, len - task->len);
+
+    hash_blocks(bh, bh->bufs[worker], len, bh->hashes + (size_t) block * SPARSE_SHA256_DIGEST_SIZE);
+
+    return 0;
+}
+
+int sparse_file_block_hashes(struct sparse_file *s, const void *salt, size_t salt_len,
+                             uint8_t * hashes)
+{
+    struct block_hash bh;
+    struct backed_block *bb;
+    unsigned int blocks = DIV_ROUND_UP(s->len, s->block_size);
+    unsigned int threads = s->threads ? s->threads : 1;
+    unsigned int last_block = 0;
+    unsigned int count = 0;
+    unsigned int offset;
+    unsigned int len;
+    unsigned int i;
+    int ret;
+
+    memset(&bh, 0, sizeof(bh));
+    bh.s = s;
+    bh.hashes = hashes;
+    bh.task_size = HASH_TASK_SIZE / s->block_size * s->block_size;
+    if (bh.task_size == 0) {
+        bh.task_size = s->block_size;
+    }
+    sparse_sha256_init(&bh.salted);
+    sparse_sha256_update(&bh.salted, salt, salt_len);
+
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_type(bb) != BACKED_BLOCK_FILL) {
+            count += DIV_ROUND_UP(backed_block_len(bb), bh.task_size);
+        }
+    }
+
+    bh.tasks = calloc(count ? count : 1, sizeof(struct hash_task));
+    bh.bufs = calloc(threads, sizeof(char *));
+    bh.fill_buf = malloc(s->block_size);
+    if (!bh.tasks || !bh.bufs || !bh.fill_buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Gaps are don't care blocks, which read back as zeros */
+    i = 0;
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_block(bb) > last_block) {
+            fill_hashes(&bh, 0, last_block, backed_block_block(bb) - last_block);
+        }
+
+        if (backed_block_type(bb) == BACKED_BLOCK_FILL) {
+            fill_hashes(&bh, backed_block_fill_val(bb), backed_block_block(bb),
+                        DIV_ROUND_UP(backed_block_len(bb), s->block_size));
+        } else {
+            for (offset = 0; offset < backed_block_len(bb); offset += len) {
+                len = backed_block_len(bb) - offset;
+                if (len > bh.task_size) {
+                    len = bh.task_size;
+                }
+                bh.tasks[i].bb = bb;
+                bh.tasks[i].offset = offset;
+                bh.tasks[i].len = len;
+                i++;
+            }
+        }
+
+        last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+    }
+    if (last_block < blocks) {
+        fill_hashes(&bh, 0, last_block, blocks - last_block);
+    }
+
+    ret = sparse_parallel_for(threads, count, hash_task, &bh);
+
+ out:
+    if (bh.bufs) {
+        for (i = 0; i < threads; i++) {
+            free(bh.bufs[i]);
+        }
+    }
+    free(bh.bufs);
+    free(bh.tasks);
+    free(bh.fill_buf);
+
+    return ret;
+}
+
+struct level_hash {
+    unsigned int block_size;
+    const sparse_sha256_ctx *salted;
+    const uint8_t *in;
+    uint8_t *out;
+};
+
+static int level_hash_task(void *priv, unsigned int worker __unused, unsigned int idx)
+{
+    struct level_hash *lh = priv;
+    sparse_sha256_ctx ctx = *lh->salted;
+
+    sparse_sha256_update(&ctx, lh->in + (size_t) idx * lh->block_size, lh->block_size);
+    sparse_sha256_final(&ctx, lh->out + (size_t) idx * SPARSE_SHA256_DIGEST_SIZE);
+
+    return 0;
+}
+
+int sparse_file_hash_tree(struct sparse_file *s, const void *salt, size_t salt_len, int fd,
+                          uint8_t * root_digest)
+{
+    struct level_hash lh;
+    sparse_sha256_ctx salted;
+    unsigned int block_size = s->block_size;
+    unsigned int threads = s->threads ? s->threads : 1;
+    uint64_t level_offset[MAX_LEVELS];
+    uint64_t level_len[MAX_LEVELS];
+    uint64_t blocks = DIV_ROUND_UP(s->len, block_size);
+    uint64_t tree_len = 0;
+    unsigned int levels = 0;
+    unsigned int i;
+    uint8_t *tree;
+    int ret;
+
+    /* Digests must pack evenly into hash blocks */
+    if (blocks == 0 || block_size < 2 * SPARSE_SHA256_DIGEST_SIZE ||
+        (block_size & (block_size - 1))) {
+        return -EINVAL;
+    }
+
+    /* Level 0 holds the hash of every data block, each level above it the
+     * hashes of the blocks of the one below, up to a single block */
+    do {
+        level_len[levels] = ALIGN(blocks * SPARSE_SHA256_DIGEST_SIZE, block_size);
+        tree_len += level_len[levels];
+        blocks = level_len[levels] / block_size;
+        levels++;
+    } while (blocks > 1 && levels < MAX_LEVELS);
+
+    /* As in dm-verity, the top level is stored first */
+    level_offset[levels - 1] = 0;
+    for (i = levels - 1; i > 0; i--) {
+        level_offset[i - 1] = level_offset[i] + level_len[i];
+    }
+
+    tree = calloc(1, tree_len);
+    if (!tree) {
+        return -ENOMEM;
+    }
+
+    ret = sparse_file_block_hashes(s, salt, salt_len, tree + level_offset[0]);
+    if (ret < 0) {
+        goto out;
+    }
+
+    sparse_sha256_init(&salted);
+    sparse_sha256_update(&salted, salt, salt_len);
+    lh.block_size = block_size;
+    lh.salted = &salted;
+    for (i = 1; i < levels; i++) {
+        lh.in = tree + level_offset[i - 1];
+        lh.out = tree + level_offset[i];
+        ret = sparse_parallel_for(threads, level_len[i - 1] / block_size, level_hash_task, &lh);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    lh.in = tree + level_offset[levels - 1];
+    lh.out = root_digest;
+    level_hash_task(&lh, 0, 0);
+
+    if (fd >= 0) {
+        ret = write_all(fd, tree, tree_len);
+    }
+
+ out:
+    free(tree);
+    return ret;
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef USE_MINGW
+#include <sys/mman.h>
+#endif
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "output_file.h"
+#include "sparse_crc32.h"
+#include "sparse_err.h"
+#include "sparse_file.h"
+#include "sparse_format.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef ESTALE
+#define ESTALE EINVAL
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+#define SPARSE_INDEX_MAJOR_VER 2
+
+/* Reads the identity of the image an index must match */
+static int index_image_key(int fd, sparse_index_header_t * key)
+{
+    sparse_header_t sparse_header;
+    struct stat st;
+    int ret;
+
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+
+    ret = pread_all(fd, &sparse_header, sizeof(sparse_header), 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (sparse_header.magic != SPARSE_HEADER_MAGIC) {
+        return -EINVAL;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->magic = SPARSE_INDEX_MAGIC;
+    key->major_version = SPARSE_INDEX_MAJOR_VER;
+    key->entry_sz = sizeof(sparse_index_entry_t);
+    key->blk_sz = sparse_header.blk_sz;
+    key->total_blks = sparse_header.total_blks;
+    key->header_crc = sparse_crc32(0, &sparse_header, sizeof(sparse_header));
+    key->image_size = st.st_size;
+    key->image_ino = st.st_ino;
+    /* Whole seconds miss an image rewritten within the same second */
+#ifdef USE_MINGW
+    key->image_mtime = st.st_mtime;
+    key->image_ctime = st.st_ctime;
+#else
+    key->image_mtime = st.st_mtim.tv_sec;
+    key->image_mtime_nsec = st.st_mtim.tv_nsec;
+    key->image_ctime = st.st_ctim.tv_sec;
+    key->image_ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+
+    return 0;
+}
+
+int sparse_file_write_index(struct sparse_file *s, int fd, const char *path)
+{
+    sparse_index_header_t header;
+    sparse_index_entry_t *entries;
+    struct backed_block *bb;
+    unsigned int count = 0;
+    unsigned int i;
+    char *tmp_path;
+    int out;
+    int ret;
+
+    ret = index_image_key(fd, &header);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (header.blk_sz != s->block_size ||
+        (int64_t) header.total_blks * header.blk_sz != s->len) {
+        return -EINVAL;
+    }
+
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        count++;
+    }
+
+    entries = calloc(count ? count : 1, sizeof(*entries));
+    if (!entries) {
+        return -ENOMEM;
+    }
+
+    /* Only blocks that point back into the image itself can be indexed */
+    i = 0;
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        entries[i].block = backed_block_block(bb);
+        entries[i].len = backed_block_len(bb);
+        if (backed_block_type(bb) == BACKED_BLOCK_FILL) {
+            entries[i].chunk_type = CHUNK_TYPE_FILL;
+            entries[i].fill_val = backed_block_fill_val(bb);
+        } else if (backed_block_type(bb) == BACKED_BLOCK_FD && backed_block_fd(bb) == fd) {
+            entries[i].chunk_type = CHUNK_TYPE_RAW;
+            entries[i].offset = backed_block_file_offset(bb);
+        } else {
+            free(entries);
+            return -EINVAL;
+        }
+        i++;
+    }
+
+    header.total_entries = count;
+    header.entries_crc = sparse_crc32(0, entries, (size_t) count * sizeof(*entries));
+
+    /* Write to a temporary file and rename it over the old index, so readers
+     * never see a partial one */
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (!tmp_path) {
+        free(entries);
+        return -ENOMEM;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        ret = -errno;
+        goto out_free;
+    }
+
+    ret = pwrite_all(out, &header, sizeof(header), 0);
+    if (ret == 0) {
+        ret = pwrite_all(out, entries, (size_t) count * sizeof(*entries), sizeof(header));
+    }
+    if (close(out) < 0 && ret == 0) {
+        ret = -errno;
+    }
+    if (ret == 0 && rename(tmp_path, path) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp_path);
+    }
+
+out_free:
+    free(tmp_path);
+    free(entries);
+    return ret;
+}
+
+/*
+ * Adds the entries of an index that matches key to s.  They were written in
+ * block order and must not overlap, so each one is appended after the last
+ * block of s in O(1) without touching the lookup index, and loading n entries
+ * costs O(n).
+ */
+static int index_load(struct sparse_file *s, int image_fd, const sparse_index_header_t * key,
+                      const void *map, int64_t map_len)
+{
+    const sparse_index_header_t *header = map;
+    const sparse_index_entry_t *entries;
+    const sparse_index_entry_t *e;
+    int64_t end = 0;
+    unsigned int i;
+    int ret;
+
+    if (map_len < (int64_t) sizeof(*header)) {
+        return -EINVAL;
+    }
+
+    if (header->magic != key->magic || header->major_version != key->major_version ||
+        header->entry_sz != key->entry_sz || header->blk_sz != key->blk_sz ||
+        header->total_blks != key->total_blks || header->header_crc != key->header_crc ||
+        header->image_size != key->image_size || header->image_ino != key->image_ino ||
+        header->image_mtime != key->image_mtime ||
+        header->image_mtime_nsec != key->image_mtime_nsec ||
+        header->image_ctime != key->image_ctime ||
+        header->image_ctime_nsec != key->image_ctime_nsec) {
+        return -ESTALE;
+    }
+
+    if ((int64_t) header->total_entries * sizeof(*entries) != map_len - (int64_t) sizeof(*header)) {
+        return -EINVAL;
+    }
+
+    entries = (const sparse_index_entry_t *)(header + 1);
+    if (sparse_crc32(0, entries, (size_t) header->total_entries * sizeof(*entries)) !=
+        header->entries_crc) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < header->total_entries; i++) {
+        e = &entries[i];
+        if ((int64_t) e->block * header->blk_sz < end || e->len == 0 ||
+            (int64_t) e->block * header->blk_sz + e->len > s->len) {
+            return -EINVAL;
+        }
+        end = ((int64_t) e->block * header->blk_sz + e->len + header->blk_sz - 1) /
+            header->blk_sz * header->blk_sz;
+
+        if (e->chunk_type == CHUNK_TYPE_FILL) {
+            ret = sparse_file_add_fill(s, e->fill_val, e->len, e->block);
+        } else if (e->chunk_type == CHUNK_TYPE_RAW && e->offset <= header->image_size &&
+                   e->len <= header->image_size - e->offset) {
+            ret = sparse_file_add_fd(s, image_fd, e->offset, e->len, e->block);
+        } else {
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Maps the index file at path and loads it into s if it matches key, with
+ * raw entries pointing into image_fd */
+static int index_read(struct sparse_file *s, int image_fd, const sparse_index_header_t * key,
+                      const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    if (st.st_size < (off_t) sizeof(sparse_index_header_t)) {
+        close(fd);
+        return -EINVAL;
+    }
+
+#ifndef USE_MINGW
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+#else
+    map = malloc(st.st_size);
+    if (!map) {
+        close(fd);
+        return -ENOMEM;
+    }
+    ret = pread_all(fd, map, st.st_size, 0);
+    if (ret < 0) {
+        free(map);
+        close(fd);
+        return ret;
+    }
+#endif
+
+    ret = index_load(s, image_fd, key, map, st.st_size);
+
+#ifndef USE_MINGW
+    munmap(map, st.st_size);
+#else
+    free(map);
+#endif
+    close(fd);
+
+    return ret;
+}
+
+struct sparse_file *sparse_file_import_indexed(int fd, const char *path, bool verbose)
+{
+    sparse_index_header_t key;
+    struct sparse_file *s;
+    int ret;
+
+    ret = index_image_key(fd, &key);
+    if (ret < 0) {
+        if (verbose) {
+            sparse_log_verbose("Cannot read sparse header for index\n");
+        }
+        return NULL;
+    }
+
+    s = sparse_file_new(key.blk_sz, (int64_t) key.total_blks * key.blk_sz);
+    if (!s) {
+        return NULL;
+    }
+    s->verbose = verbose;
+
+    ret = index_read(s, fd, &key, path);
+    if (ret == 0) {
+        return s;
+    }
+    sparse_file_destroy(s);
+
+    if (verbose && ret != -ENOENT) {
+        sparse_log_verbose("Ignoring index %s: %s\n", path,
+                             ret == -ESTALE ? "out of date" : "invalid");
+    }
+
+    /* Missing or stale, fall back to reading the chunk headers and leave a
+     * fresh index behind for the next open.  Not being able to write it is
+     * not an error. */
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return NULL;
+    }
+
+    s = sparse_file_import(fd, verbose, false);
+    if (s) {
+        sparse_file_write_index(s, fd, path);
+    }
+
+    return s;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <sparse/sparse.h>
+
+#include "defs.h"
+#include "backed_block.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+#define max(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a > _b) ? _a : _b; })
+
+/*
+ * Adds the parts of the blocks of base, starting from *base_bb, that fall in
+ * [start, end) to s.  *base_bb is left at the first block that may still
+ * reach past end, so each block of base is visited once over the whole walk.
+ */
+static int overlay_gap(struct sparse_file *s, struct backed_block **base_bb,
+                       unsigned int start, unsigned int end)
+{
+    unsigned int block_size = s->block_size;
+    struct backed_block *bb;
+    unsigned int from;
+    unsigned int to;
+    int ret;
+
+    if (start >= end) {
+        return 0;
+    }
+
+    for (bb = *base_bb; bb && backed_block_block(bb) < end; bb = backed_block_iter_next(bb)) {
+        to = backed_block_end(bb, block_size);
+        if (to <= start) {
+            continue;
+        }
+        from = max(start, backed_block_block(bb));
+        ret = backed_block_add_blocks(s->backed_block_list, bb, from, min(to, end) - from);
+        if (ret < 0) {
+            return ret;
+        }
+        if (to > end) {
+            break;
+        }
+    }
+    *base_bb = bb;
+
+    return 0;
+}
+
+int sparse_file_overlay(struct sparse_file *base, struct sparse_file *top,
+                        struct sparse_file **out_s)
+{
+    struct sparse_file *s;
+    struct backed_block *base_bb;
+    struct backed_block *top_bb;
+    unsigned int pos = 0;
+    int ret;
+
+    *out_s = NULL;
+    if (base->block_size != top->block_size) {
+        error("block sizes differ: %u and %u", base->block_size, top->block_size);
+        return -EINVAL;
+    }
+
+    s = sparse_file_new(top->block_size, max(base->len, top->len));
+    if (!s) {
+        return -ENOMEM;
+    }
+
+    /*
+     * Both lists are sorted, so walking them side by side queues every block
+     * of s in order: the gap of base before each block of top, then the
+     * block of top itself.  Each one lands after the last block of s, which
+     * backed_block_add_blocks appends in O(1) without touching the index, so
+     * the whole overlay is linear in the chunks of base and top.
+     */
+    base_bb = backed_block_iter_new(base->backed_block_list);
+    for (top_bb = backed_block_iter_new(top->backed_block_list); top_bb;
+         top_bb = backed_block_iter_next(top_bb)) {
+        ret = overlay_gap(s, &base_bb, pos, backed_block_block(top_bb));
+        if (ret < 0) {
+            goto err;
+        }
+        ret = backed_block_add_blocks(s->backed_block_list, top_bb, backed_block_block(top_bb),
+                                      backed_block_end(top_bb, s->block_size) - backed_block_block(top_bb));
+        if (ret < 0) {
+            goto err;
+        }
+        pos = backed_block_end(top_bb, s->block_size);
+    }
+
+    ret = overlay_gap(s, &base_bb, pos, UINT_MAX);
+    if (ret < 0) {
+        goto err;
+    }
+
+    *out_s = s;
+    return 0;
+
+ err:
+    sparse_file_destroy(s);
+    return ret;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "sparse_err.h"
+#include "sparse_parallel.h"
+#include "sparse_stats.h"
+
+struct parallel_ctx {
+    pthread_mutex_t lock;
+    unsigned int next;
+    unsigned int count;
+    int err;
+    int (*fn) (void *priv, unsigned int worker, unsigned int idx);
+    void *priv;
+    /* The caller's log, so messages from workers end up in the same place */
+    struct sparse_log log;
+    /* The caller's stats, which workers add to as well */
+    struct sparse_stats *stats;
+};
+
+struct parallel_worker {
+    struct parallel_ctx *ctx;
+    unsigned int id;
+    pthread_t thread;
+};
+
+static void *parallel_worker_run(void *arg)
+{
+    struct parallel_worker *w = arg;
+    struct parallel_ctx *ctx = w->ctx;
+    unsigned int idx;
+    int ret;
+
+    sparse_log_set(&ctx->log);
+    if (w->id) {
+        sparse_set_stats(ctx->stats);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->err || ctx->next >= ctx->count) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        idx = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        ret = ctx->fn(ctx->priv, w->id, idx);
+        if (ret < 0) {
+            pthread_mutex_lock(&ctx->lock);
+            if (!ctx->err) {
+                ctx->err = ret;
+            }
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+
+    return NULL;
+}
+
+int sparse_parallel_for(unsigned int threads, unsigned int count,
+                        int (*fn) (void *priv, unsigned int worker, unsigned int idx),
+                        void *priv)
+{
+    struct parallel_ctx ctx;
+    struct parallel_worker *workers;
+    unsigned int started;
+    unsigned int i;
+
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    workers = calloc(threads, sizeof(struct parallel_worker));
+    if (!workers) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    ctx.next = 0;
+    ctx.count = count;
+    ctx.err = 0;
+    ctx.fn = fn;
+    ctx.priv = priv;
+    sparse_log_get(&ctx.log);
+    ctx.stats = sparse_thread_stats;
+
+    /* Worker 0 is the calling thread; if a thread fails to start, the
+     * remaining work is simply shared among the ones that did. */
+    for (started = 1; started < threads; started++) {
+        workers[started].ctx = &ctx;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].thread, NULL, parallel_worker_run,
+                           &workers[started])) {
+            break;
+        }
+    }
+
+    workers[0].ctx = &ctx;
+    workers[0].id = 0;
+    parallel_worker_run(&workers[0]);
+
+    for (i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&ctx.lock);
+    free(workers);
+
+    return ctx.err;
+}
@@ -20,6 +20,7 @@
 
 #include <inttypes.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -28,13 +29,22 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 #include <sparse/sparse.h>
 
 #include "defs.h"
 #include "output_file.h"
 #include "sparse_crc32.h"
+#include "sparse_err.h"
 #include "sparse_file.h"
 #include "sparse_format.h"
+#include "sparse_scan.h"
+#include "sparse_stats.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek lseek
@@ -46,7 +56,12 @@
 #define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
 
 #define COPY_BUF_SIZE (1024U*1024U)
-static char *copybuf;
+
+/* Amount of a normal file read and classified at a time */
+#define READ_WINDOW_SIZE (8U*1024U*1024U)
+
+/* Number of extents asked for per FIEMAP call */
+#define FIEMAP_BATCH 64
 
 #define min(a, b) \
 	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
@@ -73,7 +88,7 @@ static void verbose_error(bool verbose, int err, const char *fmt, ...)
         }
 
         va_start(argp, fmt);
-        vsnprintf(at, size, fmt, argp);
+        vsnprintf(at, size + 1, fmt, argp);
         va_end(argp);
         at[size] = 0;
         s = " at ";
@@ -81,15 +96,15 @@ static void verbose_error(bool verbose, int err, const char *fmt, ...)
     if (verbose) {
 #ifndef USE_MINGW
         if (err == -EOVERFLOW) {
-            sparse_print_verbose("EOF while reading file%s%s\n", s, at);
+            sparse_log_verbose("EOF while reading file%s%s\n", s, at);
         } else
 #endif
         if (err == -EINVAL) {
-            sparse_print_verbose("Invalid sparse file format%s%s\n", s, at);
+            sparse_log_verbose("Invalid sparse file format%s%s\n", s, at);
         } else if (err == -ENOMEM) {
-            sparse_print_verbose("Failed allocation while reading file%s%s\n", s, at);
+            sparse_log_verbose("Failed allocation while reading file%s%s\n", s, at);
         } else {
-            sparse_print_verbose("Unknown error %d%s%s\n", err, s, at);
+            sparse_log_verbose("Unknown error %d%s%s\n", err, s, at);
         }
     }
     if (fmt) {
@@ -97,9 +112,28 @@ static void verbose_error(bool verbose, int err, const char *fmt, ...)
     }
 }
 
+/* Counts a chunk of an image being read by its type */
+static void stats_chunk_read(uint16_t chunk_type)
+{
+    switch (chunk_type) {
+    case CHUNK_TYPE_RAW:
+        stats_add(chunks_read[SPARSE_STATS_CHUNK_RAW], 1);
+        break;
+    case CHUNK_TYPE_FILL:
+        stats_add(chunks_read[SPARSE_STATS_CHUNK_FILL], 1);
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        stats_add(chunks_read[SPARSE_STATS_CHUNK_DONT_CARE], 1);
+        break;
+    case CHUNK_TYPE_CRC32:
+        stats_add(chunks_read[SPARSE_STATS_CHUNK_CRC32], 1);
+        break;
+    }
+}
+
 static int process_raw_chunk(struct sparse_file *s, unsigned int chunk_size,
                              int fd, int64_t offset, unsigned int blocks, unsigned int block,
-                             uint32_t * crc32)
+                             uint32_t * crc32, char *copybuf)
 {
     int ret;
     int chunk;
@@ -130,6 +164,7 @@ static int process_raw_chunk(struct sparse_file *s, unsigned int chunk_size,
         }
     } else {
         lseek(fd, len, SEEK_CUR);
+        stats_add(seek_calls, 1);
     }
 
     return 0;
@@ -139,11 +174,8 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
                               int fd, unsigned int blocks, unsigned int block, uint32_t * crc32)
 {
     int ret;
-    int chunk;
     int64_t len = (int64_t) blocks * s->block_size;
     uint32_t fill_val;
-    uint32_t *fillbuf;
-    unsigned int i;
 
     if (chunk_size != sizeof(fill_val)) {
         return -EINVAL;
@@ -160,17 +192,7 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
     }
 
     if (crc32) {
-        /* Fill copy_buf with the fill value */
-        fillbuf = (uint32_t *) copybuf;
-        for (i = 0; i < (COPY_BUF_SIZE / sizeof(fill_val)); i++) {
-            fillbuf[i] = fill_val;
-        }
-
-        while (len) {
-            chunk = min(len, COPY_BUF_SIZE);
-            *crc32 = sparse_crc32(*crc32, copybuf, chunk);
-            len -= chunk;
-        }
+        *crc32 = sparse_crc32_fill(*crc32, fill_val, len);
     }
 
     return 0;
@@ -186,13 +208,7 @@ static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
 
     if (crc32) {
         int64_t len = (int64_t) blocks * s->block_size;
-        memset(copybuf, 0, COPY_BUF_SIZE);
-
-        while (len) {
-            int chunk = min(len, COPY_BUF_SIZE);
-            *crc32 = sparse_crc32(*crc32, copybuf, chunk);
-            len -= chunk;
-        }
+        *crc32 = sparse_crc32_fill(*crc32, 0, len);
     }
 
     return 0;
@@ -221,17 +237,18 @@ static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t * crc32
 
 static int process_chunk(struct sparse_file *s, int fd, off_t offset,
                          unsigned int chunk_hdr_sz, chunk_header_t * chunk_header,
-                         unsigned int cur_block, uint32_t * crc_ptr)
+                         unsigned int cur_block, uint32_t * crc_ptr, char *copybuf)
 {
     int ret;
     unsigned int chunk_data_size;
 
     chunk_data_size = chunk_header->total_sz - chunk_hdr_sz;
+    stats_chunk_read(chunk_header->chunk_type);
 
     switch (chunk_header->chunk_type) {
     case CHUNK_TYPE_RAW:
         ret = process_raw_chunk(s, chunk_data_size, fd, offset,
-                                chunk_header->chunk_sz, cur_block, crc_ptr);
+                                chunk_header->chunk_sz, cur_block, crc_ptr, copybuf);
         if (ret < 0) {
             verbose_error(s->verbose, ret, "data block at %" PRId64, offset);
             return ret;
@@ -280,38 +297,45 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
     uint32_t *crc_ptr = 0;
     unsigned int cur_block = 0;
     off_t offset;
+    char *copybuf = NULL;
+    int phase;
+    int io_phase;
 
-    if (!copybuf) {
-        copybuf = malloc(COPY_BUF_SIZE);
-    }
-
-    if (!copybuf) {
-        return -ENOMEM;
-    }
-
+    /* Verifying the crc means reading the data, through a buffer of our own
+     * so several files can be imported at once */
     if (crc) {
         crc_ptr = &crc32;
+        copybuf = malloc(COPY_BUF_SIZE);
+        if (!copybuf) {
+            return -ENOMEM;
+        }
     }
 
+    phase = stats_enter(SPARSE_STATS_PHASE_HEADER);
+
     ret = read_all(fd, &sparse_header, sizeof(sparse_header));
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     if (sparse_header.magic != SPARSE_HEADER_MAGIC) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
     if (sparse_header.major_version != SPARSE_HEADER_MAJOR_VER) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
     if (sparse_header.file_hdr_sz < SPARSE_HEADER_LEN) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
     if (sparse_header.chunk_hdr_sz < sizeof(chunk_header)) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
     if (sparse_header.file_hdr_sz > SPARSE_HEADER_LEN) {
@@ -319,12 +343,13 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
          * we expected.
          */
         lseek(fd, sparse_header.file_hdr_sz - SPARSE_HEADER_LEN, SEEK_CUR);
+        stats_add(seek_calls, 1);
     }
 
     for (i = 0; i < sparse_header.total_chunks; i++) {
         ret = read_all(fd, &chunk_header, sizeof(chunk_header));
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         if (sparse_header.chunk_hdr_sz > CHUNK_HEADER_LEN) {
@@ -332,88 +357,325 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
              * we expected.
              */
             lseek(fd, sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN, SEEK_CUR);
+            stats_add(seek_calls, 1);
         }
 
         offset = lseek(fd, 0, SEEK_CUR);
+        stats_add(seek_calls, 1);
 
+        io_phase = stats_enter(SPARSE_STATS_PHASE_IO);
         ret = process_chunk(s, fd, offset, sparse_header.chunk_hdr_sz, &chunk_header,
-                            cur_block, crc_ptr);
+                            cur_block, crc_ptr, copybuf);
+        stats_leave(io_phase);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         cur_block += ret;
     }
 
     if (sparse_header.total_blks != cur_block) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
-    return 0;
+    ret = 0;
+
+ out:
+    stats_leave(phase);
+    free(copybuf);
+    return ret;
 }
 
-static int sparse_file_read_normal(struct sparse_file *s, int fd)
+/* A run of consecutive blocks that will become a single backed block */
+struct read_run {
+    bool fill;
+    uint32_t fill_val;
+    unsigned int block;
+    int64_t offset;
+    int64_t len;
+};
+
+static int flush_read_run(struct sparse_file *s, int fd, struct read_run *run)
+{
+    int ret = 0;
+
+    if (run->len == 0) {
+        return 0;
+    }
+
+    if (run->fill) {
+        ret = sparse_file_add_fill(s, run->fill_val, run->len, run->block);
+    } else {
+        ret = sparse_file_add_fd(s, fd, run->offset, run->len, run->block);
+    }
+
+    run->len = 0;
+    return ret;
+}
+
+/* Extends the current run with one block, or starts a new one */
+static int add_read_block(struct sparse_file *s, int fd, struct read_run *run, bool fill,
+                          uint32_t fill_val, unsigned int block, int64_t offset,
+                          unsigned int len)
 {
     int ret;
-    uint32_t *buf = malloc(s->block_size);
-    unsigned int block = 0;
-    int64_t remain = s->len;
-    int64_t offset = 0;
+
+    if (run->len && run->fill == fill && (!fill || run->fill_val == fill_val) &&
+        run->len + len <= UINT_MAX - s->block_size) {
+        run->len += len;
+        return 0;
+    }
+
+    ret = flush_read_run(s, fd, run);
+    if (ret < 0) {
+        return ret;
+    }
+
+    run->fill = fill;
+    run->fill_val = fill_val;
+    run->block = block;
+    run->offset = offset;
+    run->len = len;
+
+    return 0;
+}
+
+/*
+ * Reads len bytes of a normal file starting at offset, which must be block
+ * aligned.  The fd must already be positioned at offset.
+ */
+static int do_sparse_file_read_normal(struct sparse_file *s, int fd, int64_t offset,
+                                      int64_t remain)
+{
+    int ret = 0;
+    unsigned int window = ALIGN_DOWN(READ_WINDOW_SIZE, s->block_size);
+    char *buf;
+    unsigned int block = offset / s->block_size;
+    struct read_run run = { 0 };
     unsigned int to_read;
-    unsigned int i;
-    bool sparse_block;
+    unsigned int pos;
+    unsigned int len;
+    uint32_t fill_val;
+    bool fill;
+    int phase;
+    int io_phase;
+
+    if (window < s->block_size) {
+        window = s->block_size;
+    }
 
+    buf = malloc(window);
     if (!buf) {
         return -ENOMEM;
     }
 
+    phase = stats_enter(SPARSE_STATS_PHASE_SCAN);
+
     while (remain > 0) {
-        to_read = min(remain, s->block_size);
+        to_read = min(remain, window);
+        io_phase = stats_enter(SPARSE_STATS_PHASE_IO);
         ret = read_all(fd, buf, to_read);
+        stats_leave(io_phase);
         if (ret < 0) {
             error("failed to read sparse file");
-            free(buf);
-            return ret;
+            break;
         }
 
-        if (to_read == s->block_size) {
-            sparse_block = true;
-            for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-                if (buf[0] != buf[i]) {
-                    sparse_block = false;
-                    break;
-                }
+        for (pos = 0; pos < to_read; pos += len) {
+            len = min(to_read - pos, s->block_size);
+            fill = len == s->block_size && sparse_scan_uniform(buf + pos, len, &fill_val);
+
+            if (fill && fill_val == 0 && s->skip_zero) {
+                /* Leave a gap, it will be written as don't care */
+                ret = flush_read_run(s, fd, &run);
+            } else {
+                ret = add_read_block(s, fd, &run, fill, fill_val, block, offset + pos, len);
             }
-        } else {
-            sparse_block = false;
+            if (ret < 0) {
+                break;
+            }
+            block++;
         }
-
-        if (sparse_block) {
-            /* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-            sparse_file_add_fill(s, buf[0], to_read, block);
-        } else {
-            sparse_file_add_fd(s, fd, offset, to_read, block);
+        if (ret < 0) {
+            break;
         }
 
         remain -= to_read;
         offset += to_read;
-        block++;
     }
 
+    if (ret >= 0) {
+        ret = flush_read_run(s, fd, &run);
+    }
+
+    stats_leave(phase);
     free(buf);
+    return ret;
+}
+
+static int sparse_file_read_normal(struct sparse_file *s, int fd)
+{
+    return do_sparse_file_read_normal(s, fd, 0, s->len);
+}
+
+/*
+ * Reads the data extent [start, end) of a normal file, widened to whole
+ * blocks.  *done is the end of the previous extent read, so a block shared
+ * by two extents is only read once.
+ */
+static int read_data_extent(struct sparse_file *s, int fd, int64_t start, int64_t end,
+                            int64_t * done)
+{
+    int ret;
+
+    start = ALIGN_DOWN(start, s->block_size);
+    if (start < *done) {
+        start = *done;
+    }
+    end = min(ALIGN(end, s->block_size), s->len);
+    if (start >= end) {
+        return 0;
+    }
+
+    stats_add(seek_calls, 1);
+    if (lseek(fd, start, SEEK_SET) < 0) {
+        return -errno;
+    }
+
+    ret = do_sparse_file_read_normal(s, fd, start, end - start);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *done = end;
     return 0;
 }
 
-int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
+#ifdef __linux__
+static int sparse_file_read_fiemap(struct sparse_file *s, int fd)
 {
-    if (crc && !sparse) {
+    struct fiemap *fm;
+    struct fiemap_extent *ext;
+    int64_t done = 0;
+    int64_t start = 0;
+    unsigned int i;
+    bool last = false;
+    int ret = 0;
+
+    fm = calloc(1, sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    if (!fm) {
+        return -ENOMEM;
+    }
+
+    while (!last && start < s->len) {
+        fm->fm_start = start;
+        fm->fm_length = s->len - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_BATCH;
+        stats_add(other_calls, 1);
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+            ret = -errno;
+            break;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (i = 0; i < fm->fm_mapped_extents; i++) {
+            ext = &fm->fm_extents[i];
+            ret = read_data_extent(s, fd, ext->fe_logical, ext->fe_logical + ext->fe_length,
+                                   &done);
+            if (ret < 0) {
+                goto out;
+            }
+            start = ext->fe_logical + ext->fe_length;
+            if (ext->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = true;
+            }
+        }
+    }
+
+ out:
+    free(fm);
+    return ret;
+}
+#else
+static int sparse_file_read_fiemap(struct sparse_file *s __unused, int fd __unused)
+{
+    return -EOPNOTSUPP;
+}
+#endif
+
+/*
+ * Reads only the data extents of a normal file, leaving holes out of the
+ * sparse file so they are written as don't care chunks.  Falls back to FIEMAP
+ * if lseek can't find holes, and to reading everything if neither works.
+ */
+static int sparse_file_read_hole(struct sparse_file *s, int fd)
+{
+    int ret;
+#ifdef SEEK_DATA
+    int64_t done = 0;
+    int64_t end = 0;
+    int64_t start;
+
+    while (end < s->len) {
+        start = lseek(fd, end, SEEK_DATA);
+        stats_add(seek_calls, 1);
+        if (start < 0) {
+            if (errno == ENXIO) {
+                /* The rest of the file is a hole */
+                return 0;
+            }
+            if (end == 0 && errno == EINVAL) {
+                break;
+            }
+            return -errno;
+        }
+
+        end = lseek(fd, start, SEEK_HOLE);
+        stats_add(seek_calls, 1);
+        if (end < 0) {
+            return -errno;
+        }
+
+        ret = read_data_extent(s, fd, start, end, &done);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (end >= s->len) {
+        return 0;
+    }
+#endif
+
+    ret = sparse_file_read_fiemap(s, fd);
+    if (ret == -EOPNOTSUPP || ret == -ENOTTY) {
+        if (lseek(fd, 0, SEEK_SET) < 0) {
+            return -errno;
+        }
+        ret = sparse_file_read_normal(s, fd);
+    }
+
+    return ret;
+}
+
+int sparse_file_read(struct sparse_file *s, int fd, enum sparse_read_mode mode, bool crc)
+{
+    if (crc && mode != SPARSE_READ_MODE_SPARSE) {
         return -EINVAL;
     }
 
-    if (sparse) {
+    switch (mode) {
+    case SPARSE_READ_MODE_SPARSE:
         return sparse_file_read_sparse(s, fd, crc);
-    } else {
+    case SPARSE_READ_MODE_NORMAL:
         return sparse_file_read_normal(s, fd);
+    case SPARSE_READ_MODE_HOLE:
+        return sparse_file_read_hole(s, fd);
+    default:
+        return -EINVAL;
     }
 }
 
@@ -504,3 +766,303 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose)
 
     return s;
 }
+
+/* Size of the buffer data is passed through by sparse_file_stream */
+#define STREAM_BUF_SIZE (1024U*1024U)
+
+/* Largest skip handed to the stream callback in one call */
+#define STREAM_SKIP_MAX (1U << 30)
+
+struct sparse_stream {
+    int fd;
+    bool verbose;
+    unsigned int block_size;
+    uint32_t *crc32;
+    char *buf;
+    int (*write) (void *priv, const void *data, int len);
+    void *priv;
+};
+
+/* Reads and drops len bytes, for streams that can't seek */
+static int stream_discard(struct sparse_stream *st, int64_t len)
+{
+    int ret;
+    unsigned int chunk;
+
+    while (len > 0) {
+        chunk = min(len, (int64_t) STREAM_BUF_SIZE);
+        ret = read_all(st->fd, st->buf, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int stream_raw_chunk(struct sparse_stream *st, int64_t len)
+{
+    int ret;
+    unsigned int chunk;
+
+    while (len > 0) {
+        chunk = min(len, (int64_t) STREAM_BUF_SIZE);
+        ret = read_all(st->fd, st->buf, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (st->crc32) {
+            *st->crc32 = sparse_crc32(*st->crc32, st->buf, chunk);
+        }
+
+        ret = st->write(st->priv, st->buf, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int stream_fill_chunk(struct sparse_stream *st, int64_t len)
+{
+    int ret;
+    unsigned int i;
+    unsigned int chunk;
+    uint32_t fill_val;
+    uint32_t *fill_buf = (uint32_t *) st->buf;
+
+    ret = read_all(st->fd, &fill_val, sizeof(fill_val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (st->crc32) {
+        *st->crc32 = sparse_crc32_fill(*st->crc32, fill_val, len);
+    }
+
+    chunk = min(len, (int64_t) STREAM_BUF_SIZE);
+    for (i = 0; i < chunk / sizeof(uint32_t); i++) {
+        fill_buf[i] = fill_val;
+    }
+
+    while (len > 0) {
+        chunk = min(len, (int64_t) STREAM_BUF_SIZE);
+        ret = st->write(st->priv, fill_buf, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int stream_skip_chunk(struct sparse_stream *st, int64_t len)
+{
+    int ret;
+    unsigned int chunk;
+
+    if (st->crc32) {
+        *st->crc32 = sparse_crc32_fill(*st->crc32, 0, len);
+    }
+
+    while (len > 0) {
+        chunk = min(len, (int64_t) STREAM_SKIP_MAX);
+        ret = st->write(st->priv, NULL, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int stream_crc32_chunk(struct sparse_stream *st)
+{
+    uint32_t file_crc32;
+    int ret;
+
+    ret = read_all(st->fd, &file_crc32, sizeof(file_crc32));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (st->crc32 != NULL && file_crc32 != *st->crc32) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Expands one chunk, returning the number of output blocks it covered */
+static int stream_chunk(struct sparse_stream *st, chunk_header_t * chunk_header,
+                        unsigned int chunk_hdr_sz, int64_t offset)
+{
+    int ret;
+    int phase;
+    unsigned int chunk_data_size;
+    int64_t len = (int64_t) chunk_header->chunk_sz * st->block_size;
+
+    if (chunk_header->total_sz < chunk_hdr_sz) {
+        verbose_error(st->verbose, -EINVAL, "chunk at %" PRId64, offset);
+        return -EINVAL;
+    }
+    chunk_data_size = chunk_header->total_sz - chunk_hdr_sz;
+    stats_chunk_read(chunk_header->chunk_type);
+
+    switch (chunk_header->chunk_type) {
+    case CHUNK_TYPE_RAW:
+        ret = -EINVAL;
+        if (chunk_data_size == len) {
+            phase = stats_enter(SPARSE_STATS_PHASE_IO);
+            ret = stream_raw_chunk(st, len);
+            stats_leave(phase);
+        }
+        if (ret < 0) {
+            verbose_error(st->verbose, ret, "data block at %" PRId64, offset);
+            return ret;
+        }
+        return chunk_header->chunk_sz;
+    case CHUNK_TYPE_FILL:
+        ret = -EINVAL;
+        if (chunk_data_size == sizeof(uint32_t)) {
+            phase = stats_enter(SPARSE_STATS_PHASE_PAD);
+            ret = stream_fill_chunk(st, len);
+            stats_leave(phase);
+        }
+        if (ret < 0) {
+            verbose_error(st->verbose, ret, "fill block at %" PRId64, offset);
+            return ret;
+        }
+        return chunk_header->chunk_sz;
+    case CHUNK_TYPE_DONT_CARE:
+        ret = -EINVAL;
+        if (chunk_data_size == 0) {
+            phase = stats_enter(SPARSE_STATS_PHASE_PAD);
+            ret = stream_skip_chunk(st, len);
+            stats_leave(phase);
+        }
+        if (ret < 0) {
+            verbose_error(st->verbose, ret, "skip block at %" PRId64, offset);
+            return ret;
+        }
+        return chunk_header->chunk_sz;
+    case CHUNK_TYPE_CRC32:
+        ret = -EINVAL;
+        if (chunk_data_size == sizeof(uint32_t)) {
+            ret = stream_crc32_chunk(st);
+        }
+        if (ret < 0) {
+            verbose_error(st->verbose, ret, "crc block at %" PRId64, offset);
+            return ret;
+        }
+        return 0;
+    default:
+        verbose_error(st->verbose, -EINVAL, "unknown block %04X at %" PRId64,
+                      chunk_header->chunk_type, offset);
+        ret = stream_discard(st, chunk_data_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int sparse_file_stream(int fd, bool verbose, bool crc,
+                       int (*write) (void *priv, const void *data, int len), void *priv)
+{
+    int ret;
+    unsigned int i;
+    sparse_header_t sparse_header;
+    chunk_header_t chunk_header;
+    uint32_t crc32 = 0;
+    unsigned int cur_block = 0;
+    int64_t offset;
+    int phase;
+    struct sparse_stream st = {
+        .fd = fd,
+        .verbose = verbose,
+        .crc32 = crc ? &crc32 : NULL,
+        .write = write,
+        .priv = priv,
+    };
+
+    ret = read_all(fd, &sparse_header, sizeof(sparse_header));
+    if (ret < 0) {
+        verbose_error(verbose, ret, "header");
+        return ret;
+    }
+
+    if (sparse_header.magic != SPARSE_HEADER_MAGIC) {
+        verbose_error(verbose, -EINVAL, "header magic");
+        return -EINVAL;
+    }
+
+    if (sparse_header.major_version != SPARSE_HEADER_MAJOR_VER) {
+        verbose_error(verbose, -EINVAL, "header major version");
+        return -EINVAL;
+    }
+
+    if (sparse_header.file_hdr_sz < SPARSE_HEADER_LEN ||
+        sparse_header.chunk_hdr_sz < CHUNK_HEADER_LEN) {
+        verbose_error(verbose, -EINVAL, "header size");
+        return -EINVAL;
+    }
+
+    if (sparse_header.blk_sz == 0 || sparse_header.blk_sz % 4 != 0) {
+        verbose_error(verbose, -EINVAL, "block size");
+        return -EINVAL;
+    }
+    st.block_size = sparse_header.blk_sz;
+
+    st.buf = malloc(STREAM_BUF_SIZE);
+    if (!st.buf) {
+        verbose_error(verbose, -ENOMEM, NULL);
+        return -ENOMEM;
+    }
+
+    phase = stats_enter(SPARSE_STATS_PHASE_HEADER);
+
+    ret = stream_discard(&st, sparse_header.file_hdr_sz - SPARSE_HEADER_LEN);
+    if (ret < 0) {
+        goto out;
+    }
+    offset = sparse_header.file_hdr_sz;
+
+    for (i = 0; i < sparse_header.total_chunks; i++) {
+        ret = read_all(fd, &chunk_header, sizeof(chunk_header));
+        if (ret >= 0) {
+            ret = stream_discard(&st, sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN);
+        }
+        if (ret < 0) {
+            verbose_error(verbose, ret, "chunk header at %" PRId64, offset);
+            goto out;
+        }
+        offset += sparse_header.chunk_hdr_sz;
+
+        ret = stream_chunk(&st, &chunk_header, sparse_header.chunk_hdr_sz, offset);
+        if (ret < 0) {
+            goto out;
+        }
+
+        cur_block += ret;
+        offset += chunk_header.total_sz - sparse_header.chunk_hdr_sz;
+    }
+
+    ret = 0;
+    if (sparse_header.total_blks != cur_block) {
+        verbose_error(verbose, -EINVAL, "block count");
+        ret = -EINVAL;
+    }
+
+out:
+    stats_leave(phase);
+    free(st.buf);
+    return ret;
+}
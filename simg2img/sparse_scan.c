@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sparse_scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static bool uniform_scalar(const uint32_t *buf, unsigned int words)
+{
+    unsigned int i;
+
+    for (i = 1; i < words; i++) {
+        if (buf[0] != buf[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static bool uniform_sse2(const uint32_t *buf, unsigned int words)
+{
+    __m128i val = _mm_set1_epi32(buf[0]);
+    __m128i eq;
+    unsigned int i;
+
+    for (i = 0; i + 16 <= words; i += 16) {
+        eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + i)), val),
+                          _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + i + 4)), val)),
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + i + 8)), val),
+                          _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + i + 12)), val)));
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            return false;
+        }
+    }
+
+    for (; i < words; i++) {
+        if (buf[0] != buf[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool uniform_avx2(const uint32_t *buf, unsigned int words)
+{
+    __m256i val = _mm256_set1_epi32(buf[0]);
+    __m256i diff;
+    unsigned int i;
+
+    for (i = 0; i + 32 <= words; i += 32) {
+        diff = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i)), val),
+                _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 8)), val)),
+            _mm256_or_si256(
+                _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 16)), val),
+                _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 24)), val)));
+        if (!_mm256_testz_si256(diff, diff)) {
+            return false;
+        }
+    }
+
+    for (; i < words; i++) {
+        if (buf[0] != buf[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+static bool (*uniform_impl) (const uint32_t *, unsigned int) = uniform_scalar;
+static pthread_once_t uniform_once = PTHREAD_ONCE_INIT;
+
+static void uniform_init(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        uniform_impl = uniform_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        uniform_impl = uniform_sse2;
+    }
+#endif
+}
+
+bool sparse_scan_uniform(const void *buf, unsigned int len, uint32_t *val)
+{
+    const uint32_t *words = buf;
+
+    pthread_once(&uniform_once, uniform_init);
+
+    if (!uniform_impl(words, len / sizeof(uint32_t))) {
+        return false;
+    }
+
+    *val = words[0];
+    return true;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_SCAN_H_
+#define _LIBSPARSE_SPARSE_SCAN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Returns true if the len bytes at buf are a single 32 bit value repeated,
+ * and stores that value in *val.  buf must be 4 byte aligned and len a
+ * non-zero multiple of 4.  Uses SSE2 or AVX2 when the CPU supports them.
+ */
+bool sparse_scan_uniform(const void *buf, unsigned int len, uint32_t *val);
+
+#endif
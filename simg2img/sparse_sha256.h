@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_SHA256_H_
+#define _LIBSPARSE_SPARSE_SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPARSE_SHA256_BLOCK_SIZE 64
+
+typedef struct sparse_sha256_ctx {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buf[SPARSE_SHA256_BLOCK_SIZE];
+} sparse_sha256_ctx;
+
+void sparse_sha256_init(sparse_sha256_ctx * ctx);
+void sparse_sha256_update(sparse_sha256_ctx * ctx, const void *data, size_t len);
+/* Writes SPARSE_SHA256_DIGEST_SIZE bytes to digest */
+void sparse_sha256_final(sparse_sha256_ctx * ctx, uint8_t * digest);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_stats.h"
+
+__thread struct sparse_stats *sparse_thread_stats;
+
+/* Phase the calling thread is in, or -1, and when it entered it */
+static __thread int thread_phase = -1;
+static __thread uint64_t thread_phase_start;
+
+static const char *chunk_names[SPARSE_STATS_CHUNK_TYPES] = {
+    [SPARSE_STATS_CHUNK_RAW] = "raw",
+    [SPARSE_STATS_CHUNK_FILL] = "fill",
+    [SPARSE_STATS_CHUNK_DONT_CARE] = "dont_care",
+    [SPARSE_STATS_CHUNK_CRC32] = "crc32",
+};
+
+static const char *phase_names[SPARSE_STATS_PHASES] = {
+    [SPARSE_STATS_PHASE_HEADER] = "header",
+    [SPARSE_STATS_PHASE_CRC] = "crc",
+    [SPARSE_STATS_PHASE_IO] = "payload i/o",
+    [SPARSE_STATS_PHASE_PAD] = "padding",
+    [SPARSE_STATS_PHASE_SCAN] = "scan",
+    [SPARSE_STATS_PHASE_SPLIT] = "resparse",
+};
+
+static uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Charges the time since the last change to the current phase */
+static void stats_switch(int phase)
+{
+    uint64_t now = stats_now();
+
+    if (thread_phase >= 0) {
+        stats_add(phase_ns[thread_phase], now - thread_phase_start);
+    }
+    thread_phase = phase;
+    thread_phase_start = now;
+}
+
+int sparse_stats_enter(enum sparse_stats_phase phase)
+{
+    int prev = thread_phase;
+
+    stats_switch(phase);
+    return prev;
+}
+
+void sparse_stats_leave(int prev)
+{
+    stats_switch(prev);
+}
+
+void sparse_set_stats(struct sparse_stats *stats)
+{
+    sparse_thread_stats = stats;
+    thread_phase = -1;
+}
+
+void sparse_stats_print(const struct sparse_stats *stats)
+{
+    int i;
+
+    fprintf(stderr, "%-12s %12s %12s\n", "chunks", "read", "written");
+    for (i = 0; i < SPARSE_STATS_CHUNK_TYPES; i++) {
+        fprintf(stderr, "%-12s %12llu %12llu\n", chunk_names[i],
+                (unsigned long long)stats->chunks_read[i],
+                (unsigned long long)stats->chunks_written[i]);
+    }
+
+    fprintf(stderr, "read %llu bytes in %llu calls, wrote %llu bytes in %llu calls\n",
+            (unsigned long long)stats->bytes_read, (unsigned long long)stats->read_calls,
+            (unsigned long long)stats->bytes_written, (unsigned long long)stats->write_calls);
+    fprintf(stderr, "%llu seeks, %llu other calls\n", (unsigned long long)stats->seek_calls,
+            (unsigned long long)stats->other_calls);
+
+    fprintf(stderr, "%-12s %12s\n", "phase", "ms");
+    for (i = 0; i < SPARSE_STATS_PHASES; i++) {
+        fprintf(stderr, "%-12s %12.3f\n", phase_names[i], stats->phase_ns[i] / 1000000.0);
+    }
+}
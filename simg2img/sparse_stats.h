@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_STATS_H_
+#define _LIBSPARSE_SPARSE_STATS_H_
+
+#include <sparse/sparse.h>
+
+/* Stats the calling thread counts into, NULL when they are off */
+extern __thread struct sparse_stats *sparse_thread_stats;
+
+/*
+ * Adds n to a counter of the calling thread's stats.  Workers of one call
+ * share the caller's stats, so counters are only ever added to atomically.
+ * When stats are off this is a single test of a thread local.
+ */
+#define stats_add(field, n) \
+	do { \
+		if (sparse_thread_stats) \
+			__atomic_fetch_add(&sparse_thread_stats->field, (uint64_t) (n), \
+					   __ATOMIC_RELAXED); \
+	} while (0)
+
+int sparse_stats_enter(enum sparse_stats_phase phase);
+void sparse_stats_leave(int prev);
+
+/*
+ * Time between stats_enter and the matching stats_leave is charged to phase,
+ * except for time in phases entered in between, which is charged to those.
+ * stats_enter returns what stats_leave needs to go back to the outer phase.
+ */
+#define stats_enter(phase) (sparse_thread_stats ? sparse_stats_enter(phase) : -1)
+#define stats_leave(prev) \
+	do { \
+		if (sparse_thread_stats) \
+			sparse_stats_leave(prev); \
+	} while (0)
+
+#endif
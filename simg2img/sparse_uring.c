@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output_file.h"
+#include "sparse_defs.h"
+#include "sparse_stats.h"
+#include "sparse_uring.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_OP_WRITE needs Linux 5.6, which also added IORING_FEAT_RW_CUR_POS */
+#ifdef IORING_FEAT_RW_CUR_POS
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+#define max(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a > _b) ? _a : _b; })
+
+#define NO_BUF UINT_MAX
+
+struct uring_buf {
+    char *data;
+    size_t len;
+    int64_t offset;
+    unsigned int next;          /* next free buffer */
+};
+
+struct sparse_uring {
+    int ring_fd;
+    int fd;
+    unsigned int depth;
+    /* Buffers are registered, so writes can use IORING_OP_WRITE_FIXED */
+    bool fixed;
+
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *mem;
+    struct uring_buf *bufs;
+    unsigned int free_buf;      /* first free buffer */
+    unsigned int cur;           /* buffer being filled */
+    unsigned int in_flight;
+    /* First failed write, reported by every later call */
+    int err;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags)
+{
+    stats_add(write_calls, 1);
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static int uring_map(struct sparse_uring *ring, struct io_uring_params *p)
+{
+    ring->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    ring->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_map_len = max(ring->sq_map_len, ring->cq_map_len);
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        return -errno;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            return -errno;
+        }
+    }
+
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -errno;
+    }
+
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_map + p->sq_off.tail);
+    ring->sq_mask = *(unsigned int *)((char *)ring->sq_map + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_map + p->sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_map + p->cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_map + p->cq_off.tail);
+    ring->cq_mask = *(unsigned int *)((char *)ring->cq_map + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + p->cq_off.cqes);
+
+    return 0;
+}
+
+/* Allocates the write buffers and registers them if the memlock limit allows */
+static int uring_alloc_bufs(struct sparse_uring *ring)
+{
+    struct iovec *iov;
+    unsigned int i;
+
+    ring->bufs = calloc(ring->depth, sizeof(*ring->bufs));
+    iov = calloc(ring->depth, sizeof(*iov));
+    if (!ring->bufs || !iov ||
+        posix_memalign((void **)&ring->mem, 4096, (size_t)ring->depth * SPARSE_URING_BUF_SIZE)) {
+        ring->mem = NULL;
+        free(iov);
+        return -ENOMEM;
+    }
+
+    ring->free_buf = NO_BUF;
+    for (i = ring->depth; i-- > 0;) {
+        ring->bufs[i].data = ring->mem + (size_t)i * SPARSE_URING_BUF_SIZE;
+        ring->bufs[i].next = ring->free_buf;
+        ring->free_buf = i;
+        iov[i].iov_base = ring->bufs[i].data;
+        iov[i].iov_len = SPARSE_URING_BUF_SIZE;
+    }
+
+    ring->fixed = uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, ring->depth) == 0;
+    free(iov);
+
+    return 0;
+}
+
+struct sparse_uring *sparse_uring_new(int fd, unsigned int depth)
+{
+    struct io_uring_params p;
+    struct sparse_uring *ring;
+
+    if (depth == 0) {
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->depth = min(depth, SPARSE_URING_MAX_DEPTH);
+    ring->cur = NO_BUF;
+
+    memset(&p, 0, sizeof(p));
+    ring->ring_fd = uring_setup(ring->depth, &p);
+    if (ring->ring_fd < 0 || !(p.features & IORING_FEAT_RW_CUR_POS) ||
+        uring_map(ring, &p) < 0 || uring_alloc_bufs(ring) < 0) {
+        sparse_uring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/* Waits for at least one completion and handles all that have arrived */
+static int uring_reap(struct sparse_uring *ring)
+{
+    struct io_uring_cqe *cqe;
+    struct uring_buf *buf;
+    unsigned int head = *ring->cq_head;
+    int ret;
+
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        ret = uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+            ret = -errno;
+            error_errno("io_uring_enter");
+            return ret;
+        }
+    }
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        buf = &ring->bufs[cqe->user_data];
+
+        if (cqe->res > 0) {
+            stats_add(bytes_written, cqe->res);
+        }
+
+        if (cqe->res < 0) {
+            if (!ring->err) {
+                error("write: %s", strerror(-cqe->res));
+                ring->err = cqe->res;
+            }
+        } else if ((size_t)cqe->res < buf->len && !ring->err) {
+            /* Finish a short write synchronously */
+            ret = pwrite_all(ring->fd, buf->data + cqe->res, buf->len - cqe->res,
+                             buf->offset + cqe->res);
+            if (ret < 0) {
+                error("pwrite: %s", strerror(-ret));
+                ring->err = ret;
+            }
+        }
+
+        buf->next = ring->free_buf;
+        ring->free_buf = buf - ring->bufs;
+        ring->in_flight--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Submits the buffer being filled */
+static int uring_submit(struct sparse_uring *ring)
+{
+    struct uring_buf *buf = &ring->bufs[ring->cur];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int idx = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    int ret;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = ring->fd;
+    sqe->addr = (uintptr_t)buf->data;
+    sqe->len = buf->len;
+    sqe->off = buf->offset;
+    sqe->buf_index = ring->fixed ? ring->cur : 0;
+    sqe->user_data = ring->cur;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        ret = uring_enter(ring->ring_fd, 1, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        /* Nothing was consumed, take the entry back */
+        ring->err = -errno;
+        error_errno("io_uring_enter");
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        return ring->err;
+    }
+
+    ring->cur = NO_BUF;
+    ring->in_flight++;
+
+    return 0;
+}
+
+int sparse_uring_write(struct sparse_uring *ring, const void *data, size_t len, int64_t offset)
+{
+    struct uring_buf *buf;
+    size_t n;
+    int ret;
+
+    if (ring->err) {
+        return ring->err;
+    }
+
+    if (ring->cur != NO_BUF) {
+        buf = &ring->bufs[ring->cur];
+        if (buf->offset + (int64_t)buf->len != offset) {
+            ret = uring_submit(ring);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    while (len > 0) {
+        if (ring->cur == NO_BUF) {
+            while (ring->free_buf == NO_BUF) {
+                ret = uring_reap(ring);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            ring->cur = ring->free_buf;
+            buf = &ring->bufs[ring->cur];
+            ring->free_buf = buf->next;
+            buf->len = 0;
+            buf->offset = offset;
+        }
+
+        buf = &ring->bufs[ring->cur];
+        n = min(len, SPARSE_URING_BUF_SIZE - buf->len);
+        memcpy(buf->data + buf->len, data, n);
+        buf->len += n;
+        data = (const char *)data + n;
+        len -= n;
+        offset += n;
+
+        if (buf->len == SPARSE_URING_BUF_SIZE) {
+            ret = uring_submit(ring);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return ring->err;
+}
+
+/* Waits for the writes already submitted */
+static int uring_drain(struct sparse_uring *ring)
+{
+    int ret;
+
+    while (ring->in_flight > 0) {
+        ret = uring_reap(ring);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int sparse_uring_wait(struct sparse_uring *ring)
+{
+    int ret;
+
+    if (ring->cur != NO_BUF && !ring->err) {
+        ret = uring_submit(ring);
+        if (ret < 0) {
+            uring_drain(ring);
+            return ret;
+        }
+    }
+
+    ret = uring_drain(ring);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return ring->err;
+}
+
+void sparse_uring_destroy(struct sparse_uring *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    /* The kernel may still be reading from the buffers */
+    if (ring->ring_fd >= 0 && ring->in_flight > 0) {
+        uring_drain(ring);
+    }
+
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+    free(ring->mem);
+    free(ring->bufs);
+    free(ring);
+}
+
+#else
+
+struct sparse_uring *sparse_uring_new(int fd __unused, unsigned int depth __unused)
+{
+    return NULL;
+}
+
+int sparse_uring_write(struct sparse_uring *ring __unused, const void *data __unused,
+                       size_t len __unused, int64_t offset __unused)
+{
+    return -EOPNOTSUPP;
+}
+
+int sparse_uring_wait(struct sparse_uring *ring __unused)
+{
+    return -EOPNOTSUPP;
+}
+
+void sparse_uring_destroy(struct sparse_uring *ring __unused)
+{
+}
+
+#endif
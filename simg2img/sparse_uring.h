@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026 The Android_IMG_Tools_Cygwin Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_URING_H_
+#define _LIBSPARSE_SPARSE_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes gathered into each buffer before it is submitted */
+#define SPARSE_URING_BUF_SIZE (256U * 1024U)
+#define SPARSE_URING_MAX_DEPTH 256U
+
+struct sparse_uring;
+
+/*
+ * Sets up an io_uring writing to fd with up to depth buffers in flight.  The
+ * buffers are registered with the kernel when the memlock limit allows it.
+ * Returns NULL if io_uring is not available, in which case the caller writes
+ * synchronously instead.
+ */
+struct sparse_uring *sparse_uring_new(int fd, unsigned int depth);
+
+/*
+ * Queues a write of len bytes of data at offset.  data is copied, so it can be
+ * reused as soon as this returns.  Writes that continue the previous one are
+ * gathered into the same buffer.  Returns a negative errno if this or any
+ * earlier write failed.
+ */
+int sparse_uring_write(struct sparse_uring *ring, const void *data, size_t len, int64_t offset);
+
+/* Submits anything still buffered and waits for every write to complete */
+int sparse_uring_wait(struct sparse_uring *ring);
+
+void sparse_uring_destroy(struct sparse_uring *ring);
+
+#endif